@@ -0,0 +1,482 @@
+#include "../src/lmlisp.hpp"
+#include "../src/printer.hpp"
+#include "../src/reader.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Benchmark suite for the interpreter hot paths. Every case is warmed up,
+// then timed for a number of repetitions; the results are written as JSON
+// so runs of different versions can be compared.
+//
+// usage: bench [--filter SUBSTR] [--warmup N] [--reps N] [--out FILE]
+//              [--engine tree|closures] [--jit on|off]
+
+//**************************************************************************
+//
+//                           ALLOCATION COUNTER
+//
+//**************************************************************************
+
+static std::atomic<unsigned long> allocations = 0;
+
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size == 0 ? 1 : size))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+//**************************************************************************
+//
+//                               EXTERNALS
+//
+//**************************************************************************
+
+// stdout is reserved for the report
+std::string lmlisp::readln(std::string prompt) {
+  std::cerr << prompt;
+  std::string ret;
+  std::getline(std::cin, ret);
+  return ret;
+}
+
+void lmlisp::writeln(std::string line) { std::cerr << line << std::endl; }
+
+//**************************************************************************
+//
+//                                HARNESS
+//
+//**************************************************************************
+
+struct Case {
+  std::string name;
+  std::string group;
+  std::function<void()> setup;
+  std::function<std::string()> run;
+  std::string expect;      // result of run(), checked once after setup
+  unsigned long bytes = 0; // input size for throughput cases
+};
+
+struct Result {
+  std::string name;
+  std::string group;
+  std::vector<double> times_ns;
+  unsigned long allocations;
+  unsigned long bytes;
+};
+
+static double percentile(std::vector<double> sorted, double p) {
+  unsigned int rank = p * sorted.size();
+  if (rank >= sorted.size())
+    rank = sorted.size() - 1;
+  return sorted[rank];
+}
+
+static Result measure(const Case &c, unsigned int warmup, unsigned int reps) {
+  using namespace std::chrono;
+  Result r{c.name, c.group, {}, 0, c.bytes};
+  for (unsigned int i = 0; i < warmup; i++)
+    c.run();
+  unsigned long allocs_before = allocations.load();
+  for (unsigned int i = 0; i < reps; i++) {
+    auto start = steady_clock::now();
+    c.run();
+    r.times_ns.push_back(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count());
+  }
+  r.allocations = (allocations.load() - allocs_before) / reps;
+  std::sort(r.times_ns.begin(), r.times_ns.end());
+  return r;
+}
+
+static std::string json(const std::vector<Result> &results,
+                        const std::string &engine, bool jit,
+                        unsigned int warmup, unsigned int reps) {
+  std::ostringstream out;
+  out << "{\n  \"suite\": \"lmlisp\",\n  \"build_type\": \""
+      << LMLISP_BUILD_TYPE << "\",\n  \"engine\": \"" << engine
+      << "\",\n  \"jit\": " << (jit ? "true" : "false")
+      << ",\n  \"warmup\": " << warmup
+      << ",\n  \"repetitions\": " << reps << ",\n  \"benchmarks\": [";
+  for (unsigned int i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    double median = percentile(r.times_ns, 0.5);
+    out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << r.name
+        << "\", \"group\": \"" << r.group << "\", \"median_ns\": " << median
+        << ", \"p99_ns\": " << percentile(r.times_ns, 0.99)
+        << ", \"min_ns\": " << r.times_ns.front()
+        << ", \"max_ns\": " << r.times_ns.back()
+        << ", \"allocations\": " << r.allocations;
+    if (r.bytes > 0)
+      out << ", \"bytes\": " << r.bytes
+          << ", \"mb_per_s\": " << (r.bytes / 1e6) / (median / 1e9);
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+  return out.str();
+}
+
+//**************************************************************************
+//
+//                                 CASES
+//
+//**************************************************************************
+
+static std::string numbers_vector(unsigned int n) {
+  std::string ret = "[";
+  for (unsigned int i = 0; i < n; i++)
+    ret += std::to_string(i) + (i + 1 < n ? " " : "");
+  return ret + "]";
+}
+
+static std::string large_source(unsigned int n) {
+  std::string ret;
+  for (unsigned int i = 0; i < n; i++) {
+    std::string id = std::to_string(i);
+    ret += "(def! f" + id + " (fn* (x y) (let* (z (+ x y " + id +
+           ")) (if (> z 10) {:key \"value " + id + "\" :n [1 2 z]} (list "
+           "'quoted x y)))))\n";
+  }
+  return ret;
+}
+
+static std::string large_json(unsigned int n) {
+  std::string ret = "[";
+  for (unsigned int i = 0; i < n; i++) {
+    std::string id = std::to_string(i);
+    ret += (i > 0 ? ",\n" : "") + std::string("{\"id\": ") + id +
+           ", \"name\": \"user " + id +
+           "\", \"score\": 5, \"tags\": [\"a\", \"b\"], "
+           "\"active\": true}";
+  }
+  return ret + "]";
+}
+
+static std::string large_csv(unsigned int n) {
+  std::string ret = "id,name,score\n";
+  for (unsigned int i = 0; i < n; i++)
+    ret += std::to_string(i) + ",user " + std::to_string(i % 100) + ",0.5\n";
+  return ret;
+}
+
+// The files the load and formats cases read, kept out of the working
+// directory and removed when the run ends
+static std::string scratch_path(const char *name) {
+  return (std::filesystem::temp_directory_path() / name).generic_string();
+}
+
+static const std::string load_path = scratch_path("lmlisp_bench_load.mal");
+static const std::string json_path = scratch_path("lmlisp_bench_data.json");
+static const std::string csv_path = scratch_path("lmlisp_bench_data.csv");
+
+static std::vector<Case> cases(lmlisp::Runtime &r) {
+  std::vector<Case> ret;
+  auto rep = [&r](std::string expr) {
+    return [&r, expr]() { return r.rep(expr); };
+  };
+
+  // READER / PRINTER
+  static std::string source = "(do " + large_source(500) + " nil)";
+  ret.push_back({"read-large-form", "reader", [] {},
+                 [] {
+                   lmlisp::read_str(source);
+                   return std::string();
+                 },
+                 "", source.size()});
+
+  static lmlisp::ElementP data = lmlisp::read_str(source);
+  static std::string printed = lmlisp::pr_str(data, true);
+  ret.push_back({"print-large-form", "printer", [] {},
+                 [] {
+                   lmlisp::pr_str(data, true);
+                   return std::string();
+                 },
+                 "", printed.size()});
+
+  // EVAL
+  ret.push_back({"fib-17", "eval",
+                 [&r] {
+                   r.rep("(def! fib (fn* (n) (if (< n 2) n (+ (fib (- n 1)) "
+                         "(fib (- n 2))))))");
+                 },
+                 rep("(fib 17)"), "1597"});
+
+  ret.push_back({"tak-12-8-4", "eval",
+                 [&r] {
+                   r.rep("(def! tak (fn* (x y z) (if (not (< y x)) z (tak "
+                         "(tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x "
+                         "y)))))");
+                 },
+                 rep("(tak 12 8 4)"), "5"});
+
+  ret.push_back({"let-loop-2000", "eval",
+                 [&r] {
+                   r.rep("(def! let-loop (fn* (n acc) (if (= n 0) acc (let* "
+                         "(m (- n 1) a (+ acc 2)) (let-loop m a)))))");
+                 },
+                 rep("(let-loop 2000 0)"), "4000"});
+
+  ret.push_back({"loop-recur-2000", "eval", [] {},
+                 rep("(loop [n 2000 acc 0] (if (= n 0) acc (recur (- n 1) "
+                     "(+ acc 2))))"),
+                 "4000"});
+
+  ret.push_back({"closure-creation-2000", "eval",
+                 [&r] {
+                   r.rep("(def! make-closures (fn* (n acc) (if (= n 0) acc "
+                         "(make-closures (- n 1) ((fn* (x) (+ x acc)) 1)))))");
+                 },
+                 rep("(make-closures 2000 0)"), "2000"});
+
+  ret.push_back({"multi-arity-2000", "eval",
+                 [&r] {
+                   r.rep("(def! count-down (fn* ([n] (count-down n 0)) ([n "
+                         "acc] (if (= n 0) acc (count-down (- n 1) (+ acc "
+                         "2))))))");
+                 },
+                 rep("(count-down 2000)"), "4000"});
+
+  // the let* binding shadows the global and must call itself
+  ret.push_back({"let-recursion-2000", "eval",
+                 [&r] { r.rep("(def! let-rec (fn* (n) 100))"); },
+                 rep("(let* (let-rec (fn* (n) (if (= n 0) 0 (let-rec (- n "
+                     "1))))) (let-rec 2000))"),
+                 "0"});
+
+  // closures made before a macro they call is rebound see the new binding
+  ret.push_back({"closure-macro-rebound-2000", "eval",
+                 [&r] {
+                   r.rep("(defmacro! rebound (fn* (a) 1))");
+                   r.rep("(def! make-rebound (fn* (x) (fn* () (rebound x))))");
+                   r.rep("((make-rebound 5))");
+                   r.rep("(def! rebound (fn* (a) a))");
+                 },
+                 rep("(reduce + 0 (map (fn* (i) ((make-rebound i))) (range "
+                     "2000)))"),
+                 "1999000"});
+
+  ret.push_back({"macro-heavy-1000", "eval",
+                 [&r] {
+                   r.rep("(defmacro! unless (fn* (c a b) (list 'if c b a)))");
+                   r.rep("(def! macro-loop (fn* (n acc) (cond (= n 0) acc "
+                         "(< n 0) 0 true (unless (= n 1) (macro-loop (- n 1) "
+                         "(+ acc 1)) (+ acc 1)))))");
+                 },
+                 rep("(macro-loop 1000 0)"), "1000"});
+
+  // DATA STRUCTURES
+  ret.push_back({"conj-vector-1000", "data",
+                 [&r] {
+                   r.rep("(def! conj-loop (fn* (v n) (if (= n 0) (count v) "
+                         "(conj-loop (conj v n) (- n 1)))))");
+                 },
+                 rep("(conj-loop [] 1000)"), "1000"});
+
+  ret.push_back({"assoc-dict-500", "data",
+                 [&r] {
+                   r.rep("(def! assoc-loop (fn* (d n) (if (= n 0) (count "
+                         "(keys d)) (assoc-loop (assoc d (keyword (str \"k\" "
+                         "n)) n) (- n 1)))))");
+                 },
+                 rep("(assoc-loop {} 500)"), "500"});
+
+  ret.push_back({"keyword-get-5000", "data",
+                 [&r] {
+                   r.rep("(def! bench-record {:id 1 :name \"x\" :score 2 "
+                         ":tags [] :active true})");
+                 },
+                 rep("(loop [n 5000 acc 0] (if (= n 0) acc (recur (- n 1) (+ "
+                     "acc (get bench-record :score)))))"),
+                 "10000"});
+
+  ret.push_back({"nth-vector-5000", "data",
+                 [&r] {
+                   r.rep("(def! big-vector " + numbers_vector(5000) + ")");
+                   r.rep("(def! nth-loop (fn* (v i acc) (if (< i 0) acc "
+                         "(nth-loop v (- i 1) (+ acc (nth v i))))))");
+                 },
+                 rep("(nth-loop big-vector 4999 0)"), "12497500"});
+
+  ret.push_back({"fold-vector-5000", "data",
+                 [&r] {
+                   r.rep("(def! fold-vector " + numbers_vector(5000) + ")");
+                 },
+                 rep("(fold + (fn* (acc x) (+ acc x)) fold-vector)"),
+                 "12497500"});
+
+  ret.push_back({"sort-by-5000", "data",
+                 [&r] {
+                   r.rep("(def! sort-vector " + numbers_vector(5000) + ")");
+                 },
+                 rep("(first (sort-by (fn* (x) (- 0 x)) sort-vector))"),
+                 "4999"});
+
+  ret.push_back({"array-kernels-10000", "data",
+                 [&r] {
+                   r.rep("(def! bench-array (long-array (range 10000)))");
+                 },
+                 rep("(asum (amap+ (a* bench-array 2) 1))"), "100000000"});
+
+  ret.push_back({"table-group-by-10000", "data",
+                 [&r] {
+                   r.rep("(def! bench-table (table {:k (map (fn* (x) (if (> x "
+                         "4999) :hi :lo)) (range 10000)) :v (range 10000)}))");
+                 },
+                 rep("(count (group-by (where bench-table :v :> 99) :k {:n "
+                     "[:count] :s [:sum :v]}))"),
+                 "2"});
+
+  ret.push_back({"subs-long-string-5000", "data",
+                 [&r] {
+                   r.rep("(def! bench-line \"" + std::string(400, 'x') +
+                         "\")");
+                 },
+                 rep("(count (map (fn* (i) (subs bench-line 10 300)) (range "
+                     "5000)))"),
+                 "5000"});
+
+  ret.push_back({"str-accumulate-5000", "data", [] {},
+                 rep("(count (loop [n 5000 acc \"\"] (if (= n 0) acc (recur "
+                     "(- n 1) (str acc \"line \" n \"\\n\")))))"),
+                 "48893"});
+
+  ret.push_back({"string-builder-5000", "data", [] {},
+                 rep("(let* [sb (string-builder)] (loop [n 5000] (if (= n 0) "
+                     "(count (sb->str sb)) (do (sb-append! sb \"line \" n "
+                     "\"\\n\") (recur (- n 1))))))"),
+                 "48893"});
+
+  ret.push_back({"lazy-pipeline-5000", "data", [] {},
+                 rep("(count (filter (fn* (x) (> x 5)) (map (fn* (x) (+ x 1)) "
+                     "(take 5000 (range)))))"),
+                 "4995"});
+
+  ret.push_back({"transduce-pipeline-5000", "data", [] {},
+                 rep("(transduce (comp (map (fn* (x) (+ x 1))) (filter (fn* "
+                     "(x) (> x 5)))) + 0 (range 5000))"),
+                 "12502485"});
+
+  // LOAD-FILE
+  ret.push_back({"load-file-2000-defs", "load",
+                 [] {
+                   std::ofstream ofs(load_path);
+                   ofs << large_source(2000);
+                 },
+                 rep("(load-file \"" + load_path + "\")"), "nil",
+                 large_source(2000).size()});
+
+  // SANDBOX
+  ret.push_back({"fork-sandbox-1000", "sandbox", [] {},
+                 [&r] {
+                   unsigned int done = 0;
+                   for (unsigned int i = 0; i < 1000; i++) {
+                     lmlisp::Sandbox s = r.fork();
+                     if (s.rep("(do (def! x (not false)) x)") == "true")
+                       done++;
+                   }
+                   return std::to_string(done);
+                 },
+                 "1000"});
+
+  // FORMATS
+  ret.push_back({"read-json-file-5000", "formats",
+                 [] {
+                   std::ofstream ofs(json_path);
+                   ofs << large_json(5000);
+                 },
+                 rep("(count (read-json-file \"" + json_path + "\"))"), "5000",
+                 large_json(5000).size()});
+
+  ret.push_back({"read-csv-file-20000", "formats",
+                 [] {
+                   std::ofstream ofs(csv_path);
+                   ofs << large_csv(20000);
+                 },
+                 rep("(count (read-csv-file \"" + csv_path + "\"))"), "20000",
+                 large_csv(20000).size()});
+
+  return ret;
+}
+
+//**************************************************************************
+//
+//                                  MAIN
+//
+//**************************************************************************
+
+int main(int argc, char **argv) {
+  std::string filter, out_file, engine = "tree", jit = "on";
+  unsigned int warmup = 2, reps = 10;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string opt = argv[i];
+    if (opt == "--filter")
+      filter = argv[i + 1];
+    else if (opt == "--warmup")
+      warmup = std::stoi(argv[i + 1]);
+    else if (opt == "--reps")
+      reps = std::stoi(argv[i + 1]);
+    else if (opt == "--out")
+      out_file = argv[i + 1];
+    else if (opt == "--engine")
+      engine = argv[i + 1];
+    else if (opt == "--jit")
+      jit = argv[i + 1];
+    else {
+      std::cerr << "unknown option " << opt << std::endl;
+      return 1;
+    }
+  }
+  if (reps == 0)
+    reps = 1;
+
+  lmlisp::Runtime &r = lmlisp::init();
+  if (r.rep("(engine :" + engine + ")") != ":" + engine) {
+    std::cerr << "unknown engine " << engine << std::endl;
+    return 1;
+  }
+  if (jit != "on" and jit != "off") {
+    std::cerr << "--jit takes on or off" << std::endl;
+    return 1;
+  }
+  // a build without the JIT runs with it off
+  bool jit_on = r.rep(jit == "on" ? "(try* (jit true) (catch* e false))"
+                                  : "(jit false)") == "true";
+  std::vector<Result> results;
+  bool failed = false;
+  for (const Case &c : cases(r)) {
+    if (not filter.empty() and c.name.find(filter) == std::string::npos)
+      continue;
+    c.setup();
+    std::string got = c.run();
+    if (got != c.expect) {
+      std::cerr << c.name << ": expected " << c.expect << ", got " << got
+                << std::endl;
+      failed = true;
+      continue;
+    }
+    std::cerr << "running " << c.name << std::endl;
+    results.push_back(measure(c, warmup, reps));
+  }
+  for (const std::string *path : {&load_path, &json_path, &csv_path})
+    std::remove(path->c_str());
+
+  std::string report = json(results, engine, jit_on, warmup, reps);
+  if (out_file.empty())
+    std::cout << report;
+  else
+    std::ofstream(out_file) << report;
+  return failed ? 1 : 0;
+}
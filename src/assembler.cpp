@@ -0,0 +1,217 @@
+#include "assembler.hpp"
+#include <cassert>
+#include <cstring>
+#ifdef _LM_WITH_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace lmlisp {
+//**************************************************************************
+//
+//                                ASSEMBLER
+//
+//**************************************************************************
+
+Assembler::Label Assembler::new_label() {
+  labels.push_back(-1);
+  return labels.size() - 1;
+}
+
+void Assembler::bind(Label label) { labels[label] = code.size(); }
+
+std::size_t Assembler::size() const { return code.size(); }
+
+void Assembler::emit(std::initializer_list<std::uint8_t> bytes) {
+  code.insert(code.end(), bytes);
+}
+
+void Assembler::emit32(std::int32_t value) {
+  std::uint32_t v = value;
+  emit({std::uint8_t(v), std::uint8_t(v >> 8), std::uint8_t(v >> 16),
+        std::uint8_t(v >> 24)});
+}
+
+void Assembler::rel32(Label label) {
+  fixups.emplace_back(code.size(), label);
+  emit32(0);
+}
+
+void Assembler::push_rax() { emit({0x50}); }
+void Assembler::pop_rax() { emit({0x58}); }
+void Assembler::pop_rcx() { emit({0x59}); }
+void Assembler::push_callee_saved() { emit({0x53, 0x41, 0x54}); }
+void Assembler::pop_callee_saved() { emit({0x41, 0x5C, 0x5B}); }
+void Assembler::enter() { emit({0x55, 0x48, 0x89, 0xE5}); }
+void Assembler::leave() { emit({0x48, 0x89, 0xEC, 0x5D}); }
+
+std::size_t Assembler::reserve_stack() {
+  emit({0x48, 0x81, 0xEC});
+  std::size_t at = code.size();
+  emit32(0);
+  return at;
+}
+
+void Assembler::add_rsp(std::int32_t bytes) {
+  emit({0x48, 0x81, 0xC4});
+  emit32(bytes);
+}
+
+void Assembler::ret() { emit({0xC3}); }
+
+void Assembler::mov_eax(std::int32_t value) {
+  emit({0xB8});
+  emit32(value);
+}
+
+void Assembler::load_eax(std::int32_t disp) {
+  emit({0x8B, 0x85});
+  emit32(disp);
+}
+
+void Assembler::store_eax(std::int32_t disp) {
+  emit({0x89, 0x85});
+  emit32(disp);
+}
+
+void Assembler::load_eax_arg(std::int32_t disp) {
+  emit({0x8B, 0x87});
+  emit32(disp);
+}
+
+void Assembler::op_eax(Op op, std::int32_t value) {
+  switch (op) {
+  case Op::ADD:
+    emit({0x05});
+    break;
+  case Op::SUB:
+    emit({0x2D});
+    break;
+  case Op::IMUL:
+    emit({0x69, 0xC0});
+    break;
+  case Op::CMP:
+    emit({0x3D});
+    break;
+  }
+  emit32(value);
+}
+
+void Assembler::op_eax_local(Op op, std::int32_t disp) {
+  switch (op) {
+  case Op::ADD:
+    emit({0x03, 0x85});
+    break;
+  case Op::SUB:
+    emit({0x2B, 0x85});
+    break;
+  case Op::IMUL:
+    emit({0x0F, 0xAF, 0x85});
+    break;
+  case Op::CMP:
+    emit({0x3B, 0x85});
+    break;
+  }
+  emit32(disp);
+}
+
+void Assembler::op_ecx_eax(Op op) {
+  switch (op) {
+  case Op::ADD:
+    emit({0x01, 0xC8}); // add eax, ecx
+    break;
+  case Op::SUB:
+    emit({0x29, 0xC1, 0x89, 0xC8}); // sub ecx, eax; mov eax, ecx
+    break;
+  case Op::IMUL:
+    emit({0x0F, 0xAF, 0xC1}); // imul eax, ecx
+    break;
+  case Op::CMP:
+    emit({0x39, 0xC1}); // cmp ecx, eax
+    break;
+  }
+}
+
+void Assembler::set_budget(std::int32_t calls) {
+  emit({0x41, 0xBC});
+  emit32(calls);
+}
+
+void Assembler::dec_budget() { emit({0x41, 0xFF, 0xCC}); }
+void Assembler::inc_budget() { emit({0x41, 0xFF, 0xC4}); }
+void Assembler::clear_bail() { emit({0x31, 0xDB}); }
+void Assembler::set_bail() { emit({0xBB, 0x01, 0x00, 0x00, 0x00}); }
+void Assembler::test_bail() { emit({0x85, 0xDB}); }
+
+void Assembler::pack_result() {
+  // mov eax, eax; shl rbx, 32; or rax, rbx
+  emit({0x89, 0xC0, 0x48, 0xC1, 0xE3, 0x20, 0x48, 0x09, 0xD8});
+}
+
+void Assembler::jmp(Label label) {
+  emit({0xE9});
+  rel32(label);
+}
+
+void Assembler::jcc(Condition c, Label label) {
+  emit({0x0F, c});
+  rel32(label);
+}
+
+void Assembler::call(Label label) {
+  emit({0xE8});
+  rel32(label);
+}
+
+void Assembler::patch32(std::size_t at, std::int32_t value) {
+  std::uint32_t v = value;
+  for (unsigned int i = 0; i < 4; i++)
+    code[at + i] = std::uint8_t(v >> (8 * i));
+}
+
+std::vector<std::uint8_t> Assembler::finish() {
+  for (const auto &[at, label] : fixups) {
+    assert(labels[label] >= 0 && "PANIC: jump to an unbound label");
+    patch32(at, labels[label] - std::ptrdiff_t(at + 4));
+  }
+  fixups.clear();
+  return code;
+}
+
+//**************************************************************************
+//
+//                            EXECUTABLE MEMORY
+//
+//**************************************************************************
+
+#ifdef _LM_WITH_JIT
+Executable_Memory::Executable_Memory(const std::vector<std::uint8_t> &code) {
+  std::size_t page = sysconf(_SC_PAGESIZE);
+  std::size_t size = (code.size() + page - 1) / page * page;
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return;
+  std::memcpy(p, code.data(), code.size());
+  if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(p, size);
+    return;
+  }
+  memory = p;
+  mapped = size;
+  length = code.size();
+}
+
+Executable_Memory::~Executable_Memory() {
+  if (memory)
+    munmap(memory, mapped);
+}
+#else
+Executable_Memory::Executable_Memory(const std::vector<std::uint8_t> &) {}
+Executable_Memory::~Executable_Memory() {}
+#endif
+
+bool Executable_Memory::is_ready() const { return memory != nullptr; }
+const void *Executable_Memory::address() const { return memory; }
+std::size_t Executable_Memory::size() const { return length; }
+} // namespace lmlisp
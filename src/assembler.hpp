@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+namespace lmlisp {
+// X86-64 ASSEMBLER
+// The few instructions the JIT's templates are made of. Values are 32-bit
+// integers computed in eax, with ecx as scratch and locals addressed from
+// rbp; ebx and r12d hold the JIT's bail-out flag and call budget.
+class Assembler {
+public:
+  using Label = unsigned int;
+  // jcc opcodes; a condition xor 1 is its negation
+  enum Condition : std::uint8_t {
+    EQ = 0x84,
+    NE = 0x85,
+    LT = 0x8C,
+    GE = 0x8D,
+    LE = 0x8E,
+    GT = 0x8F
+  };
+  enum class Op { ADD, SUB, IMUL, CMP };
+
+  Label new_label();
+  void bind(Label label);
+  std::size_t size() const;
+
+  void push_rax();
+  void pop_rax();
+  void pop_rcx();
+  void push_callee_saved(); // rbx and r12
+  void pop_callee_saved();
+  void enter(); // push rbp; mov rbp, rsp
+  void leave(); // mov rsp, rbp; pop rbp
+  // sub rsp, imm32; returns where the immediate is, to patch it later
+  std::size_t reserve_stack();
+  void add_rsp(std::int32_t bytes);
+  void ret();
+
+  void mov_eax(std::int32_t value);
+  void load_eax(std::int32_t disp);  // mov eax, [rbp + disp]
+  void store_eax(std::int32_t disp); // mov [rbp + disp], eax
+  void load_eax_arg(std::int32_t disp); // mov eax, [rdi + disp]
+  void op_eax(Op op, std::int32_t value);       // eax = eax op value
+  void op_eax_local(Op op, std::int32_t disp);  // eax = eax op [rbp + disp]
+  void op_ecx_eax(Op op);                       // eax = ecx op eax
+
+  void set_budget(std::int32_t calls); // mov r12d, calls
+  void dec_budget();
+  void inc_budget();
+  void clear_bail(); // xor ebx, ebx
+  void set_bail();
+  void test_bail();
+  // rax = eax zero-extended, with the bail-out flag in bit 32
+  void pack_result();
+
+  void jmp(Label label);
+  void jcc(Condition c, Label label);
+  void call(Label label);
+
+  void patch32(std::size_t at, std::int32_t value);
+  // The code with every jump resolved; all labels used must be bound
+  std::vector<std::uint8_t> finish();
+
+private:
+  void emit(std::initializer_list<std::uint8_t> bytes);
+  void emit32(std::int32_t value);
+  void rel32(Label label);
+
+  std::vector<std::uint8_t> code;
+  std::vector<std::ptrdiff_t> labels; // offset, -1 while unbound
+  std::vector<std::pair<std::size_t, Label>> fixups;
+};
+
+// Machine code copied into pages of its own, which are writable while it
+// is copied in and executable afterwards, never both
+class Executable_Memory {
+public:
+  Executable_Memory(const std::vector<std::uint8_t> &code);
+  ~Executable_Memory();
+  Executable_Memory(const Executable_Memory &) = delete;
+  Executable_Memory &operator=(const Executable_Memory &) = delete;
+  bool is_ready() const;
+  const void *address() const;
+  std::size_t size() const;
+
+private:
+  void *memory = nullptr;
+  std::size_t mapped = 0;
+  std::size_t length = 0;
+};
+} // namespace lmlisp
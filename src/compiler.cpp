@@ -0,0 +1,775 @@
+#include "compiler.hpp"
+#include "jit.hpp"
+#include "macros.hpp"
+#include "printer.hpp"
+#include "profiler.hpp"
+#include "stats.hpp"
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+namespace lmlisp {
+//**************************************************************************
+//
+//                                  NODES
+//
+//**************************************************************************
+
+// The locals of the compiled calls running on this thread, each call's
+// from its base up
+static thread_local std::vector<ElementP> slots;
+
+// A running compiled call
+struct Frame {
+  Frame(std::size_t base, Environment *closure)
+      : base(base), closure(closure), globals(closure->global_env()) {}
+  std::size_t base;
+  Environment *closure;
+  Environment *globals; // at the bottom of closure
+  // a user function called in tail position, for run to call in place of
+  // the current one
+  FunctionP tail_f;
+  ListP tail_args;
+  bool recur = false; // the innermost loop is to run again
+};
+
+struct Node {
+  virtual ~Node() = default;
+  virtual ElementP exec(Frame &frame) const = 0;
+};
+using NodeP = std::unique_ptr<const Node>;
+
+struct Code {
+  NodeP body;
+  unsigned int n_params; // taking the first slots
+  bool last_is_variadic;
+  unsigned int n_slots;
+  // The call heads compiled as macro calls, with the macro each expanded,
+  // and as calls, with null: the code holds while the closure binds them
+  // the same way, as last checked against the given version of its globals
+  std::vector<std::pair<std::string, ElementP>> macros;
+  mutable std::atomic<std::uint64_t> checked = 0;
+};
+
+static bool is_true(const ElementP &el) {
+  return not(el->type == NIL or
+             (el->type == BOOLEAN and
+              not static_cast<const Boolean *>(el.get())->value()));
+}
+
+// A binding of the closure of the running function that isn't global, null
+// when there is none
+static ElementP local_binding(const Frame &frame, std::string_view name) {
+  if (frame.closure == frame.globals)
+    return nullptr;
+  if (frame.closure->get_level() == 1) {
+    const ElementP *binding = frame.closure->lookup(name);
+    return binding ? *binding : nullptr;
+  }
+  // the whole chain of frames, kept when the fn* form wasn't flat
+  ElementP found = frame.closure->find(name);
+  if (found->type == NIL or found->to<Environment>()->get_level() == 0)
+    return nullptr;
+  return found->to<Environment>()->get(name);
+}
+
+struct Const_Node : Node {
+  Const_Node(ElementP value) : value(std::move(value)) {}
+  ElementP exec(Frame &) const override { return value; }
+  ElementP value;
+};
+
+struct Local_Node : Node {
+  Local_Node(unsigned int slot) : slot(slot) {}
+  ElementP exec(Frame &frame) const override {
+    return slots[frame.base + slot];
+  }
+  unsigned int slot;
+};
+
+// A symbol not bound in the function itself. Where it is found in a global
+// environment the binding is cached, keyed by the version of the
+// environment; a cell found stale is replaced in place. Cells are read
+// without locking: a writer clears the version while it rewrites one.
+struct Free_Node : Node {
+  static constexpr unsigned int MAX_CELLS = 8;
+  struct Cell {
+    std::atomic<std::uint64_t> version = 0;
+    std::atomic<const ElementP *> binding = nullptr;
+    const Environment *globals = nullptr; // written under cells_mutex
+  };
+
+  Free_Node(std::string name)
+      : name(std::move(name)), bit(Environment::key_bit(this->name)) {}
+
+  ElementP exec(Frame &frame) const override {
+    // closures made by closure_env hold few names, which key_bit tells
+    // apart from most others without looking them up
+    if (frame.closure != frame.globals and
+        (frame.closure->get_level() > 1 or frame.closure->may_hold(bit))) {
+      ElementP local = local_binding(frame, name);
+      if (local)
+        return local;
+    }
+    std::uint64_t version = frame.globals->version();
+    for (const Cell &c : cells)
+      if (c.version.load() == version) {
+        const ElementP *binding = c.binding.load();
+        if (c.version.load() == version)
+          return *binding;
+      }
+    const ElementP *binding = frame.globals->lookup(name);
+    if (not binding) {
+      Runtime::raise(str("'" + name + "' not found"));
+      return nil();
+    }
+    remember(frame.globals, version, binding);
+    return *binding;
+  }
+
+  // Replaces the cell of globals, stale since it missed, else an empty one,
+  // else each of the others in turn
+  void remember(const Environment *globals, std::uint64_t version,
+                const ElementP *binding) const {
+    std::lock_guard<std::mutex> lock(cells_mutex);
+    Cell *target = nullptr;
+    for (Cell &c : cells) {
+      if (c.version.load() == version)
+        return; // cached by another thread meanwhile
+      if (c.globals == globals or (not target and not c.globals))
+        target = &c;
+    }
+    if (not target)
+      target = &cells[next_cell++ % MAX_CELLS];
+    target->version.store(0);
+    target->binding.store(binding);
+    target->globals = globals;
+    target->version.store(version);
+  }
+
+  std::string name;
+  std::uint64_t bit;
+  mutable Cell cells[MAX_CELLS];
+  mutable std::mutex cells_mutex;
+  mutable unsigned int next_cell = 0;
+};
+
+struct If_Node : Node {
+  If_Node(NodeP condition, NodeP then, NodeP otherwise)
+      : condition(std::move(condition)), then(std::move(then)),
+        otherwise(std::move(otherwise)) {}
+  ElementP exec(Frame &frame) const override {
+    ElementP c = condition->exec(frame);
+    if (Runtime::raised)
+      return nil();
+    if (is_true(c))
+      return then->exec(frame);
+    return otherwise ? otherwise->exec(frame) : nil();
+  }
+  NodeP condition, then, otherwise; // otherwise null when missing
+};
+
+struct Do_Node : Node {
+  Do_Node(std::vector<NodeP> body) : body(std::move(body)) {}
+  ElementP exec(Frame &frame) const override {
+    for (std::size_t i = 0; i + 1 < body.size(); i++) {
+      body[i]->exec(frame);
+      if (Runtime::raised)
+        return nil();
+    }
+    return body.back()->exec(frame);
+  }
+  std::vector<NodeP> body;
+};
+
+// The slots bound by let* and loop, each value evaluated in turn
+using Binds = std::vector<std::pair<unsigned int, NodeP>>;
+
+static bool bind(const Binds &binds, Frame &frame) {
+  for (const auto &[slot, value] : binds) {
+    ElementP v = value->exec(frame);
+    if (Runtime::raised)
+      return false;
+    slots[frame.base + slot] = std::move(v);
+  }
+  return true;
+}
+
+struct Let_Node : Node {
+  Let_Node(Binds binds, NodeP body)
+      : binds(std::move(binds)), body(std::move(body)) {}
+  ElementP exec(Frame &frame) const override {
+    if (not bind(binds, frame))
+      return nil();
+    return body->exec(frame);
+  }
+  Binds binds;
+  NodeP body;
+};
+
+struct Loop_Node : Node {
+  Loop_Node(Binds binds, NodeP body)
+      : binds(std::move(binds)), body(std::move(body)) {}
+  ElementP exec(Frame &frame) const override {
+    if (not bind(binds, frame))
+      return nil();
+    while (true) {
+      ElementP ret = body->exec(frame);
+      if (not frame.recur)
+        return ret;
+      frame.recur = false;
+    }
+  }
+  Binds binds;
+  NodeP body;
+};
+
+// The new values are evaluated on top of the slot stack before any loop
+// slot is overwritten
+struct Recur_Node : Node {
+  Recur_Node(std::vector<unsigned int> targets, std::vector<NodeP> values)
+      : targets(std::move(targets)), values(std::move(values)) {}
+  ElementP exec(Frame &frame) const override {
+    std::size_t top = slots.size();
+    for (const NodeP &value : values) {
+      ElementP v = value->exec(frame);
+      if (Runtime::raised) {
+        slots.resize(top);
+        return nil();
+      }
+      slots.push_back(std::move(v));
+    }
+    for (std::size_t i = 0; i < targets.size(); i++)
+      slots[frame.base + targets[i]] = std::move(slots[top + i]);
+    slots.resize(top);
+    frame.recur = true;
+    return nil();
+  }
+  std::vector<unsigned int> targets;
+  std::vector<NodeP> values;
+};
+
+struct Try_Node : Node {
+  Try_Node(NodeP body, unsigned int slot, NodeP handler)
+      : body(std::move(body)), slot(slot), handler(std::move(handler)) {}
+  ElementP exec(Frame &frame) const override {
+    Runtime::handled = true;
+    ElementP ret = body->exec(frame);
+    Runtime::handled = false;
+    if (not Runtime::raised)
+      return ret;
+    slots[frame.base + slot] = Runtime::exc_value;
+    Runtime::raised = false;
+    return handler->exec(frame);
+  }
+  NodeP body;
+  unsigned int slot;
+  NodeP handler;
+};
+
+struct Vec_Node : Node {
+  Vec_Node(std::vector<NodeP> items) : items(std::move(items)) {}
+  ElementP exec(Frame &frame) const override {
+    VecP ret = vec();
+    ret->reserve(items.size());
+    for (const NodeP &item : items) {
+      ElementP v = item->exec(frame);
+      if (Runtime::raised)
+        return nil();
+      ret->append(std::move(v));
+    }
+    return ret;
+  }
+  std::vector<NodeP> items;
+};
+
+struct Dict_Node : Node {
+  Dict_Node(std::vector<std::pair<ElementP, NodeP>> entries)
+      : entries(std::move(entries)) {}
+  ElementP exec(Frame &frame) const override {
+    DictP ret = dict();
+    ret->reserve(entries.size());
+    for (const auto &[key, value] : entries) {
+      ElementP v = value->exec(frame);
+      if (Runtime::raised)
+        return nil();
+      ret->append(key, std::move(v));
+    }
+    return ret;
+  }
+  std::vector<std::pair<ElementP, NodeP>> entries;
+};
+
+// A closure keeps the values of its free variables bound in the calling
+// function, like one made by EVAL from a flat fn* form
+struct Fn_Node : Node {
+  struct Capture {
+    std::string name;
+    int slot; // -1 when not bound in the calling function
+  };
+
+  Fn_Node(std::vector<Arity> arities, Closure_InfoP info,
+          std::vector<Capture> captures, Source_Span site)
+      : arities(std::move(arities)), info(std::move(info)),
+        captures(std::move(captures)), site(site) {}
+
+  ElementP exec(Frame &frame) const override {
+    // a binding of the running function's closure may still change: the
+    // new closure keeps that chain of frames, with the locals it uses on top
+    bool keep = false;
+    ElementP value;
+    if (frame.closure != frame.globals)
+      for (const Capture &c : captures)
+        if (c.slot < 0 and not closure_binding(frame.closure, c.name, value)) {
+          keep = true;
+          break;
+        }
+    EnvironmentP outer = std::static_pointer_cast<Environment>(
+        (keep ? frame.closure : frame.globals)->shared_from_this());
+    EnvironmentP captured;
+    for (const Capture &c : captures) {
+      value = nullptr;
+      if (c.slot >= 0)
+        value = slots[frame.base + c.slot];
+      else if (not keep and frame.closure != frame.globals)
+        closure_binding(frame.closure, c.name, value);
+      if (not value)
+        continue;
+      if (not captured)
+        captured = environment(outer);
+      captured->set(c.name, std::move(value));
+    }
+    FunctionP f = func(captured ? captured : outer, arities);
+    f->frame_escapes = info->frame_escapes;
+    f->site = site;
+    f->info = info;
+    return f;
+  }
+
+  std::vector<Arity> arities;
+  Closure_InfoP info;
+  std::vector<Capture> captures;
+  Source_Span site;
+};
+
+// Natives and functions in non-tail position are called through apply,
+// which runs the compiled ones
+struct Call_Node : Node {
+  Call_Node(ListP form, NodeP head, std::vector<NodeP> args, bool tail)
+      : form(std::move(form)), head(std::move(head)), args(std::move(args)),
+        tail(tail) {}
+  ElementP exec(Frame &frame) const override {
+    ElementP e_f = head->exec(frame);
+    if (Runtime::raised)
+      return nil();
+    if (e_f->type != FUNCTION) {
+      // see Environment::get for why this isn't "'" + ...
+      Runtime::raise(
+          str(std::string("'").append(pr_str(form->at(0))) + "' not found"));
+      return nil();
+    }
+    ListP values = list();
+    values->reserve(args.size());
+    for (const NodeP &arg : args) {
+      ElementP v = arg->exec(frame);
+      if (Runtime::raised)
+        return nil();
+      values->append(std::move(v));
+    }
+    FunctionP f = std::static_pointer_cast<Function>(std::move(e_f));
+    if (tail and not f->is_native()) {
+      frame.tail_f = std::move(f);
+      frame.tail_args = std::move(values);
+      return nil();
+    }
+    return apply(std::move(f), std::move(values));
+  }
+  ListP form;
+  NodeP head;
+  std::vector<NodeP> args;
+  bool tail;
+};
+
+//**************************************************************************
+//
+//                                COMPILER
+//
+//**************************************************************************
+
+// Compiles the arities of functions whose closure is env. Every method
+// returns null when the form has to be left to EVAL, either because the
+// compiler doesn't handle it or because it is malformed and EVAL is to
+// raise the error.
+class Compiler {
+public:
+  Compiler(EnvironmentP env) : env(std::move(env)) {}
+  std::shared_ptr<const Code> compile(const Arity &arity);
+
+private:
+  // recur holds the slots of the loop a recur here would jump back to,
+  // null when recur isn't allowed
+  NodeP compile(ElementP ast, bool tail,
+                const std::vector<unsigned int> *recur);
+  NodeP compile_list(ListP form, bool tail,
+                     const std::vector<unsigned int> *recur);
+  NodeP compile_let(ListP form, bool tail,
+                    const std::vector<unsigned int> *recur, bool loop);
+  NodeP compile_fn(ListP form);
+  int find(std::string_view name) const;
+  unsigned int add_local(std::string_view name);
+
+  EnvironmentP env;
+  std::vector<std::pair<std::string_view, unsigned int>> scope;
+  // names a let* is about to bind: closures made by their values would
+  // have to see them, which only EVAL's frames allow
+  std::vector<std::string_view> pending;
+  unsigned int n_slots = 0;
+  std::vector<std::pair<std::string, ElementP>> macros;
+  void depends_on(std::string_view name, ElementP macro);
+};
+
+std::shared_ptr<const Code> Compiler::compile(const Arity &arity) {
+  for (unsigned int i = 0; i < arity.binds->size(); i++)
+    add_local(arity.binds->at(i)->to<Symbol>()->value());
+  NodeP body = compile(arity.exprs, true, nullptr);
+  if (not body)
+    return nullptr;
+  auto code = std::make_shared<Code>();
+  code->body = std::move(body);
+  code->n_params = arity.binds->size();
+  code->last_is_variadic = arity.last_is_variadic;
+  code->n_slots = n_slots;
+  code->macros = std::move(macros);
+  return code;
+}
+
+void Compiler::depends_on(std::string_view name, ElementP macro) {
+  for (const auto &m : macros)
+    if (m.first == name)
+      return;
+  macros.emplace_back(name, std::move(macro));
+}
+
+int Compiler::find(std::string_view name) const {
+  for (std::size_t i = scope.size(); i > 0; i--)
+    if (scope[i - 1].first == name)
+      return scope[i - 1].second;
+  return -1;
+}
+
+unsigned int Compiler::add_local(std::string_view name) {
+  scope.emplace_back(name, n_slots);
+  return n_slots++;
+}
+
+NodeP Compiler::compile(ElementP ast, bool tail,
+                        const std::vector<unsigned int> *recur) {
+  switch (ast->type) {
+  case SYMBOL: {
+    std::string_view name = ast->to<Symbol>()->value();
+    int slot = find(name);
+    if (slot >= 0)
+      return std::make_unique<Local_Node>(slot);
+    return std::make_unique<Free_Node>(std::string(name));
+  }
+  case VEC: {
+    VecP v = ast->to<Vec>();
+    std::vector<NodeP> items;
+    for (unsigned int i = 0; i < v->size(); i++) {
+      items.push_back(compile(v->at(i), false, nullptr));
+      if (not items.back())
+        return nullptr;
+    }
+    return std::make_unique<Vec_Node>(std::move(items));
+  }
+  case DICT: {
+    std::vector<std::pair<ElementP, NodeP>> entries;
+    bool failed = false;
+    ast->to<Dict>()->for_each([&](ElementP key, ElementP value) {
+      NodeP node = failed ? nullptr : compile(value, false, nullptr);
+      failed = failed or not node;
+      entries.emplace_back(key, std::move(node));
+    });
+    if (failed)
+      return nullptr;
+    return std::make_unique<Dict_Node>(std::move(entries));
+  }
+  case LIST:
+    if (ast->to<List>()->size() == 0)
+      return std::make_unique<Const_Node>(ast);
+    return compile_list(ast->to<List>(), tail, recur);
+  default:
+    return std::make_unique<Const_Node>(ast);
+  }
+}
+
+NodeP Compiler::compile_list(ListP form, bool tail,
+                             const std::vector<unsigned int> *recur) {
+  if (form->at(0)->type == SYMBOL) {
+    std::string_view name = form->at(0)->to<Symbol>()->value();
+    if (name == "let*")
+      return compile_let(form, tail, recur, false);
+    if (name == "loop")
+      return compile_let(form, tail, recur, true);
+    if (name == "recur") {
+      if (not recur or form->size() - 1 != recur->size())
+        return nullptr;
+      std::vector<NodeP> values;
+      for (unsigned int i = 1; i < form->size(); i++) {
+        values.push_back(compile(form->at(i), false, nullptr));
+        if (not values.back())
+          return nullptr;
+      }
+      return std::make_unique<Recur_Node>(*recur, std::move(values));
+    }
+    if (name == "do") {
+      if (form->size() < 2)
+        return nullptr;
+      std::vector<NodeP> body;
+      for (unsigned int i = 1; i < form->size(); i++) {
+        bool last = i == form->size() - 1;
+        body.push_back(compile(form->at(i), tail and last,
+                               last ? recur : nullptr));
+        if (not body.back())
+          return nullptr;
+      }
+      return std::make_unique<Do_Node>(std::move(body));
+    }
+    if (name == "if") {
+      if (form->size() < 3)
+        return nullptr;
+      NodeP condition = compile(form->at(1), false, nullptr);
+      NodeP then = compile(form->at(2), tail, recur);
+      NodeP otherwise;
+      if (form->size() >= 4)
+        otherwise = compile(form->at(3), tail, recur);
+      if (not condition or not then or (form->size() >= 4 and not otherwise))
+        return nullptr;
+      return std::make_unique<If_Node>(std::move(condition), std::move(then),
+                                       std::move(otherwise));
+    }
+    if (name == "fn*")
+      return compile_fn(form);
+    if (name == "quote") {
+      if (form->size() != 2)
+        return nullptr;
+      return std::make_unique<Const_Node>(form->at(1));
+    }
+    if (name == "quasiquote") {
+      if (form->size() != 2)
+        return nullptr;
+      ElementP expanded = quasiquote(form->at(1));
+      if (Runtime::raised) {
+        Runtime::take_exception();
+        return nullptr;
+      }
+      return compile(expanded, tail, recur);
+    }
+    if (name == "try*") {
+      if (form->size() == 2)
+        return compile(form->at(1), tail, nullptr);
+      if (form->size() != 3 or form->at(2)->type != LIST)
+        return nullptr;
+      ListP catch_form = form->at(2)->to<List>();
+      if (catch_form->size() != 3 or not catch_form->check_nth(0, SYMBOL) or
+          catch_form->at(0)->to<Symbol>()->value() != "catch*" or
+          not catch_form->check_nth(1, SYMBOL))
+        return nullptr;
+      NodeP body = compile(form->at(1), false, nullptr);
+      if (not body)
+        return nullptr;
+      std::size_t outer = scope.size();
+      unsigned int slot = add_local(catch_form->at(1)->to<Symbol>()->value());
+      NodeP handler = compile(catch_form->at(2), tail, nullptr);
+      scope.resize(outer);
+      if (not handler)
+        return nullptr;
+      return std::make_unique<Try_Node>(std::move(body), slot,
+                                        std::move(handler));
+    }
+    if (name == "def!" or name == "defmacro!" or name == "lazy-seq" or
+        name == "macroexpand" or name == "quasiquoteexpand")
+      return nullptr;
+    if (find(name) < 0) {
+      if (env->find(name)->type != NIL and is_macro_call(form, env)) {
+        Macro_Uses uses;
+        ElementP expanded = macroexpand(form, env, &uses);
+        if (Runtime::raised) {
+          Runtime::take_exception();
+          return nullptr;
+        }
+        for (auto &[used, macro] : uses)
+          depends_on(used, std::move(macro));
+        return compile(expanded, tail, recur);
+      }
+      depends_on(name, nullptr);
+    }
+  }
+  NodeP head = compile(form->at(0), false, nullptr);
+  if (not head)
+    return nullptr;
+  std::vector<NodeP> args;
+  for (unsigned int i = 1; i < form->size(); i++) {
+    args.push_back(compile(form->at(i), false, nullptr));
+    if (not args.back())
+      return nullptr;
+  }
+  return std::make_unique<Call_Node>(form, std::move(head), std::move(args),
+                                     tail);
+}
+
+NodeP Compiler::compile_let(ListP form, bool tail,
+                            const std::vector<unsigned int> *recur,
+                            bool loop) {
+  if (not form->at_least(3) or
+      (form->at(1)->type != LIST and form->at(1)->type != VEC))
+    return nullptr;
+  ListP binds = form->at(1)->type == VEC ? form->at(1)->to<Vec>()->listed()
+                                         : form->at(1)->to<List>();
+  if (binds->size() % 2 != 0)
+    return nullptr;
+  for (unsigned int i = 0; i < binds->size(); i += 2)
+    if (not binds->check_nth(i, SYMBOL))
+      return nullptr;
+  std::size_t outer = scope.size(), outer_pending = pending.size();
+  Binds values;
+  std::vector<unsigned int> targets;
+  for (unsigned int i = 0; i < binds->size(); i += 2) {
+    pending.resize(outer_pending);
+    for (unsigned int j = i; j < binds->size(); j += 2)
+      pending.push_back(binds->at(j)->to<Symbol>()->value());
+    NodeP value = compile(binds->at(i + 1), false, nullptr);
+    if (not value)
+      return nullptr;
+    unsigned int slot = add_local(binds->at(i)->to<Symbol>()->value());
+    values.emplace_back(slot, std::move(value));
+    targets.push_back(slot);
+  }
+  pending.resize(outer_pending);
+  NodeP body = compile(form->at(2), tail, loop ? &targets : recur);
+  scope.resize(outer);
+  if (not body)
+    return nullptr;
+  if (loop)
+    return std::make_unique<Loop_Node>(std::move(values), std::move(body));
+  return std::make_unique<Let_Node>(std::move(values), std::move(body));
+}
+
+NodeP Compiler::compile_fn(ListP form) {
+  std::vector<Arity> arities;
+  if (not read_fn(form, arities)) {
+    Runtime::take_exception();
+    return nullptr;
+  }
+  Closure_InfoP info = closure_info(form, arities, env);
+  if (not info->flat)
+    return nullptr;
+  std::vector<Fn_Node::Capture> captures;
+  for (const std::string &name : info->free) {
+    // a pending name may shadow a local of the same name
+    for (std::string_view p : pending)
+      if (p == name)
+        return nullptr;
+    captures.push_back({name, find(name)});
+  }
+  return std::make_unique<Fn_Node>(std::move(arities), std::move(info),
+                                   std::move(captures), get_span(form));
+}
+
+//**************************************************************************
+//
+//                                 DRIVER
+//
+//**************************************************************************
+
+// Whether the call heads of code are still bound as it was compiled for, as
+// seen from f's closure. Checked once per version of the globals.
+static bool macros_hold(const Code &code, const Function &f) {
+  if (code.macros.empty())
+    return true;
+  std::uint64_t version = f.closure()->global_env()->version();
+  if (code.checked.load(std::memory_order_acquire) == version)
+    return true;
+  for (const auto &[name, macro] : code.macros) {
+    ElementP found = f.closure()->find(name);
+    ElementP value =
+        found->type == NIL ? nullptr : *found->to<Environment>()->lookup(name);
+    bool is_macro = value and value->type == FUNCTION and
+                    value->to<Function>()->is_macro;
+    if (macro ? value != macro : is_macro)
+      return false;
+  }
+  code.checked.store(version, std::memory_order_release);
+  return true;
+}
+
+const Code *compiled(Function &f, const Arity &arity) {
+  const Closure_Info *info = f.info.get();
+  if (not info)
+    return nullptr;
+  const std::vector<Arity> &arities = f.get_arities();
+  if (not info->compiled.load(std::memory_order_acquire)) {
+    std::lock_guard<std::recursive_mutex> lock(info->code_mutex);
+    if (not info->compiled.load(std::memory_order_relaxed)) {
+      std::vector<std::shared_ptr<const Code>> code;
+      for (const Arity &a : arities)
+        code.push_back(Compiler(f.closure()).compile(a));
+      info->code = std::move(code);
+      info->compiled.store(true, std::memory_order_release);
+    }
+  }
+  const Code *code = info->code[&arity - arities.data()].get();
+  if (code and not macros_hold(*code, f))
+    return nullptr;
+  return code;
+}
+
+ElementP run(FunctionP f, const Code *code, ListP args) {
+  if (Runtime::stack_exhausted())
+    THROW("stack overflow: evaluation nested too deeply");
+  Call_Frame call;
+  std::size_t base = slots.size();
+  while (true) {
+    if (Profiler::tick.load(std::memory_order_relaxed))
+      Profiler::sample();
+    Frame frame(base, f->closure().get());
+    call.enter(std::move(f));
+    slots.resize(base + code->n_slots);
+    if (code->n_params > 0) {
+      unsigned int last = code->n_params - 1;
+      for (unsigned int i = 0; i < last; i++)
+        slots[base + i] = args->at(i);
+      if (code->last_is_variadic) {
+        ListP rest = list();
+        for (unsigned int i = last; i < args->size(); i++)
+          rest->append(args->at(i));
+        slots[base + last] = std::move(rest);
+      } else
+        slots[base + last] = args->at(last);
+    }
+    args = nullptr;
+    ElementP ret = code->body->exec(frame);
+    slots.resize(base);
+    if (not frame.tail_f)
+      return ret;
+    f = std::move(frame.tail_f);
+    args = std::move(frame.tail_args);
+    STAT_INC(user_calls);
+    STAT_INC(tail_calls);
+    const Arity *arity = f->arity(args->size());
+    if (not arity)
+      return nil();
+    ElementP jitted;
+    if (Jit::enabled.load(std::memory_order_relaxed) and
+        Jit::call(*f, *arity, args, jitted))
+      return jitted;
+    code = compiled(*f, *arity);
+    if (not code) {
+      EnvironmentP f_env = f->create_env(*arity, args);
+      call.enter(std::move(f));
+      return EVAL(arity->exprs, std::move(f_env));
+    }
+  }
+}
+} // namespace lmlisp
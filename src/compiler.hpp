@@ -0,0 +1,20 @@
+#pragma once
+#include "runtime.hpp"
+
+namespace lmlisp {
+// CLOSURE ENGINE
+// Compiles the body of each arity of a user function, once, into a tree of
+// nodes that run it without looking at the forms again: macros are
+// expanded at compile time, locals live in slots of a per-thread stack and
+// globals are read through cached pointers to their bindings. Bodies using
+// forms the compiler doesn't handle (def!, defmacro!, lazy-seq,
+// macroexpand, quasiquoteexpand) are left to EVAL.
+struct Code;
+
+// The compiled body of arity, compiled on the first call; null when it is
+// left to EVAL, also once a macro it expanded, or a call head it took for
+// a function, is bound otherwise
+const Code *compiled(Function &f, const Arity &arity);
+// Calls f, one of whose arities compiled to code, on args
+ElementP run(FunctionP f, const Code *code, ListP args);
+} // namespace lmlisp
@@ -1,9 +1,17 @@
 #include "core.hpp"
 #include "externals.hpp"
+#include "formats.hpp"
+#include "jit.hpp"
+#include "kernels.hpp"
 #include "macros.hpp"
+#include "parallel.hpp"
 #include "printer.hpp"
+#include "profiler.hpp"
 #include "reader.hpp"
 #include "runtime.hpp"
+#include "stats.hpp"
+#include "table.hpp"
+#include <algorithm>
 #include <cmath>
 #include <chrono>
 #include <fstream>
@@ -39,6 +47,19 @@ StringP type(ElementP el) {
     return str("excepion");
   case ATOM:
     return str("atom");
+  case LAZY_SEQ:
+    return str("lazy-seq");
+  case REDUCED:
+    return str("reduced");
+  case TRANSIENT:
+    return str("transient");
+  case ARRAY:
+    return str(el->to<Array>()->kind == Array::DOUBLE ? "double-array"
+                                                      : "long-array");
+  case TABLE:
+    return str("table");
+  case STRING_BUILDER:
+    return str("string-builder");
   default:
     return str("type unknown");
   }
@@ -50,6 +71,705 @@ unsigned int timeMillisec() {
       .time_since_epoch()).count();
 }
 
+//**************************************************************************
+//
+//                             LAZY SEQUENCES
+//
+//**************************************************************************
+
+// Produced chunks hold at most CHUNK_SIZE values; a larger source chunk
+// (a vector seen as a sequence) is consumed CHUNK_SIZE values at a time.
+static constexpr unsigned int CHUNK_SIZE = 32;
+
+#ifdef _LM_WITH_FLOAT
+using Number_Value = float;
+#else
+using Number_Value = int;
+#endif
+
+static bool is_truthy(ElementP el) {
+  return not(el->type == NIL or
+             (el->type == BOOLEAN and not el->to<Boolean>()->value()));
+}
+
+static ElementP call(FunctionP f, std::initializer_list<ElementP> args) {
+  ListP f_args = list();
+  f_args->reserve(args.size());
+  for (ElementP arg : args)
+    f_args->append(arg);
+  return apply(f, f_args);
+}
+
+static Lazy_SeqP lazy_range(Number_Value start, Number_Value end,
+                            Number_Value step, bool bounded) {
+  return lazy_seq([=]() -> ElementP {
+    VecP chunk = vec();
+    Number_Value n = start;
+    for (unsigned int i = 0; i < CHUNK_SIZE; i++, n += step) {
+      if (bounded and (step >= 0 ? n >= end : n <= end))
+        break;
+      chunk->append(num(n));
+    }
+    bool done = chunk->size() < CHUNK_SIZE;
+    return lazy_seq(chunk, 0, chunk->size(),
+                    done ? nullptr : lazy_range(n, end, step, bounded));
+  });
+}
+
+static Lazy_SeqP lazy_iterate(FunctionP f, ElementP x) {
+  ListP chunk = list();
+  chunk->append(x);
+  return lazy_seq(chunk, 0, 1, lazy_seq([f, x]() -> ElementP {
+                    ElementP next = call(f, {x});
+                    if (Runtime::raised)
+                      return nil();
+                    return lazy_iterate(f, next);
+                  }));
+}
+
+static Lazy_SeqP lazy_take(int n, Lazy_SeqP s) {
+  return lazy_seq([n, s]() -> ElementP {
+    if (n <= 0 or s->empty())
+      return nil();
+    unsigned int k = std::min<unsigned int>(n, s->chunk_size());
+    Lazy_SeqP more = s->chunk_more();
+    return s->slice(0, k,
+                    (k < static_cast<unsigned int>(n) and more)
+                        ? lazy_take(n - k, more)
+                        : nullptr);
+  });
+}
+
+static Lazy_SeqP lazy_drop(int n, Lazy_SeqP s) {
+  return lazy_seq([n, s]() mutable -> ElementP {
+    // s is moved out so the dropped values are released while skipping
+    Lazy_SeqP cur = std::move(s);
+    unsigned int left = n > 0 ? n : 0;
+    while (cur and left >= cur->chunk_size() and not cur->empty()) {
+      left -= cur->chunk_size();
+      cur = cur->chunk_more();
+    }
+    if (not cur or cur->empty())
+      return nil();
+    return cur->slice(left, cur->chunk_size(), cur->chunk_more());
+  });
+}
+
+// map and filter take up to CHUNK_SIZE values from the source chunk; the
+// rest of the source chunk is left for the next cell.
+static Lazy_SeqP lazy_map(FunctionP f, Lazy_SeqP s) {
+  return lazy_seq([f, s]() -> ElementP {
+    if (s->empty())
+      return nil();
+    unsigned int k = std::min(CHUNK_SIZE, s->chunk_size());
+    VecP chunk = vec();
+    for (unsigned int i = 0; i < k; i++) {
+      chunk->append(call(f, {s->chunk_at(i)}));
+      if (Runtime::raised)
+        return nil();
+    }
+    Lazy_SeqP more = k < s->chunk_size()
+                         ? s->slice(k, s->chunk_size(), s->chunk_more())
+                         : s->chunk_more();
+    return lazy_seq(chunk, 0, k, more ? lazy_map(f, more) : nullptr);
+  });
+}
+
+static Lazy_SeqP lazy_filter(FunctionP pred, Lazy_SeqP s) {
+  return lazy_seq([pred, s]() mutable -> ElementP {
+    Lazy_SeqP cur = std::move(s);
+    while (cur and not cur->empty()) {
+      unsigned int k = std::min(CHUNK_SIZE, cur->chunk_size());
+      VecP chunk = vec();
+      for (unsigned int i = 0; i < k; i++) {
+        bool keep = is_truthy(call(pred, {cur->chunk_at(i)}));
+        if (Runtime::raised)
+          return nil();
+        if (keep)
+          chunk->append(cur->chunk_at(i));
+      }
+      cur = k < cur->chunk_size()
+                ? cur->slice(k, cur->chunk_size(), cur->chunk_more())
+                : cur->chunk_more();
+      if (chunk->size() > 0)
+        return lazy_seq(chunk, 0, chunk->size(),
+                        cur ? lazy_filter(pred, cur) : nullptr);
+    }
+    return nil();
+  });
+}
+
+//**************************************************************************
+//
+//                        REDUCING AND TRANSDUCERS
+//
+//**************************************************************************
+
+// A reducing function is called with no arguments for an initial value,
+// with the accumulator to complete it, and with the accumulator and a
+// value for each step. Functions that don't take the first two are only
+// used for steps.
+static ElementP rf_init(FunctionP rf) {
+  return rf->accepts(0) ? call(rf, {}) : nil();
+}
+
+static ElementP rf_complete(FunctionP rf, ElementP acc) {
+  return rf->accepts(1) ? call(rf, {acc}) : acc;
+}
+
+// Feeds s to rf a chunk at a time, stopping early on a reduced value.
+static ElementP reduce(FunctionP rf, ElementP acc, Lazy_SeqP s) {
+  for (; s; s = s->chunk_more()) {
+    for (unsigned int i = 0; i < s->chunk_size(); i++) {
+      acc = call(rf, {acc, s->chunk_at(i)});
+      if (Runtime::raised)
+        return nil();
+      if (acc->type == REDUCED)
+        return acc->to<Reduced>()->ref;
+    }
+  }
+  return acc;
+}
+
+// Transducers take a reducing function and return the one that runs their
+// step before it.
+static FunctionP transducer(
+    std::function<ElementP(FunctionP rf, ElementP acc, ElementP x)> step) {
+  return func([step](ListP args) {
+    if (not args->check_nth(0, FUNCTION))
+      THROW("transducer: argument must be a reducing function");
+    FunctionP rf = args->at(0)->to<Function>();
+    return func([step, rf](ListP args) {
+             switch (args->size()) {
+             case 0:
+               return rf_init(rf);
+             case 1:
+               return rf_complete(rf, args->at(0));
+             default:
+               return step(rf, args->at(0), args->at(1));
+             }
+           })
+        ->el();
+  });
+}
+
+static FunctionP map_xf(FunctionP f) {
+  return transducer([f](FunctionP rf, ElementP acc, ElementP x) {
+    ElementP y = call(f, {x});
+    if (Runtime::raised)
+      return nil();
+    return call(rf, {acc, y});
+  });
+}
+
+static FunctionP filter_xf(FunctionP pred) {
+  return transducer([pred](FunctionP rf, ElementP acc, ElementP x) {
+    if (is_truthy(call(pred, {x})))
+      return call(rf, {acc, x});
+    return acc;
+  });
+}
+
+static FunctionP mapcat_xf(FunctionP f) {
+  return transducer([f](FunctionP rf, ElementP acc, ElementP x) {
+    Lazy_SeqP s = as_lazy_seq(call(f, {x}));
+    if (not s)
+      THROW("mapcat: function must return a sequence");
+    for (; s; s = s->chunk_more()) {
+      for (unsigned int i = 0; i < s->chunk_size(); i++) {
+        acc = call(rf, {acc, s->chunk_at(i)});
+        if (acc->type == REDUCED or Runtime::raised)
+          return acc;
+      }
+    }
+    return acc;
+  });
+}
+
+// The count is per reducing function, so a transducer can be reused.
+static FunctionP take_xf(int n) {
+  return func([n](ListP args) {
+    if (not args->check_nth(0, FUNCTION))
+      THROW("transducer: argument must be a reducing function");
+    FunctionP rf = args->at(0)->to<Function>();
+    std::shared_ptr<int> left = std::make_shared<int>(n);
+    return func([rf, left](ListP args) {
+             switch (args->size()) {
+             case 0:
+               return rf_init(rf);
+             case 1:
+               return rf_complete(rf, args->at(0));
+             default: {
+               ElementP acc = args->at(0);
+               if (*left > 0) {
+                 acc = call(rf, {acc, args->at(1)});
+                 (*left)--;
+               }
+               if (*left <= 0 and acc->type != REDUCED)
+                 acc = reduced(acc);
+               return acc;
+             }
+             }
+           })
+        ->el();
+  });
+}
+
+// Runs the reducing function rf, a transducer applied to a collector of
+// out, as the sequence is realized: each cell holds what came out of the
+// pipeline for a run of source values.
+static Lazy_SeqP lazy_sequence(FunctionP rf,
+                               std::shared_ptr<std::vector<ElementP>> out,
+                               Lazy_SeqP s) {
+  return lazy_seq([rf, out, s]() mutable -> ElementP {
+    Lazy_SeqP cur = std::move(s);
+    bool done = false;
+    while (out->empty() and not done) {
+      if (not cur or cur->empty()) {
+        done = true;
+      } else {
+        unsigned int k = std::min(CHUNK_SIZE, cur->chunk_size());
+        for (unsigned int i = 0; i < k and not done; i++) {
+          ElementP acc = call(rf, {nil(), cur->chunk_at(i)});
+          if (Runtime::raised)
+            return nil();
+          done = acc->type == REDUCED;
+        }
+        cur = k < cur->chunk_size()
+                  ? cur->slice(k, cur->chunk_size(), cur->chunk_more())
+                  : cur->chunk_more();
+      }
+      if (done)
+        rf_complete(rf, nil());
+    }
+    if (out->empty())
+      return nil();
+    VecP chunk = vec();
+    for (ElementP el : *out)
+      chunk->append(el);
+    out->clear();
+    return lazy_seq(chunk, 0, chunk->size(),
+                    done ? nullptr : lazy_sequence(rf, out, cur));
+  });
+}
+
+static Lazy_SeqP sequence(FunctionP xf, Lazy_SeqP s) {
+  std::shared_ptr<std::vector<ElementP>> out =
+      std::make_shared<std::vector<ElementP>>();
+  FunctionP collect = func([out](ListP args) {
+    if (args->size() == 2)
+      out->push_back(args->at(1));
+    return args->size() > 0 ? args->at(0) : nil();
+  });
+  ElementP rf = call(xf, {collect});
+  if (rf->type != FUNCTION)
+    return lazy_seq(nullptr, 0, 0, nullptr);
+  return lazy_sequence(rf->to<Function>(), out, s);
+}
+
+//**************************************************************************
+//
+//                              TRANSIENTS
+//
+//**************************************************************************
+
+// The collection behind a transient the calling thread may still edit;
+// raises and returns null otherwise.
+static ElementP editable(ElementP t, const std::string &name) {
+  if (t->type != TRANSIENT) {
+    Runtime::raise(str(name + ": first argument must be a transient"));
+    return nullptr;
+  }
+  TransientP tr = t->to<Transient>();
+  if (not tr->coll) {
+    Runtime::raise(str(name + ": transient used after persistent!"));
+    return nullptr;
+  } else if (tr->owner != std::this_thread::get_id()) {
+    Runtime::raise(str(name + ": transient used outside its owner thread"));
+    return nullptr;
+  }
+  return tr->coll;
+}
+
+static bool is_dict_key(ElementP key) {
+  return key->type == KEYWORD or key->type == STRING;
+}
+
+//**************************************************************************
+//
+//                                STRINGS
+//
+//**************************************************************************
+
+// Strings at least this long are linked into ropes by str rather than
+// copied, so building a string a piece at a time stays linear
+static constexpr std::size_t ROPE_MIN_SIZE = 256;
+
+// The printed forms of args, separated by spaces
+static std::string join_printed(ListP args, bool print_readably) {
+  std::string ret;
+  for (unsigned int i = 0; i < args->size(); i++) {
+    if (i > 0)
+      ret += " ";
+    pr_str(args->at(i), print_readably, ret);
+  }
+  return ret;
+}
+
+// The concatenation of the printed forms of args
+static StringP str_of(ListP args) {
+  StringP ret;
+  std::string pending;
+  auto link = [&ret](StringP piece) {
+    ret = ret ? str_concat(ret, piece) : piece;
+  };
+  for (unsigned int i = 0; i < args->size(); i++) {
+    if (args->at(i)->type == STRING and
+        args->at(i)->to<String>()->size() >= ROPE_MIN_SIZE) {
+      if (not pending.empty())
+        link(str(std::move(pending)));
+      pending.clear();
+      link(args->at(i)->to<String>());
+    } else {
+      pr_str(args->at(i), false, pending);
+    }
+  }
+  if (not pending.empty() or not ret)
+    link(str(std::move(pending)));
+  return ret;
+}
+
+static String_BuilderP builder(ElementP sb, const std::string &name) {
+  if (sb->type != STRING_BUILDER) {
+    Runtime::raise(str(name + ": first argument must be a string builder"));
+    return nullptr;
+  } else if (sb->to<String_Builder>()->owner != std::this_thread::get_id()) {
+    Runtime::raise(str(name + ": string builder used outside its thread"));
+    return nullptr;
+  }
+  return sb->to<String_Builder>();
+}
+
+//**************************************************************************
+//
+//                                 FOLD
+//
+//**************************************************************************
+
+static constexpr unsigned int FOLD_CHUNK_SIZE = 512;
+
+// Reduces the values in [from, to) into acc, stopping early on a reduced
+// value.
+using Chunk_Reducer =
+    std::function<ElementP(ElementP acc, unsigned int from, unsigned int to)>;
+
+// Runs task(i) for i in [0, n) on the thread pool. Exceptions raised on
+// the workers are raised again here, the one from the first task first;
+// returns false if there was one.
+static bool run_parallel(unsigned int n,
+                         const std::function<void(unsigned int)> &task) {
+  std::vector<ElementP> errors(n);
+  Thread_Pool::shared().run(n, [&task, &errors](unsigned int i) {
+    task(i);
+    if (Runtime::raised)
+      errors[i] = Runtime::take_exception();
+  });
+  for (ElementP error : errors) {
+    if (error) {
+      Runtime::raise(error);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Splits size values into chunks of n, reduces each chunk on the thread
+// pool starting from (combinef), then combines the results pairwise, also
+// on the pool. Chunks keep their order, so combinef only needs to be
+// associative.
+static ElementP fold(unsigned int n, FunctionP combinef, unsigned int size,
+                     const Chunk_Reducer &reduce_chunk) {
+  if (size <= n)
+    return reduce_chunk(rf_init(combinef), 0, size);
+  unsigned int chunks = (size + n - 1) / n;
+  std::vector<ElementP> results(chunks);
+  if (not run_parallel(chunks, [&](unsigned int i) {
+        ElementP acc = rf_init(combinef);
+        if (not Runtime::raised)
+          results[i] = reduce_chunk(acc, i * n, std::min(size, (i + 1) * n));
+      }))
+    return nil();
+  for (unsigned int step = 1; step < chunks; step *= 2) {
+    unsigned int pairs = (chunks - step + 2 * step - 1) / (2 * step);
+    if (not run_parallel(pairs, [&](unsigned int k) {
+          unsigned int i = k * 2 * step;
+          results[i] = call(combinef, {results[i], results[i + step]});
+        }))
+      return nil();
+  }
+  return results[0];
+}
+
+// Folds a vector, a dict (whose entries are passed to rf as a key and a
+// value) or, sequentially, any other sequence.
+static ElementP fold(unsigned int n, FunctionP combinef, FunctionP rf,
+                     ElementP coll) {
+  auto step = [&rf](ElementP &acc, std::initializer_list<ElementP> args) {
+    acc = call(rf, args);
+    if (Runtime::raised)
+      return false;
+    if (acc->type == REDUCED) {
+      acc = acc->to<Reduced>()->ref;
+      return false;
+    }
+    return true;
+  };
+  if (coll->type == VEC) {
+    VecP v = coll->to<Vec>();
+    return fold(n, combinef, v->size(),
+                [&v, &step](ElementP acc, unsigned int from, unsigned int to) {
+                  for (unsigned int i = from; i < to; i++)
+                    if (not step(acc, {acc, v->at(i)}))
+                      break;
+                  return acc;
+                });
+  } else if (coll->type == DICT) {
+    std::vector<std::pair<ElementP, ElementP>> entries;
+    entries.reserve(coll->to<Dict>()->size());
+    coll->to<Dict>()->for_each([&entries](ElementP key, ElementP value) {
+      entries.emplace_back(key, value);
+    });
+    return fold(n, combinef, entries.size(),
+                [&entries, &step](ElementP acc, unsigned int from,
+                                  unsigned int to) {
+                  for (unsigned int i = from; i < to; i++)
+                    if (not step(acc,
+                                 {acc, entries[i].first, entries[i].second}))
+                      break;
+                  return acc;
+                });
+  }
+  Lazy_SeqP s = as_lazy_seq(coll);
+  if (not s)
+    THROW("fold: collection must be a sequence or a dict");
+  ElementP acc = rf_init(combinef);
+  return Runtime::raised ? nil() : reduce(rf, acc, s);
+}
+
+// The dicts built by the chunks of frequencies and group-by are private to
+// the fold, so they are merged in place.
+static FunctionP merge_dicts(
+    std::function<void(DictP into, ElementP key, ElementP value)> merge) {
+  return func([merge](ListP args) {
+    if (args->size() == 0)
+      return dict()->el();
+    DictP into = args->at(0)->to<Dict>();
+    args->at(1)->to<Dict>()->for_each(
+        [&into, &merge](ElementP key, ElementP value) {
+          merge(into, key, value);
+        });
+    return into->el();
+  });
+}
+
+//**************************************************************************
+//
+//                                 SORT
+//
+//**************************************************************************
+
+// Inputs up to this size are sorted on the calling thread.
+static constexpr unsigned int PARALLEL_SORT_THRESHOLD = 8192;
+
+// Stable sort. Large inputs are split in one run per pool thread; the runs
+// are sorted on the pool, then merged pairwise, a round of merges at a
+// time. Returns false if less raised.
+template <class T, class Less>
+static bool sort_items(std::vector<T> &items, Less less) {
+  // once an exception is pending every pair compares equal, which keeps
+  // the sort well defined until it returns
+  auto guarded = [&less](const T &a, const T &b) {
+    return not Runtime::raised and less(a, b);
+  };
+  unsigned int size = items.size(), runs = Thread_Pool::shared().size();
+  if (size <= PARALLEL_SORT_THRESHOLD or runs == 1) {
+    std::stable_sort(items.begin(), items.end(), guarded);
+    return not Runtime::raised;
+  }
+  unsigned int run = (size + runs - 1) / runs;
+  auto bound = [&items, size, run](unsigned int i) {
+    return items.begin() + std::min(size, i * run);
+  };
+  if (not run_parallel(runs, [&](unsigned int i) {
+        std::stable_sort(bound(i), bound(i + 1), guarded);
+      }))
+    return false;
+  std::vector<T> merged(size);
+  for (unsigned int width = 1; width < runs; width *= 2) {
+    unsigned int merges = (runs + 2 * width - 1) / (2 * width);
+    if (not run_parallel(merges, [&](unsigned int k) {
+          unsigned int i = k * 2 * width;
+          std::merge(bound(i), bound(i + width), bound(i + width),
+                     bound(i + 2 * width),
+                     merged.begin() + (bound(i) - items.begin()), guarded);
+        }))
+      return false;
+    items.swap(merged);
+  }
+  return true;
+}
+
+static bool collect(ElementP coll, std::vector<ElementP> &out) {
+  if (coll->type == VEC) {
+    VecP v = coll->to<Vec>();
+    out.reserve(v->size());
+    for (unsigned int i = 0; i < v->size(); i++)
+      out.push_back(v->at(i));
+    return true;
+  }
+  Lazy_SeqP s = as_lazy_seq(coll);
+  if (not s)
+    return false;
+  for (; s; s = s->chunk_more())
+    for (unsigned int i = 0; i < s->chunk_size(); i++)
+      out.push_back(s->chunk_at(i));
+  return not Runtime::raised;
+}
+
+// A comparator returns a number, negative when a comes first, or whether a
+// comes first; without one values are sorted by their natural order.
+static std::function<bool(ElementP, ElementP)> less_than(FunctionP cmp) {
+  if (not cmp)
+    return [](ElementP a, ElementP b) { return order(a, b) < 0; };
+  return [cmp](ElementP a, ElementP b) {
+    ElementP ret = call(cmp, {a, b});
+    if (ret->type == NUMBER)
+      return ret->to<Number>()->value() < 0;
+    return is_truthy(ret);
+  };
+}
+
+//**************************************************************************
+//
+//                             NUMERIC ARRAYS
+//
+//**************************************************************************
+
+// Builds an array of zeros from a size, or converts an array or a sequence
+// of numbers.
+static ElementP make_array(Array::Kind kind, ElementP from,
+                           const std::string &name) {
+  if (from->type == NUMBER) {
+    if (from->to<Number>()->value() < 0)
+      THROW(name + ": size must not be negative");
+    return array(kind, from->to<Number>()->value())->el();
+  }
+  ArrayP ret = array(kind);
+  // long arrays only take whole numbers in their range
+  auto push = [&ret](double x) {
+    if (ret->kind == Array::DOUBLE)
+      ret->doubles.push_back(x);
+    else if (x == std::trunc(x) and x >= -0x1p63 and x < 0x1p63)
+      ret->longs.push_back(std::int64_t(x));
+    else
+      return false;
+    return true;
+  };
+  if (from->type == ARRAY) {
+    ArrayP a = from->to<Array>();
+    if (a->kind == Array::LONG and kind == Array::LONG) {
+      ret->longs = a->longs;
+      return ret->el();
+    }
+    for (std::size_t i = 0; i < a->size(); i++)
+      if (not push(a->double_at(i)))
+        THROW(name + ": values must be whole numbers in the range of longs");
+    return ret->el();
+  }
+  Lazy_SeqP s = as_lazy_seq(from);
+  if (not s)
+    THROW(name + ": argument must be a size or a sequence of numbers");
+  for (; s; s = s->chunk_more()) {
+    for (unsigned int i = 0; i < s->chunk_size(); i++) {
+      if (s->chunk_at(i)->type != NUMBER)
+        THROW(name + ": values must be numbers");
+      if (not push(s->chunk_at(i)->to<Number>()->value()))
+        THROW(name + ": values must be whole numbers in the range of longs");
+    }
+  }
+  return ret->el();
+}
+
+static ArrayP as_doubles(ArrayP a) {
+  return a->kind == Array::DOUBLE ? a : make_array(Array::DOUBLE, a, "")
+                                            ->to<Array>();
+}
+
+// Runs kernel(a, b, out, n) on an array and an array of the same size or
+// a number, in doubles if either side is.
+template <class Kernel>
+static ElementP elementwise(ListP args, const std::string &name,
+                            Kernel kernel) {
+  if (args->size() != 2 or args->at(0)->type != ARRAY or
+      (args->at(1)->type != ARRAY and args->at(1)->type != NUMBER))
+    THROW(name + ": arguments are an array and an array or a number");
+  ArrayP a = args->at(0)->to<Array>();
+  ElementP b = args->at(1);
+  if (b->type == ARRAY and b->to<Array>()->size() != a->size())
+    THROW(name + ": arrays must have the same size");
+  bool doubles = a->kind == Array::DOUBLE or
+                 (b->type == ARRAY and b->to<Array>()->kind == Array::DOUBLE) or
+                 (b->type == NUMBER and std::is_floating_point_v<Number_Value>);
+  std::size_t n = a->size();
+  ArrayP out = array(doubles ? Array::DOUBLE : Array::LONG, n);
+  if (doubles) {
+    a = as_doubles(a);
+    if (b->type == ARRAY)
+      kernel(a->doubles.data(), as_doubles(b->to<Array>())->doubles.data(),
+             out->doubles.data(), n);
+    else
+      kernel(a->doubles.data(), double(b->to<Number>()->value()),
+             out->doubles.data(), n);
+  } else {
+    if (b->type == ARRAY)
+      kernel(a->longs.data(), b->to<Array>()->longs.data(),
+             out->longs.data(), n);
+    else
+      kernel(a->longs.data(), std::int64_t(b->to<Number>()->value()),
+             out->longs.data(), n);
+  }
+  return out->el();
+}
+
+// Runs kernel(a, n) on the values of an array.
+template <class Kernel>
+static ElementP reduction(ListP args, const std::string &name, Kernel kernel,
+                          bool allow_empty) {
+  if (args->size() != 1 or args->at(0)->type != ARRAY)
+    THROW(name + ": argument must be an array");
+  ArrayP a = args->at(0)->to<Array>();
+  if (a->size() == 0 and not allow_empty)
+    THROW(name + ": array is empty");
+  if (a->kind == Array::DOUBLE)
+    return num_checked(kernel(a->doubles.data(), a->size()));
+  return num_checked(kernel(a->longs.data(), a->size()));
+}
+
+// Runs kernel(a, x, mask, n) on an array and a number, giving a mask.
+template <class Kernel>
+static ElementP make_mask(ListP args, const std::string &name, Kernel kernel) {
+  if (args->size() != 2 or args->at(0)->type != ARRAY or
+      args->at(1)->type != NUMBER)
+    THROW(name + ": arguments are an array and a number");
+  ArrayP a = args->at(0)->to<Array>(), ret = array(Array::LONG, a->size());
+  Number_Value x = args->at(1)->to<Number>()->value();
+  if (a->kind == Array::DOUBLE)
+    kernel(a->doubles.data(), double(x), ret->longs.data(), a->size());
+  else
+    kernel(a->longs.data(), std::int64_t(x), ret->longs.data(), a->size());
+  return ret->el();
+}
+
 EnvironmentP init_core(std::vector<std::string> argv) {
   EnvironmentP core = std::make_shared<Environment>(nil());
 
@@ -74,10 +794,11 @@ EnvironmentP init_core(std::vector<std::string> argv) {
 
   core->set("*host-language*", str("cpp"));
 
-  core->set("apply", func([core](ListP args) {
+  core->set("apply", func([](ListP args) {
               if (args->at_least(2) and args->at(0)->type == FUNCTION and
                   (args->at(args->size() - 1)->type == LIST or
-                   args->at(args->size() - 1)->type == VEC)) {
+                   args->at(args->size() - 1)->type == VEC or
+                   args->at(args->size() - 1)->type == LAZY_SEQ)) {
                 FunctionP f = args->at(0)->to<Function>();
                 ListP f_args = list();
                 for (unsigned int i = 1; i < args->size() - 1; i++) {
@@ -88,18 +809,17 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                   ListP l_arg = el_arg->to<List>();
                   for (unsigned int i = 0; i < l_arg->size(); i++)
                     f_args->append(l_arg->at(i));
+                } else if (el_arg->type == LAZY_SEQ) {
+                  for (Lazy_SeqP s = el_arg->to<Lazy_Seq>(); s;
+                       s = s->chunk_more())
+                    for (unsigned int i = 0; i < s->chunk_size(); i++)
+                      f_args->append(s->chunk_at(i));
                 } else {
                   VecP v_arg = el_arg->to<Vec>();
                   for (unsigned int i = 0; i < v_arg->size(); i++)
                     f_args->append(v_arg->at(i));
                 }
-                if (f->is_native()) {
-                  return f->apply(f_args);
-                } else {
-                  ElementP ast = f->get_exprs();
-                  EnvironmentP env = f->create_env(core, f_args);
-                  return EVAL(ast, env);
-                }
+                return tail_call(f, f_args);
               } else
                 return exc("apply: arguments are a function and its arguments, "
                            "last of whom must be a list or a vector whose "
@@ -109,7 +829,14 @@ EnvironmentP init_core(std::vector<std::string> argv) {
 
   core->set(
       "map", func([core](ListP args) {
-        if (args->at_least(2) and args->at(0)->type == FUNCTION and
+        if (args->size() == 1 and args->at(0)->type == FUNCTION) {
+          return map_xf(args->at(0)->to<Function>())->el();
+        } else if (args->at_least(2) and args->at(0)->type == FUNCTION and
+            (args->at(1)->type == LAZY_SEQ or args->at(1)->type == ARRAY)) {
+          return lazy_map(args->at(0)->to<Function>(),
+                          as_lazy_seq(args->at(1)))
+              ->el();
+        } else if (args->at_least(2) and args->at(0)->type == FUNCTION and
             (args->at(1)->type == LIST or args->at(1)->type == VEC)) {
           ListP ret = list();
           FunctionP f = args->at(0)->to<Function>();
@@ -133,7 +860,8 @@ EnvironmentP init_core(std::vector<std::string> argv) {
           else
             return ret->el();
         } else
-          return exc("map: arguments are a function and a list or a vector")
+          return exc("map: arguments are a function and a list, a vector or "
+                     "a lazy sequence")
               ->el();
       }));
 
@@ -141,33 +869,104 @@ EnvironmentP init_core(std::vector<std::string> argv) {
               return num(timeMillisec());
             }));
 
+  // **************************** PROFILER *********************************
+
+  core->set("profile-start", func([](ListP args) {
+              unsigned int interval = 1;
+              if (args->check_nth(0, NUMBER)) {
+                if (args->at(0)->to<Number>()->value() < 1)
+                  THROW("profile-start: interval must be at least 1 ms");
+                interval = args->at(0)->to<Number>()->value();
+              }
+              if (Profiler::start(interval))
+                return nil();
+              else
+                THROW("profile-start: profiler already running");
+            }));
+
+  core->set("profile-stop", func([](ListP args) {
+              if (not Profiler::running())
+                THROW("profile-stop: profiler not running");
+              std::string folded = Profiler::stop();
+              if (args->check_nth(0, STRING)) {
+                std::string path(args->at(0)->to<String>()->value());
+                std::ofstream ofs(path);
+                if (not ofs.is_open())
+                  THROW("profile-stop: error opening file");
+                ofs << folded;
+                return nil();
+              } else
+                return str(folded)->el();
+            }));
+
+  core->set("stack-trace", func([]([[maybe_unused]] ListP args) {
+              ListP ret = list();
+              for (std::string frame : Runtime::stack_trace())
+                ret->append(str(frame));
+              return ret->el();
+            }));
+
+  // ***************************** ENGINE **********************************
+
+  core->set("engine", func([](ListP args) {
+              if (args->size() == 1) {
+                if (args->at(0)->type != KEYWORD)
+                  THROW("engine: expects :tree or :closures");
+                std::string_view name = args->at(0)->to<Keyword>()->value();
+                if (name == "tree")
+                  Runtime::engine = Engine::TREE;
+                else if (name == "closures")
+                  Runtime::engine = Engine::CLOSURES;
+                else
+                  THROW("engine: expects :tree or :closures");
+              } else if (args->size() > 1)
+                THROW("engine: expects at most one argument");
+              return kw(Runtime::engine == Engine::TREE ? "tree" : "closures")
+                  ->el();
+            }));
+
+  core->set("jit", func([](ListP args) {
+              if (args->size() == 1) {
+                bool on = not(args->at(0)->type == NIL or
+                              (args->at(0)->type == BOOLEAN and
+                               not args->at(0)->to<Boolean>()->value()));
+                if (on and not Jit::available())
+                  THROW("jit: not built with LMLISP_JIT");
+                Jit::enabled = on;
+              } else if (args->size() > 1)
+                THROW("jit: expects at most one argument");
+              return boolean(Jit::enabled)->el();
+            }));
+
+  // *************************** STATISTICS ********************************
+
+  core->set("runtime-stats", func([]([[maybe_unused]] ListP args) {
+              return stats_dict()->el();
+            }));
+
+  core->set("reset-runtime-stats", func([]([[maybe_unused]] ListP args) {
+              reset_stats();
+              return nil();
+            }));
+
   // ****************************** IO ************************************
 
   core->set("prn", func([](ListP args) {
-              std::string ret;
-              if (args->size() > 1)
-                for (unsigned int i = 0; i < args->size() - 1; i++)
-                  ret += pr_str(args->at(i), true) + " ";
-              if (args->size() > 0)
-                ret += pr_str(args->at(args->size() - 1), true);
-              writeln(ret);
+              writeln(join_printed(args, true));
               return nil();
             }));
 
   core->set("println", func([](ListP args) {
-              std::string ret;
-              if (args->size() > 1)
-                for (unsigned int i = 0; i < args->size() - 1; i++)
-                  ret += pr_str(args->at(i), false) + " ";
-              if (args->size() > 0)
-                ret += pr_str(args->at(args->size() - 1), false);
-              writeln(ret);
+              writeln(join_printed(args, false));
               return nil();
             }));
 
   core->set("read-string", func([core](ListP args) {
               if (args->at_least(1) and args->check_nth(0, STRING)) {
-                return read_str(pr_str(args->at(0), false))->el();
+                std::string filename(args->check_nth(1, STRING)
+                                         ? args->at(1)->to<String>()->value()
+                                         : "");
+                return read_str(pr_str(args->at(0), false), filename)->el();
               } else {
                 THROW("read-string: argument must be a string");
               }
@@ -175,7 +974,8 @@ EnvironmentP init_core(std::vector<std::string> argv) {
 
   core->set("slurp", func([](ListP args) {
               if (args->at_least(1) and args->check_nth(0, STRING)) {
-                std::ifstream ifs(args->at(0)->to<String>()->value());
+                std::string path(args->at(0)->to<String>()->value());
+                std::ifstream ifs(path);
                 if (ifs.is_open()) {
                   std::ostringstream ss;
                   ss << ifs.rdbuf();
@@ -187,11 +987,58 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 return exc("slurp: wrong argument")->el();
             }));
 
+  core->set("read-json", func([](ListP args) {
+              if (args->size() != 1 or args->at(0)->type != STRING)
+                THROW("read-json: argument must be a string");
+              return read_json(args->at(0)->to<String>()->value());
+            }));
+
+  core->set("read-json-file", func([](ListP args) {
+              if (args->size() != 1 or args->at(0)->type != STRING)
+                THROW("read-json-file: argument must be a path");
+              Mapped_File file(std::string(args->at(0)->to<String>()->value()));
+              if (not file.is_open())
+                THROW("read-json-file: error opening file");
+              return read_json(file.text());
+            }));
+
+  core->set("write-json", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("write-json: takes one argument");
+              std::string ret;
+              if (not write_json(args->at(0), ret))
+                return nil();
+              return str(ret)->el();
+            }));
+
+  core->set("read-csv", func([](ListP args) {
+              if (args->size() < 1 or args->size() > 2 or
+                  args->at(0)->type != STRING)
+                THROW("read-csv: arguments are a string and an optional "
+                      "header flag");
+              return read_csv(args->at(0)->to<String>()->value(),
+                              args->size() == 1 or is_truthy(args->at(1)));
+            }));
+
+  core->set("read-csv-file", func([](ListP args) {
+              if (args->size() < 1 or args->size() > 2 or
+                  args->at(0)->type != STRING)
+                THROW("read-csv-file: arguments are a path and an optional "
+                      "header flag");
+              Mapped_File file(std::string(args->at(0)->to<String>()->value()));
+              if (not file.is_open())
+                THROW("read-csv-file: error opening file");
+              return read_csv(file.text(),
+                              args->size() == 1 or is_truthy(args->at(1)));
+            }));
+
   core->set("readline", func([](ListP args) {
               if (args->size() == 0) {
                 return str(readln(""))->el();
               } else if (args->at(0)->type == STRING) {
-                return str(readln(args->at(0)->to<String>()->value()))->el();
+                return str(readln(std::string(
+                               args->at(0)->to<String>()->value())))
+                    ->el();
               } else
                 THROW("readline needs a string as argument");
             }));
@@ -227,6 +1074,16 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 return exc("true?: requires one argument")->el();
             }));
 
+  core->set("not", func([](ListP args) {
+              if (args->size() == 1) {
+                return boolean(args->at(0)->type == NIL or
+                               (args->at(0)->type == BOOLEAN and
+                                not args->at(0)->to<Boolean>()->value()))
+                    ->el();
+              } else
+                return exc("not: requires one argument")->el();
+            }));
+
   core->set("false?", func([](ListP args) {
               if (args->size() == 1) {
                 return boolean(args->at(0)->type == BOOLEAN and
@@ -274,7 +1131,8 @@ EnvironmentP init_core(std::vector<std::string> argv) {
   core->set("sequential?", func([](ListP args) {
               if (args->size() == 1) {
                 return boolean(args->at(0)->type == VEC or
-                               args->at(0)->type == LIST)
+                               args->at(0)->type == LIST or
+                               args->at(0)->type == LAZY_SEQ)
                     ->el();
               } else
                 return exc("vector?: requires one argument")->el();
@@ -334,16 +1192,45 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 return boolean(args->at(0)->to<List>()->size() == 0)->el();
               } else if (args->size() >= 1 and args->at(0)->type == VEC) {
                 return boolean(args->at(0)->to<Vec>()->size() == 0)->el();
+              } else if (args->size() >= 1 and args->at(0)->type == LAZY_SEQ) {
+                return boolean(args->at(0)->to<Lazy_Seq>()->empty())->el();
               } else {
                 return nil()->el();
               }
             }));
 
   core->set("count", func([](ListP args) {
-              if (args->size() == 1 and args->at(0)->type == LIST) {
+              if (args->size() == 1 and args->at(0)->type == LAZY_SEQ) {
+                Lazy_SeqP s = args->at(0)->to<Lazy_Seq>();
+                args.reset(); // don't hold on to the head while walking
+                unsigned int n = 0;
+                for (; s; s = s->chunk_more())
+                  n += s->chunk_size();
+                return num(n)->el();
+              } else if (args->size() == 1 and args->at(0)->type == LIST) {
                 return num(args->at(0)->to<List>()->size())->el();
               } else if (args->size() == 1 and args->at(0)->type == VEC) {
                 return num(args->at(0)->to<Vec>()->size())->el();
+              } else if (args->size() == 1 and args->at(0)->type == DICT) {
+                return num(args->at(0)->to<Dict>()->size())->el();
+              } else if (args->size() == 1 and args->at(0)->type == ARRAY) {
+                return num(args->at(0)->to<Array>()->size())->el();
+              } else if (args->size() == 1 and args->at(0)->type == STRING) {
+                // bytes, not characters, like the indices of subs and seq
+                return num(args->at(0)->to<String>()->size())->el();
+              } else if (args->size() == 1 and
+                         args->at(0)->type == STRING_BUILDER) {
+                return num(args->at(0)->to<String_Builder>()->buffer.size())
+                    ->el();
+              } else if (args->size() == 1 and args->at(0)->type == TABLE) {
+                return num(args->at(0)->to<Table>()->rows())->el();
+              } else if (args->size() == 1 and args->at(0)->type == TRANSIENT) {
+                ElementP coll = editable(args->at(0), "count");
+                if (not coll)
+                  return nil();
+                return coll->type == VEC
+                           ? num(coll->to<Vec>()->size())->el()
+                           : num(coll->to<Dict>()->size())->el();
               } else if (args->size() == 1 and args->at(0)->type == NIL) {
                 return num(0)->el();
               } else {
@@ -376,8 +1263,37 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                   return v->at(index);
                 } else
                   THROW("nth: index out of bounds");
+              } else if (args->size() == 2 and args->at(0)->type == LAZY_SEQ and
+                         args->at(1)->type == NUMBER) {
+                Lazy_SeqP s = args->at(0)->to<Lazy_Seq>();
+#ifdef _LM_WITH_FLOAT
+                int index = floor(args->at(1)->to<Number>()->value());
+#else
+                int index = args->at(1)->to<Number>()->value();
+#endif
+                args.reset(); // don't hold on to the head while walking
+                if (index < 0)
+                  THROW("nth: index out of bounds");
+                unsigned int left = index;
+                for (; s and left >= s->chunk_size(); s = s->chunk_more())
+                  left -= s->chunk_size();
+                if (not s)
+                  THROW("nth: index out of bounds");
+                return s->chunk_at(left);
+              } else if (args->size() == 2 and args->at(0)->type == ARRAY and
+                         args->at(1)->type == NUMBER) {
+                ArrayP a = args->at(0)->to<Array>();
+#ifdef _LM_WITH_FLOAT
+                int index = floor(args->at(1)->to<Number>()->value());
+#else
+                int index = args->at(1)->to<Number>()->value();
+#endif
+                if (index >= 0 and index < static_cast<int>(a->size())) {
+                  return a->at(index);
+                } else
+                  THROW("nth: index out of bounds");
               } else
-                THROW("nth: arguments are a list or a vector and an index");
+                THROW("nth: arguments are a sequence and an index");
             }));
 
   core->set("first", func([](ListP args) {
@@ -391,7 +1307,9 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                   return nil()->el();
                 else
                   return args->at(0)->to<Vec>()->at(0);
-              } else if (args->check_nth(0, NIL))
+              } else if (args->check_nth(0, LAZY_SEQ))
+                return args->at(0)->to<Lazy_Seq>()->first();
+              else if (args->check_nth(0, NIL))
                 return nil()->el();
               else
                 return exc("first: argument is a list or a vector")->el();
@@ -418,7 +1336,9 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                     ret->append(v->at(i));
                   return ret->el();
                 }
-              } else if (args->check_nth(0, NIL))
+              } else if (args->check_nth(0, LAZY_SEQ))
+                return args->at(0)->to<Lazy_Seq>()->rest();
+              else if (args->check_nth(0, NIL))
                 return list()->el();
 
               else
@@ -426,7 +1346,12 @@ EnvironmentP init_core(std::vector<std::string> argv) {
             }));
 
   core->set("conj", func([](ListP args) {
-              if (args->at_least(2)) {
+              // the 0 and 1 argument forms make conj a reducing function
+              if (args->size() == 0) {
+                return vec()->el();
+              } else if (args->size() == 1) {
+                return args->at(0);
+              } else if (args->at_least(2)) {
                 switch (args->at(0)->type) {
                 case LIST: {
                   ListP ret = list();
@@ -458,29 +1383,608 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                   THROW("conj: first argument must be a list or a vector");
                 }
               } else {
-                THROW("conj: pass at least two arguments");
+                THROW("conj: pass a collection and the elements to add");
               }
             }));
 
-  // ***************************** STRING **********************************
+  // ************************* LAZY SEQUENCES ******************************
 
-  core->set("pr-str", func([](ListP args) {
-              std::string ret = "";
-              if (args->size() > 0) {
-                if (args->size() > 1) {
-                  for (unsigned int i = 0; i < args->size() - 1; i++)
-                    ret += pr_str(args->at(i), true) + " ";
+  core->set("range", func([](ListP args) {
+              for (unsigned int i = 0; i < args->size(); i++)
+                if (args->at(i)->type != NUMBER)
+                  THROW("range: arguments must be numbers");
+              Number_Value start = 0, end = 0, step = 1;
+              if (args->size() == 1) {
+                end = args->at(0)->to<Number>()->value();
+              } else if (args->size() >= 2) {
+                start = args->at(0)->to<Number>()->value();
+                end = args->at(1)->to<Number>()->value();
+                if (args->size() >= 3)
+                  step = args->at(2)->to<Number>()->value();
+              }
+              return lazy_range(start, end, step, args->size() > 0)->el();
+            }));
+
+  core->set("iterate", func([](ListP args) {
+              if (args->size() == 2 and args->at(0)->type == FUNCTION) {
+                return lazy_iterate(args->at(0)->to<Function>(), args->at(1))
+                    ->el();
+              } else
+                THROW("iterate: arguments are a function and a value");
+            }));
+
+  core->set("take", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() == 1 and args->at(0)->type == NUMBER) {
+                return take_xf(args->at(0)->to<Number>()->value())->el();
+              } else if (args->size() == 2 and args->at(0)->type == NUMBER and
+                  (s = as_lazy_seq(args->at(1)))) {
+                return lazy_take(args->at(0)->to<Number>()->value(), s)->el();
+              } else
+                THROW("take: arguments are a number and a sequence");
+            }));
+
+  core->set("drop", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() == 2 and args->at(0)->type == NUMBER and
+                  (s = as_lazy_seq(args->at(1)))) {
+                return lazy_drop(args->at(0)->to<Number>()->value(), s)->el();
+              } else
+                THROW("drop: arguments are a number and a sequence");
+            }));
+
+  core->set("filter", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() == 1 and args->at(0)->type == FUNCTION) {
+                return filter_xf(args->at(0)->to<Function>())->el();
+              } else if (args->size() == 2 and args->at(0)->type == FUNCTION and
+                  (s = as_lazy_seq(args->at(1)))) {
+                return lazy_filter(args->at(0)->to<Function>(), s)->el();
+              } else
+                THROW("filter: arguments are a predicate and a sequence");
+            }));
+
+  core->set("mapcat", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() == 1 and args->at(0)->type == FUNCTION) {
+                return mapcat_xf(args->at(0)->to<Function>())->el();
+              } else if (args->size() == 2 and args->at(0)->type == FUNCTION and
+                         (s = as_lazy_seq(args->at(1)))) {
+                return sequence(mapcat_xf(args->at(0)->to<Function>()), s)
+                    ->el();
+              } else
+                THROW("mapcat: arguments are a function and a sequence");
+            }));
+
+  // ****************************** FOLD ***********************************
+
+  core->set("fold", func([](ListP args) {
+              unsigned int n = FOLD_CHUNK_SIZE, first = 0;
+              if (args->size() == 4) {
+                if (args->at(0)->type != NUMBER or
+                    args->at(0)->to<Number>()->value() < 1)
+                  THROW("fold: chunk size must be a positive number");
+                n = args->at(0)->to<Number>()->value();
+                first = 1;
+              }
+              if (args->size() < 2 or args->size() > 4)
+                THROW("fold: arguments are an optional chunk size, an "
+                      "optional combining function, a reducing function "
+                      "and a collection");
+              for (unsigned int i = first; i + 1 < args->size(); i++)
+                if (args->at(i)->type != FUNCTION)
+                  THROW("fold: combining and reducing functions must be "
+                        "functions");
+              FunctionP rf = args->at(args->size() - 2)->to<Function>();
+              FunctionP combinef = args->at(first)->to<Function>();
+              return fold(n, combinef, rf, args->at(args->size() - 1));
+            }));
+
+  core->set(
+      "frequencies", func([](ListP args) {
+        if (args->size() != 1)
+          THROW("frequencies: takes one argument");
+        FunctionP count = func([](ListP args) {
+          DictP counts = args->at(0)->to<Dict>();
+          ElementP x = args->at(1);
+          if (not is_dict_key(x))
+            THROW("frequencies: values must be keywords or strings");
+          ElementP n = counts->get(x);
+          counts->append(x,
+                         num(n->type == NUMBER ? n->to<Number>()->value() + 1
+                                               : 1));
+          return counts->el();
+        });
+        FunctionP combine = merge_dicts([](DictP into, ElementP key,
+                                           ElementP value) {
+          ElementP n = into->get(key);
+          if (n->type == NUMBER)
+            value = num(n->to<Number>()->value() +
+                        value->to<Number>()->value());
+          into->append(key, value);
+        });
+        return fold(FOLD_CHUNK_SIZE, combine, count, args->at(0));
+      }));
+
+  core->set(
+      "group-by", func([](ListP args) {
+        if (args->size() == 3 and args->at(0)->type == TABLE and
+            args->at(2)->type == DICT)
+          return table_group_by(args->at(0)->to<Table>(), args->at(1),
+                                args->at(2)->to<Dict>());
+        if (args->size() != 2 or args->at(0)->type != FUNCTION)
+          THROW("group-by: arguments are a function and a collection, or a "
+                "table, its key columns and a dict of aggregates");
+        FunctionP f = args->at(0)->to<Function>();
+        FunctionP group = func([f](ListP args) {
+          DictP groups = args->at(0)->to<Dict>();
+          ElementP x = args->at(1), key = call(f, {x});
+          if (Runtime::raised)
+            return nil();
+          if (not is_dict_key(key))
+            THROW("group-by: keys must be keywords or strings");
+          ElementP members = groups->get(key);
+          if (members->type != VEC) {
+            members = vec();
+            groups->append(key, members);
+          }
+          members->to<Vec>()->append(x);
+          return groups->el();
+        });
+        FunctionP combine =
+            merge_dicts([](DictP into, ElementP key, ElementP value) {
+              ElementP members = into->get(key);
+              if (members->type != VEC) {
+                into->append(key, value);
+                return;
+              }
+              for (unsigned int i = 0; i < value->to<Vec>()->size(); i++)
+                members->to<Vec>()->append(value->to<Vec>()->at(i));
+            });
+        return fold(FOLD_CHUNK_SIZE, combine, group, args->at(1));
+      }));
+
+  // ****************************** SORT ***********************************
+
+  core->set("compare", func([](ListP args) {
+              if (args->size() != 2)
+                THROW("compare: pass two values to compare");
+              int ret = order(args->at(0), args->at(1));
+              if (Runtime::raised)
+                return nil();
+              return num((ret > 0) - (ret < 0))->el();
+            }));
+
+  core->set("sort", func([](ListP args) {
+              std::vector<ElementP> items;
+              FunctionP cmp;
+              if (args->size() == 2 and args->at(0)->type == FUNCTION)
+                cmp = args->at(0)->to<Function>();
+              else if (args->size() != 1)
+                THROW("sort: arguments are an optional comparator and a "
+                      "collection");
+              if (not collect(args->at(args->size() - 1), items))
+                THROW("sort: collection must be a sequence");
+              args.reset();
+              if (not sort_items(items, less_than(cmp)))
+                return nil();
+              ListP ret = list();
+              ret->reserve(items.size());
+              for (ElementP el : items)
+                ret->append(el);
+              return ret->el();
+            }));
+
+  core->set(
+      "sort-by", func([](ListP args) {
+        std::vector<ElementP> items;
+        FunctionP cmp;
+        if ((args->size() == 2 or args->size() == 3) and
+            args->at(0)->type == FUNCTION) {
+          if (args->size() == 3 and args->at(1)->type == FUNCTION)
+            cmp = args->at(1)->to<Function>();
+          else if (args->size() == 3)
+            THROW("sort-by: comparator must be a function");
+        } else
+          THROW("sort-by: arguments are a key function, an optional "
+                "comparator and a collection");
+        FunctionP key = args->at(0)->to<Function>();
+        if (not collect(args->at(args->size() - 1), items))
+          THROW("sort-by: collection must be a sequence");
+        args.reset();
+        // the key function runs once per value, in chunks on the pool
+        std::vector<std::pair<ElementP, ElementP>> keyed(items.size());
+        unsigned int size = items.size();
+        unsigned int chunks = (size + FOLD_CHUNK_SIZE - 1) / FOLD_CHUNK_SIZE;
+        if (not run_parallel(chunks, [&](unsigned int c) {
+              unsigned int end = std::min(size, (c + 1) * FOLD_CHUNK_SIZE);
+              for (unsigned int i = c * FOLD_CHUNK_SIZE;
+                   i < end and not Runtime::raised; i++)
+                keyed[i] = {call(key, {items[i]}), items[i]};
+            }))
+          return nil();
+        items.clear();
+        std::function<bool(ElementP, ElementP)> less = less_than(cmp);
+        if (not sort_items(keyed,
+                           [&less](const std::pair<ElementP, ElementP> &a,
+                                   const std::pair<ElementP, ElementP> &b) {
+                             return less(a.first, b.first);
+                           }))
+          return nil();
+        ListP ret = list();
+        ret->reserve(keyed.size());
+        for (const auto &[k, el] : keyed)
+          ret->append(el);
+        return ret->el();
+      }));
+
+  // ************************* NUMERIC ARRAYS ******************************
+
+  core->set("double-array", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("double-array: takes one argument");
+              return make_array(Array::DOUBLE, args->at(0), "double-array");
+            }));
+
+  core->set("long-array", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("long-array: takes one argument");
+              return make_array(Array::LONG, args->at(0), "long-array");
+            }));
+
+  core->set("array?", func([](ListP args) {
+              TEST_DO_OR_EXC(
+                  args->size() == 1,
+                  { return boolean(args->at(0)->type == ARRAY)->el(); },
+                  "array?: takes one argument");
+            }));
+
+  core->set("asum", func([](ListP args) {
+              return reduction(
+                  args, "asum",
+                  [](const auto *a, std::size_t n) {
+                    return kernels::sum(a, n);
+                  },
+                  true);
+            }));
+
+  core->set("amin", func([](ListP args) {
+              return reduction(
+                  args, "amin",
+                  [](const auto *a, std::size_t n) {
+                    return kernels::min(a, n);
+                  },
+                  false);
+            }));
+
+  core->set("amax", func([](ListP args) {
+              return reduction(
+                  args, "amax",
+                  [](const auto *a, std::size_t n) {
+                    return kernels::max(a, n);
+                  },
+                  false);
+            }));
+
+  core->set("adot", func([](ListP args) {
+              if (args->size() != 2 or args->at(0)->type != ARRAY or
+                  args->at(1)->type != ARRAY)
+                THROW("adot: arguments are two arrays");
+              ArrayP a = args->at(0)->to<Array>(), b = args->at(1)->to<Array>();
+              if (a->size() != b->size())
+                THROW("adot: arrays must have the same size");
+              if (a->kind == Array::LONG and b->kind == Array::LONG)
+                return num_checked(
+                    kernels::dot(a->longs.data(), b->longs.data(), a->size()));
+              return num_checked(kernels::dot(as_doubles(a)->doubles.data(),
+                                             as_doubles(b)->doubles.data(),
+                                             a->size()));
+            }));
+
+  core->set("amap+", func([](ListP args) {
+              return elementwise(args, "amap+",
+                                 [](const auto *a, auto b, auto *out,
+                                    std::size_t n) {
+                                   kernels::add(a, b, out, n);
+                                 });
+            }));
+
+  core->set("a*", func([](ListP args) {
+              return elementwise(args, "a*",
+                                 [](const auto *a, auto b, auto *out,
+                                    std::size_t n) {
+                                   kernels::mul(a, b, out, n);
+                                 });
+            }));
+
+  core->set("a<", func([](ListP args) {
+              return make_mask(args, "a<",
+                          [](const auto *a, auto x, std::int64_t *mask,
+                             std::size_t n) { kernels::less(a, x, mask, n); });
+            }));
+
+  core->set("a>", func([](ListP args) {
+              return make_mask(
+                  args, "a>",
+                  [](const auto *a, auto x, std::int64_t *mask,
+                     std::size_t n) { kernels::greater(a, x, mask, n); });
+            }));
+
+  core->set(
+      "afilter", func([](ListP args) {
+        if (args->size() != 2 or args->at(1)->type != ARRAY)
+          THROW("afilter: arguments are a predicate or a mask and an array");
+        ArrayP a = args->at(1)->to<Array>(), m;
+        if (args->at(0)->type == ARRAY) {
+          m = args->at(0)->to<Array>();
+          if (m->kind != Array::LONG or m->size() != a->size())
+            THROW("afilter: mask must be a long-array of the array's size");
+        } else if (args->at(0)->type == FUNCTION) {
+          FunctionP pred = args->at(0)->to<Function>();
+          m = array(Array::LONG, a->size());
+          for (std::size_t i = 0; i < a->size(); i++) {
+            m->longs[i] = is_truthy(call(pred, {a->at(i)}));
+            if (Runtime::raised)
+              return nil();
+          }
+        } else
+          THROW("afilter: arguments are a predicate or a mask and an array");
+        ArrayP ret = array(a->kind, a->size());
+        std::size_t n;
+        if (a->kind == Array::DOUBLE) {
+          n = kernels::compress(a->doubles.data(), m->longs.data(),
+                                ret->doubles.data(), a->size());
+          ret->doubles.resize(n);
+        } else {
+          n = kernels::compress(a->longs.data(), m->longs.data(),
+                                ret->longs.data(), a->size());
+          ret->longs.resize(n);
+        }
+        return ret->el();
+      }));
+
+  // ***************************** TABLE ***********************************
+
+  core->set("table", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("table: argument must be a dict of columns or a "
+                      "sequence of row dicts");
+              return make_table(args->at(0));
+            }));
+
+  core->set("table?", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("table?: takes one argument");
+              return boolean(args->at(0)->type == TABLE)->el();
+            }));
+
+  core->set("columns", func([](ListP args) {
+              if (args->size() != 1 or args->at(0)->type != TABLE)
+                THROW("columns: argument must be a table");
+              VecP ret = vec();
+              for (const std::string &name : args->at(0)->to<Table>()->names)
+                ret->append(kw(name));
+              return ret->el();
+            }));
+
+  core->set("column", func([](ListP args) {
+              if (args->size() != 2 or args->at(0)->type != TABLE)
+                THROW("column: arguments are a table and a column name");
+              return table_column(args->at(0)->to<Table>(), args->at(1));
+            }));
+
+  core->set("rows", func([](ListP args) {
+              if (args->size() != 1 or args->at(0)->type != TABLE)
+                THROW("rows: argument must be a table");
+              return table_rows(args->at(0)->to<Table>());
+            }));
+
+  core->set("select", func([](ListP args) {
+              if (args->size() != 2 or args->at(0)->type != TABLE)
+                THROW("select: arguments are a table and column names");
+              return table_select(args->at(0)->to<Table>(), args->at(1));
+            }));
+
+  core->set("where", func([](ListP args) {
+              if (args->size() == 3 and args->at(0)->type == TABLE)
+                return table_where(args->at(0)->to<Table>(), args->at(1),
+                                   args->at(2), nil());
+              if (args->size() != 4 or args->at(0)->type != TABLE)
+                THROW("where: arguments are a table, a column, and an "
+                      "operator and a value or a predicate");
+              return table_where(args->at(0)->to<Table>(), args->at(1),
+                                 args->at(2), args->at(3));
+            }));
+
+  core->set("join", func([](ListP args) {
+              if (args->size() != 3 or args->at(0)->type != TABLE or
+                  args->at(1)->type != TABLE)
+                THROW("join: arguments are two tables and a key column");
+              return table_join(args->at(0)->to<Table>(),
+                                args->at(1)->to<Table>(), args->at(2));
+            }));
+
+  // ***************************** REDUCE **********************************
+
+  core->set("reduce", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() >= 2 and args->size() <= 3 and
+                  args->at(0)->type == FUNCTION and
+                  (s = as_lazy_seq(args->at(args->size() - 1)))) {
+                FunctionP f = args->at(0)->to<Function>();
+                bool has_init = args->size() == 3;
+                ElementP acc = has_init ? args->at(1) : nil();
+                args.reset(); // don't hold on to the head while walking
+                if (not has_init) {
+                  if (s->empty())
+                    return call(f, {});
+                  acc = s->first();
+                  s = s->slice(1, s->chunk_size(), s->chunk_more());
+                }
+                return reduce(f, acc, s);
+              } else
+                THROW("reduce: arguments are a function, an optional initial "
+                      "value and a sequence");
+            }));
+
+  core->set("reduced", func([](ListP args) {
+              TEST_DO_OR_EXC(
+                  args->size() == 1, { return reduced(args->at(0))->el(); },
+                  "reduced: takes one argument");
+            }));
+
+  core->set("reduced?", func([](ListP args) {
+              TEST_DO_OR_EXC(
+                  args->size() == 1,
+                  { return boolean(args->at(0)->type == REDUCED)->el(); },
+                  "reduced?: takes one argument");
+            }));
+
+  core->set("transduce", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() >= 3 and args->size() <= 4 and
+                  args->at(0)->type == FUNCTION and
+                  args->at(1)->type == FUNCTION and
+                  (s = as_lazy_seq(args->at(args->size() - 1)))) {
+                FunctionP f = args->at(1)->to<Function>();
+                ElementP rf = call(args->at(0)->to<Function>(), {f});
+                if (rf->type != FUNCTION)
+                  THROW("transduce: transducer must return a function");
+                ElementP acc = args->size() == 4 ? args->at(2) : rf_init(f);
+                args.reset(); // don't hold on to the head while walking
+                acc = reduce(rf->to<Function>(), acc, s);
+                if (Runtime::raised)
+                  return nil();
+                return rf_complete(rf->to<Function>(), acc);
+              } else
+                THROW("transduce: arguments are a transducer, a reducing "
+                      "function, an optional initial value and a sequence");
+            }));
+
+  core->set("into", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() < 2 or args->size() > 3 or
+                  not(s = as_lazy_seq(args->at(args->size() - 1))))
+                THROW("into: arguments are a collection, an optional "
+                      "transducer and a sequence");
+              ElementP to = args->at(0);
+              std::shared_ptr<std::vector<ElementP>> items =
+                  std::make_shared<std::vector<ElementP>>();
+              FunctionP rf = func([items](ListP args) {
+                if (args->size() == 2)
+                  items->push_back(args->at(1));
+                return args->size() > 0 ? args->at(0) : nil();
+              });
+              if (args->size() == 3) {
+                if (args->at(1)->type != FUNCTION)
+                  THROW("into: transducer must be a function");
+                ElementP xrf = call(args->at(1)->to<Function>(), {rf});
+                if (xrf->type != FUNCTION)
+                  THROW("into: transducer must return a function");
+                rf = xrf->to<Function>();
+              }
+              args.reset(); // don't hold on to the head while walking
+              rf_complete(rf, reduce(rf, nil(), s));
+              if (Runtime::raised)
+                return nil();
+              switch (to->type) {
+              case VEC: {
+                VecP ret = vec();
+                for (unsigned int i = 0; i < to->to<Vec>()->size(); i++)
+                  ret->append(to->to<Vec>()->at(i));
+                for (ElementP el : *items)
+                  ret->append(el);
+                return ret->el();
+              }
+              case NIL:
+              case LIST: {
+                ListP ret = list();
+                for (int i = items->size() - 1; i >= 0; i--)
+                  ret->append((*items)[i]);
+                if (to->type == LIST)
+                  for (unsigned int i = 0; i < to->to<List>()->size(); i++)
+                    ret->append(to->to<List>()->at(i));
+                return ret->el();
+              }
+              case DICT: {
+                DictP ret = dict(), orig = to->to<Dict>();
+                ListP keys = orig->keys();
+                for (unsigned int i = 0; i < keys->size(); i++)
+                  ret->append(keys->at(i), orig->get(keys->at(i)));
+                for (ElementP el : *items) {
+                  if (el->type != VEC or el->to<Vec>()->size() != 2 or
+                      (el->to<Vec>()->at(0)->type != KEYWORD and
+                       el->to<Vec>()->at(0)->type != STRING))
+                    THROW("into: dict entries must be [key value] vectors");
+                  ret->append(el->to<Vec>()->at(0), el->to<Vec>()->at(1));
                 }
-                ret += pr_str(args->at(args->size() - 1), true);
+                return ret->el();
+              }
+              default:
+                THROW("into: first argument must be a list, a vector or a "
+                      "dict");
               }
-              return str(ret);
             }));
 
-  core->set("str", func([](ListP args) {
-              std::string ret = "";
-              for (unsigned int i = 0; i < args->size(); i++)
-                ret += pr_str(args->at(i), false);
-              return str(ret)->el();
+  core->set("sequence", func([](ListP args) {
+              Lazy_SeqP s;
+              if (args->size() == 1 and (s = as_lazy_seq(args->at(0)))) {
+                return s->el();
+              } else if (args->size() == 2 and args->at(0)->type == FUNCTION and
+                         (s = as_lazy_seq(args->at(1)))) {
+                return sequence(args->at(0)->to<Function>(), s)->el();
+              } else
+                THROW("sequence: arguments are an optional transducer and a "
+                      "sequence");
+            }));
+
+  core->set("comp", func([](ListP args) {
+              std::vector<FunctionP> fs;
+              for (unsigned int i = 0; i < args->size(); i++) {
+                if (args->at(i)->type != FUNCTION)
+                  THROW("comp: arguments must be functions");
+                fs.push_back(args->at(i)->to<Function>());
+              }
+              return func([fs](ListP args) {
+                       if (fs.empty())
+                         return args->size() > 0 ? args->at(0) : nil();
+                       ElementP ret = apply(fs.back(), args);
+                       for (int i = fs.size() - 2; i >= 0; i--)
+                         ret = call(fs[i], {ret});
+                       return ret;
+                     })
+                  ->el();
+            }));
+
+  core->set("identity", func([](ListP args) {
+              TEST_DO_OR_EXC(
+                  args->size() == 1, { return args->at(0); },
+                  "identity: takes one argument");
+            }));
+
+  // ***************************** STRING **********************************
+
+  core->set("pr-str", func([](ListP args) {
+              return str(join_printed(args, true))->el();
+            }));
+
+  core->set("str", func([](ListP args) { return str_of(args)->el(); }));
+
+  // the substring shares the buffer of s
+  core->set("subs", func([](ListP args) {
+              if (args->size() < 2 or args->size() > 3 or
+                  args->at(0)->type != STRING or args->at(1)->type != NUMBER or
+                  (args->size() == 3 and args->at(2)->type != NUMBER))
+                THROW("subs: arguments are a string, a start and an optional "
+                      "end index");
+              const Text &s = args->at(0)->to<String>()->text();
+              Number_Value start = args->at(1)->to<Number>()->value();
+              Number_Value end = args->size() == 3
+                                     ? args->at(2)->to<Number>()->value()
+                                     : Number_Value(s.size());
+              if (start < 0 or end < start or end > Number_Value(s.size()))
+                THROW("subs: index out of range");
+              return str(s.substr(start, end - start))->el();
             }));
 
   core->set("seq", func([](ListP args) {
@@ -489,7 +1993,8 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 case NIL:
                   return nil()->el();
                 case STRING: {
-                  std::string content = args->at(0)->to<String>()->value();
+                  std::string_view content =
+                      args->at(0)->to<String>()->value();
                   if (content.empty())
                     return nil()->el();
                   else {
@@ -504,6 +2009,9 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 if (args->at(0)->to<List>()->size() == 0) return nil()->el();
                 else return args->at(0);
                 }
+                case LAZY_SEQ:
+                if (args->at(0)->to<Lazy_Seq>()->empty()) return nil()->el();
+                else return args->at(0);
                 case VEC:
                 if (args->at(0)->to<Vec>()->size() == 0) return nil()->el();
                 else {
@@ -520,11 +2028,38 @@ EnvironmentP init_core(std::vector<std::string> argv) {
               }
             }));
 
+  core->set("string-builder", func([](ListP args) {
+              String_BuilderP ret = string_builder();
+              for (unsigned int i = 0; i < args->size(); i++)
+                pr_str(args->at(i), false, ret->buffer);
+              return ret->el();
+            }));
+
+  core->set("sb-append!", func([](ListP args) {
+              if (args->size() < 1)
+                THROW("sb-append!: pass a string builder");
+              String_BuilderP sb = builder(args->at(0), "sb-append!");
+              if (not sb)
+                return nil();
+              for (unsigned int i = 1; i < args->size(); i++)
+                pr_str(args->at(i), false, sb->buffer);
+              return sb->el();
+            }));
+
+  core->set("sb->str", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("sb->str: pass a string builder");
+              String_BuilderP sb = builder(args->at(0), "sb->str");
+              if (not sb)
+                return nil();
+              return str(sb->buffer)->el();
+            }));
+
   // ***************************** SYMBOL **********************************
 
   core->set("symbol", func([](ListP args) {
               if (args->size() == 1 and args->at(0)->type == STRING) {
-                return sym(args->at(0)->to<String>()->value())->el();
+                return sym(args->at(0)->to<String>()->text())->el();
               } else
                 return exc("symbol: expects a string as argument")->el();
             }));
@@ -533,7 +2068,7 @@ EnvironmentP init_core(std::vector<std::string> argv) {
 
   core->set("keyword", func([](ListP args) {
               if (args->size() == 1 and args->at(0)->type == STRING) {
-                return kw(args->at(0)->to<String>()->value())->el();
+                return kw(args->at(0)->to<String>()->text())->el();
               } else if (args->size() == 1 and args->at(0)->type == KEYWORD) {
                 return args->at(0);
               } else
@@ -645,6 +2180,103 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 return exc("vals: requires a dict")->el();
             }));
 
+  // **************************** TRANSIENT ********************************
+
+  core->set("transient", func([](ListP args) {
+              if (args->size() == 1 and args->at(0)->type == VEC)
+                return transient(args->at(0)->to<Vec>()->clone())->el();
+              else if (args->size() == 1 and args->at(0)->type == DICT)
+                return transient(args->at(0)->to<Dict>()->clone())->el();
+              else
+                THROW("transient: argument must be a vector or a dict");
+            }));
+
+  core->set("persistent!", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("persistent!: takes one argument");
+              ElementP coll = editable(args->at(0), "persistent!");
+              if (not coll)
+                return nil();
+              args->at(0)->to<Transient>()->coll = nullptr;
+              return coll;
+            }));
+
+  core->set("conj!", func([](ListP args) {
+              if (args->size() == 0)
+                return transient(vec())->el();
+              ElementP coll = editable(args->at(0), "conj!");
+              if (not coll)
+                return nil();
+              for (unsigned int i = 1; i < args->size(); i++) {
+                ElementP el = args->at(i);
+                if (coll->type == VEC) {
+                  coll->to<Vec>()->append(el);
+                } else if (el->type == VEC and el->to<Vec>()->size() == 2 and
+                           is_dict_key(el->to<Vec>()->at(0))) {
+                  coll->to<Dict>()->append(el->to<Vec>()->at(0),
+                                           el->to<Vec>()->at(1));
+                } else
+                  THROW("conj!: dict entries must be [key value] vectors");
+              }
+              return args->at(0);
+            }));
+
+  core->set("assoc!", func([](ListP args) {
+              if (args->size() % 2 == 0)
+                THROW("assoc!: arguments are a transient and pairs of key "
+                      "and value");
+              ElementP coll = editable(args->at(0), "assoc!");
+              if (not coll)
+                return nil();
+              for (unsigned int i = 1; i < args->size(); i += 2) {
+                ElementP key = args->at(i), value = args->at(i + 1);
+                if (coll->type == DICT) {
+                  if (not is_dict_key(key))
+                    THROW("assoc!: keys must be keywords or strings");
+                  coll->to<Dict>()->append(key, value);
+                  continue;
+                }
+                VecP v = coll->to<Vec>();
+                if (key->type != NUMBER)
+                  THROW("assoc!: vector indices must be numbers");
+                int index = key->to<Number>()->value();
+                if (index >= 0 and index < static_cast<int>(v->size()))
+                  v->set(index, value);
+                else if (index == static_cast<int>(v->size()))
+                  v->append(value);
+                else
+                  THROW("assoc!: index out of bounds");
+              }
+              return args->at(0);
+            }));
+
+  core->set("dissoc!", func([](ListP args) {
+              if (not args->at_least(1))
+                THROW("dissoc!: arguments are a transient dict and keys");
+              ElementP coll = editable(args->at(0), "dissoc!");
+              if (not coll)
+                return nil();
+              if (coll->type != DICT)
+                THROW("dissoc!: transient must be a dict");
+              for (unsigned int i = 1; i < args->size(); i++)
+                coll->to<Dict>()->remove(args->at(i));
+              return args->at(0);
+            }));
+
+  core->set("pop!", func([](ListP args) {
+              if (args->size() != 1)
+                THROW("pop!: takes one argument");
+              ElementP coll = editable(args->at(0), "pop!");
+              if (not coll)
+                return nil();
+              if (coll->type != VEC)
+                THROW("pop!: transient must be a vector");
+              if (coll->to<Vec>()->size() == 0)
+                THROW("pop!: can't pop an empty vector");
+              coll->to<Vec>()->pop();
+              return args->at(0);
+            }));
+
   // ***************************** COMPARE *********************************
 
   core->set("=", func([](ListP args) {
@@ -815,7 +2447,12 @@ EnvironmentP init_core(std::vector<std::string> argv) {
 
   core->set("deref", func([](ListP args) {
               TEST_DO_OR_EXC(
-                  args->size() == 1, { return args->at(0)->to<Atom>()->ref; },
+                  args->size() == 1,
+                  {
+                    if (args->at(0)->type == REDUCED)
+                      return args->at(0)->to<Reduced>()->ref;
+                    return args->at(0)->to<Atom>()->ref;
+                  },
                   "deref: takes one argument");
             }));
 
@@ -862,8 +2499,7 @@ EnvironmentP init_core(std::vector<std::string> argv) {
                 THROW(pr_str(key) + ":" + pr_str(value));
               } else {
                 // THROW("\\" + pr_str(args->at(0)) + "\\");
-                Runtime::raised = true;
-                Runtime::exc_value = args->at(0);
+                Runtime::raise(args->at(0));
                 return nil();
               }
             }));
@@ -884,20 +2520,17 @@ EnvironmentP init_core(std::vector<std::string> argv) {
           ElementP ret;
           switch (args->at(0)->type) {
           case FUNCTION: {
-            ret = copy(args->at(0)->to<Function>());
+            ret = args->at(0)->to<Function>()->clone();
             set_meta(ret, args->at(1));
           } break;
           case LIST: {
-            ret = copy(args->at(0)->to<List>());
-            set_meta(ret, args->at(1));
+            ret = args->at(0)->to<List>()->with_meta(args->at(1));
           } break;
           case VEC: {
-            ret = copy(args->at(0)->to<Vec>());
-            set_meta(ret, args->at(1));
+            ret = args->at(0)->to<Vec>()->with_meta(args->at(1));
           } break;
           case DICT: {
-            ret = copy(args->at(0)->to<Dict>());
-            set_meta(ret, args->at(1));
+            ret = args->at(0)->to<Dict>()->with_meta(args->at(1));
           } break;
           default:
             THROW(
@@ -913,13 +2546,14 @@ EnvironmentP init_core(std::vector<std::string> argv) {
   return core;
 }
 
-void post_init(Runtime &r, std::string filename) {
-  r.rep("(def! not (fn* (x) (if x false true)))");
+void post_init(Runtime &r, EnvironmentP core, std::string filename) {
   r.rep("(def! load-file (fn* (f) (eval (read-string"
-        " (str \"(do \" (slurp f) \"\nnil)\")))))");
+        " (str \"(do \" (slurp f) \"\nnil)\") f))))");
   r.rep("(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) "
         "(if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to "
         "cond\")) (cons 'cond (rest (rest xs)))))))");
+  if (const ElementP *cond = core->lookup("cond"))
+    (*cond)->to<Function>()->pure_macro = true;
 
   if (not filename.empty()) {
     r.rep("(load-file \"" + filename + "\")");
@@ -7,5 +7,5 @@
 
 namespace lmlisp {
   EnvironmentP init_core(std::vector<std::string> argv);
-  void post_init(Runtime &r, std::string filename);
+  void post_init(Runtime &r, EnvironmentP core, std::string filename);
 }
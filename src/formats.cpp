@@ -0,0 +1,632 @@
+#include "formats.hpp"
+#include "macros.hpp"
+#include "printer.hpp"
+#include "runtime.hpp"
+#include "table.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#if defined(__GNUC__) and defined(__SSE2__)
+#define _LM_FORMATS_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace lmlisp {
+using Number_Value = decltype(std::declval<Number>().value());
+
+// The first of a, b, c or d in [p, end), or end. Long runs of ordinary
+// characters are skipped 16 bytes at a time.
+static const char *find_any(const char *p, const char *end, char a, char b,
+                            char c, char d) {
+#ifdef _LM_FORMATS_SSE2
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, vc), _mm_cmpeq_epi8(chunk, vd)));
+    if (int mask = _mm_movemask_epi8(hits))
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; p++)
+    if (*p == a or *p == b or *p == c or *p == d)
+      break;
+  return p;
+}
+
+//**************************************************************************
+//
+//                                  JSON
+//
+//**************************************************************************
+
+class Json_Parser {
+public:
+  Json_Parser(std::string_view text)
+      : begin(text.data()), p(text.data()), end(text.data() + text.size()) {}
+
+  ElementP parse() {
+    ElementP ret = value();
+    skip_space();
+    if (not failed and p != end)
+      return error("unexpected data after the value");
+    return failed ? nil() : ret;
+  }
+
+private:
+  static constexpr unsigned int MAX_DEPTH = 1024;
+  const char *begin, *p, *end;
+  unsigned int depth = 0;
+  bool failed = false;
+
+  ElementP error(const std::string &what) {
+    if (not failed)
+      Runtime::raise(str("read-json: " + what + " at offset " +
+                         std::to_string(p - begin)));
+    failed = true;
+    return nil();
+  }
+
+  void skip_space() {
+    while (p < end and (*p == ' ' or *p == '\n' or *p == '\r' or *p == '\t'))
+      p++;
+  }
+
+  ElementP value() {
+    skip_space();
+    if (p == end)
+      return error("unexpected end of input");
+    switch (*p) {
+    case '{':
+      return object();
+    case '[':
+      return array();
+    case '"': {
+      std::string s;
+      return string(s) ? str(s)->el() : nil();
+    }
+    case 't':
+      return literal("true", boolean(true));
+    case 'f':
+      return literal("false", boolean(false));
+    case 'n':
+      return literal("null", nil());
+    default:
+      if (*p == '-' or (*p >= '0' and *p <= '9'))
+        return number();
+      return error("unexpected character");
+    }
+  }
+
+  ElementP literal(std::string_view word, ElementP el) {
+    if (std::size_t(end - p) < word.size() or
+        std::string_view(p, word.size()) != word)
+      return error("unexpected character");
+    p += word.size();
+    return el;
+  }
+
+  ElementP number() {
+    const char *start = p;
+    bool integral = true;
+    for (; p < end; p++) {
+      if (*p == '.' or *p == 'e' or *p == 'E')
+        integral = false;
+      else if (not((*p >= '0' and *p <= '9') or *p == '-' or *p == '+'))
+        break;
+    }
+    if (integral) {
+      std::int64_t x;
+      auto [last, ec] = std::from_chars(start, p, x);
+      if (ec == std::errc() and last == p) {
+        if (fits_number(x))
+          return num(Number_Value(x));
+        p = start;
+        return error("number out of range");
+      }
+    }
+    double x;
+    auto [last, ec] = std::from_chars(start, p, x);
+    if (ec == std::errc::result_out_of_range and last == p) {
+      p = start;
+      return error("number out of range");
+    }
+    if (ec != std::errc() or last != p) {
+      p = start;
+      return error("invalid number");
+    }
+    if (not fits_number(x)) {
+      p = start;
+      return error(std::trunc(x) == x ? "number out of range"
+                                      : "not an integer");
+    }
+    return num(Number_Value(x));
+  }
+
+  bool hex4(unsigned int &code) {
+    if (end - p < 4)
+      return false;
+    auto [last, ec] = std::from_chars(p, p + 4, code, 16);
+    if (ec != std::errc() or last != p + 4)
+      return false;
+    p += 4;
+    return true;
+  }
+
+  static void append_utf8(unsigned int code, std::string &out) {
+    if (code < 0x80) {
+      out += char(code);
+    } else if (code < 0x800) {
+      out += char(0xc0 | code >> 6);
+      out += char(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+      out += char(0xe0 | code >> 12);
+      out += char(0x80 | (code >> 6 & 0x3f));
+      out += char(0x80 | (code & 0x3f));
+    } else {
+      out += char(0xf0 | code >> 18);
+      out += char(0x80 | (code >> 12 & 0x3f));
+      out += char(0x80 | (code >> 6 & 0x3f));
+      out += char(0x80 | (code & 0x3f));
+    }
+  }
+
+  // Reads the string at p into out, unescaping it
+  bool string(std::string &out) {
+    p++;
+    while (true) {
+      const char *special = find_any(p, end, '"', '\\', '"', '\\');
+      out.append(p, special);
+      p = special;
+      if (p == end) {
+        error("unterminated string");
+        return false;
+      } else if (*p++ == '"') {
+        return true;
+      }
+      char c = p < end ? *p++ : 0;
+      unsigned int code;
+      switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        out += c;
+        break;
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u':
+        if (not hex4(code)) {
+          error("invalid unicode escape");
+          return false;
+        }
+        if (code >= 0xd800 and code < 0xdc00) {
+          // a surrogate pair, or a lone surrogate
+          unsigned int low;
+          const char *mark = p;
+          if (end - p >= 2 and p[0] == '\\' and p[1] == 'u' and
+              (p += 2, hex4(low)) and low >= 0xdc00 and low < 0xe000) {
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          } else {
+            p = mark;
+            code = 0xfffd;
+          }
+        } else if (code >= 0xdc00 and code < 0xe000) {
+          code = 0xfffd;
+        }
+        append_utf8(code, out);
+        break;
+      default:
+        p--;
+        error("invalid escape");
+        return false;
+      }
+    }
+  }
+
+  ElementP object() {
+    if (++depth > MAX_DEPTH)
+      return error("nesting too deep");
+    p++;
+    DictP ret = dict();
+    skip_space();
+    if (p < end and *p == '}') {
+      p++;
+      depth--;
+      return ret;
+    }
+    while (true) {
+      skip_space();
+      if (p == end or *p != '"')
+        return error("expected a string key");
+      std::string key;
+      if (not string(key))
+        return nil();
+      skip_space();
+      if (p == end or *p != ':')
+        return error("expected ':'");
+      p++;
+      ElementP v = value();
+      if (failed)
+        return nil();
+      ret->append(str(std::move(key)), v);
+      skip_space();
+      if (p < end and *p == ',') {
+        p++;
+      } else if (p < end and *p == '}') {
+        p++;
+        break;
+      } else {
+        return error("expected ',' or '}'");
+      }
+    }
+    depth--;
+    return ret;
+  }
+
+  ElementP array() {
+    if (++depth > MAX_DEPTH)
+      return error("nesting too deep");
+    p++;
+    VecP ret = vec();
+    skip_space();
+    if (p < end and *p == ']') {
+      p++;
+      depth--;
+      return ret;
+    }
+    while (true) {
+      ElementP v = value();
+      if (failed)
+        return nil();
+      ret->append(v);
+      skip_space();
+      if (p < end and *p == ',') {
+        p++;
+      } else if (p < end and *p == ']') {
+        p++;
+        break;
+      } else {
+        return error("expected ',' or ']'");
+      }
+    }
+    depth--;
+    return ret;
+  }
+};
+
+ElementP read_json(std::string_view text) { return Json_Parser(text).parse(); }
+
+static void write_string(std::string_view s, std::string &out) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  std::size_t run = 0;
+  for (std::size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c >= 0x20 and c != '"' and c != '\\')
+      continue;
+    out.append(s.data() + run, i - run);
+    run = i + 1;
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    }
+  }
+  out.append(s.data() + run, s.size() - run);
+  out += '"';
+}
+
+template <class T> static bool write_number(T x, std::string &out) {
+  if constexpr (std::is_floating_point_v<T>) {
+    if (not std::isfinite(x)) {
+      Runtime::raise(str("write-json: JSON has no infinities or NaNs"));
+      return false;
+    }
+  }
+  char buffer[32];
+  auto [last, ec] = std::to_chars(buffer, buffer + sizeof(buffer), x);
+  out.append(buffer, last);
+  return true;
+}
+
+bool write_json(ElementP el, std::string &out) {
+  switch (el->type) {
+  case NIL:
+    out += "null";
+    return true;
+  case BOOLEAN:
+    out += el->to<Boolean>()->value() ? "true" : "false";
+    return true;
+  case NUMBER:
+    return write_number(el->to<Number>()->value(), out);
+  case STRING:
+    write_string(el->to<String>()->value(), out);
+    return true;
+  case KEYWORD:
+    write_string(el->to<Keyword>()->value(), out);
+    return true;
+  case ARRAY: {
+    const Array &a = *el->to<Array>();
+    out += '[';
+    for (std::size_t i = 0; i < a.size(); i++) {
+      if (i > 0)
+        out += ',';
+      if (not(a.kind == Array::DOUBLE ? write_number(a.doubles[i], out)
+                                      : write_number(a.longs[i], out)))
+        return false;
+    }
+    out += ']';
+    return true;
+  }
+  case DICT: {
+    bool ok = true, first = true;
+    out += '{';
+    el->to<Dict>()->for_each([&](ElementP key, ElementP value) {
+      if (not ok)
+        return;
+      if (not first)
+        out += ',';
+      first = false;
+      write_string(key->type == STRING ? key->to<String>()->value()
+                                       : key->to<Keyword>()->value(),
+                   out);
+      out += ':';
+      ok = write_json(value, out);
+    });
+    out += '}';
+    return ok;
+  }
+  case TABLE:
+    return write_json(table_rows(el->to<Table>()), out);
+  case LIST:
+  case VEC:
+  case LAZY_SEQ: {
+    out += '[';
+    bool first = true;
+    for (Lazy_SeqP s = as_lazy_seq(el); s; s = s->chunk_more()) {
+      for (unsigned int i = 0; i < s->chunk_size(); i++) {
+        if (not first)
+          out += ',';
+        first = false;
+        if (not write_json(s->chunk_at(i), out))
+          return false;
+      }
+    }
+    out += ']';
+    return not Runtime::raised;
+  }
+  default:
+    Runtime::raise(str("write-json: " + pr_str(el, true) +
+                       " has no JSON representation"));
+    return false;
+  }
+}
+
+//**************************************************************************
+//
+//                                  CSV
+//
+//**************************************************************************
+
+// Longs if every field is an integer, else doubles if every field is a
+// number, else dictionary-encoded strings
+static ColumnP csv_column(const std::vector<std::string_view> &fields,
+                          std::size_t width, std::size_t column) {
+  std::size_t rows = fields.size() / width - 1;
+  auto field = [&](std::size_t row) {
+    return fields[(row + 1) * width + column];
+  };
+  auto parse = [](std::string_view s, auto &x) {
+    auto [last, ec] = std::from_chars(s.data(), s.data() + s.size(), x);
+    return not s.empty() and ec == std::errc() and
+           last == s.data() + s.size();
+  };
+  std::shared_ptr<Column> ret = std::make_shared<Column>();
+  ret->kind = Column::NUMERIC;
+  ret->numbers = array(Array::LONG, rows);
+  std::size_t row = 0;
+  while (row < rows and parse(field(row), ret->numbers->longs[row]))
+    row++;
+  if (row == rows)
+    return ret;
+  ret->numbers = array(Array::DOUBLE, rows);
+  row = 0;
+  while (row < rows and parse(field(row), ret->numbers->doubles[row]))
+    row++;
+  if (row == rows)
+    return ret;
+
+  ret->kind = Column::STRING;
+  ret->numbers = nullptr;
+  ret->codes.reserve(rows);
+  std::unordered_map<std::string_view, std::uint32_t> codes;
+  for (row = 0; row < rows; row++) {
+    auto [it, added] = codes.try_emplace(field(row), ret->dictionary.size());
+    if (added)
+      ret->dictionary.emplace_back(field(row));
+    ret->codes.push_back(it->second);
+  }
+  return ret;
+}
+
+ElementP read_csv(std::string_view text, bool header) {
+  const char *p = text.data(), *end = p + text.size();
+  if (text.substr(0, 3) == "\xef\xbb\xbf") // byte order mark
+    p += 3;
+  std::vector<std::string_view> fields;
+  std::deque<std::string> unescaped; // quoted fields with "" in them
+  std::size_t width = 0, line = 1;
+  while (p < end) {
+    std::size_t count = 0, record_line = line;
+    while (true) {
+      std::string_view field;
+      if (p < end and *p == '"') {
+        const char *start = ++p;
+        std::string *value = nullptr;
+        while (true) {
+          const char *quote =
+              static_cast<const char *>(std::memchr(p, '"', end - p));
+          if (not quote)
+            THROW("read-csv: unterminated quoted field on line " +
+                  std::to_string(record_line));
+          if (quote + 1 < end and quote[1] == '"') {
+            if (not value)
+              value = &unescaped.emplace_back();
+            value->append(p, quote + 1);
+            p = quote + 2;
+            continue;
+          }
+          if (value)
+            value->append(p, quote);
+          field = value ? std::string_view(*value)
+                        : std::string_view(start, quote - start);
+          line += std::count(start, quote, '\n');
+          p = quote + 1;
+          break;
+        }
+        if (p < end and *p != ',' and *p != '\n' and *p != '\r')
+          THROW("read-csv: unexpected character after a quoted field on "
+                "line " +
+                std::to_string(line));
+      } else {
+        const char *stop = find_any(p, end, ',', '\n', '\r', ',');
+        field = std::string_view(p, stop - p);
+        p = stop;
+      }
+      fields.push_back(field);
+      count++;
+      if (p < end and *p == ',')
+        p++;
+      else
+        break;
+    }
+    if (p < end and *p == '\r')
+      p++;
+    if (p < end and *p == '\n')
+      p++;
+    line++;
+    if (width == 0)
+      width = count;
+    else if (count != width)
+      THROW("read-csv: line " + std::to_string(record_line) + " has " +
+            std::to_string(count) + " fields instead of " +
+            std::to_string(width));
+  }
+
+  if (not header) {
+    VecP ret = vec();
+    ret->reserve(width ? fields.size() / width : 0);
+    for (std::size_t row = 0; row * width < fields.size(); row++) {
+      VecP r = vec();
+      r->reserve(width);
+      for (std::size_t c = 0; c < width; c++)
+        r->append(str(std::string(fields[row * width + c])));
+      ret->append(r);
+    }
+    return ret->el();
+  }
+  TableP ret = table();
+  for (std::size_t c = 0; c < width; c++) {
+    ret->names.emplace_back(fields[c]);
+    ret->columns.push_back(csv_column(fields, width, c));
+  }
+  return ret->el();
+}
+
+//**************************************************************************
+//
+//                              MAPPED FILES
+//
+//**************************************************************************
+
+static bool read_all(const std::string &path, std::string &out) {
+  std::ifstream ifs(path, std::ios::binary);
+  if (not ifs.is_open())
+    return false;
+  std::ostringstream ss;
+  ss << ifs.rdbuf();
+  out = ss.str();
+  return true;
+}
+
+Mapped_File::Mapped_File(const std::string &path) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd >= 0 and fstat(fd, &st) == 0 and S_ISREG(st.st_mode) and
+      st.st_size > 0) {
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(mapped);
+      size = st.st_size;
+      opened = true;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+#endif
+  if (not opened and read_all(path, buffer)) {
+    data = buffer.data();
+    size = buffer.size();
+    opened = true;
+  }
+}
+
+Mapped_File::~Mapped_File() {
+#ifndef _WIN32
+  if (opened and data != buffer.data())
+    munmap(const_cast<char *>(data), size);
+#endif
+}
+
+bool Mapped_File::is_open() const { return opened; }
+
+std::string_view Mapped_File::text() const {
+  return std::string_view(data, size);
+}
+} // namespace lmlisp
@@ -0,0 +1,33 @@
+#pragma once
+#include "types.hpp"
+#include <string_view>
+
+namespace lmlisp {
+// Parses one JSON value: objects become dicts with string keys, arrays
+// vecs, null nil
+ElementP read_json(std::string_view text);
+// Appends the JSON for el to out; raises and returns false for values JSON
+// can't represent
+bool write_json(ElementP el, std::string &out);
+// With a header, a table whose columns are numeric when all their fields
+// are numbers; without, a vec of rows, each a vec of strings
+ElementP read_csv(std::string_view text, bool header);
+
+// A read-only view of a whole file, mapped in memory where the platform
+// allows it
+class Mapped_File {
+public:
+  Mapped_File(const std::string &path);
+  ~Mapped_File();
+  Mapped_File(const Mapped_File &) = delete;
+  Mapped_File &operator=(const Mapped_File &) = delete;
+  bool is_open() const;
+  std::string_view text() const;
+
+private:
+  bool opened = false;
+  const char *data = nullptr;
+  std::size_t size = 0;
+  std::string buffer; // the contents when the file couldn't be mapped
+};
+} // namespace lmlisp
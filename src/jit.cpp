@@ -0,0 +1,566 @@
+#include "jit.hpp"
+#include "assembler.hpp"
+#include "profiler.hpp"
+#include "runtime.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#ifdef _LM_WITH_JIT
+#include <unistd.h>
+#endif
+
+namespace lmlisp {
+#if defined(_LM_WITH_JIT) and not defined(_LM_WITH_FLOAT)
+#define LM_JIT 1
+#endif
+
+#ifdef LM_JIT
+std::atomic<bool> Jit::enabled = true;
+bool Jit::available() { return true; }
+#else
+std::atomic<bool> Jit::enabled = false;
+bool Jit::available() { return false; }
+#endif
+
+#ifndef LM_JIT
+bool Jit::call(Function &, const Arity &, const ListP &, ElementP &) {
+  return false;
+}
+void Jit::register_primitives(EnvironmentP) {}
+#else
+//**************************************************************************
+//
+//                               PRIMITIVES
+//
+//**************************************************************************
+
+enum class Primitive { NONE, SELF, ADD, SUB, MUL, LT, GT, LE, GE, EQ, NOT };
+
+// Kept alive so no other function can take their addresses
+static std::vector<std::pair<FunctionP, Primitive>> primitives;
+
+void Jit::register_primitives(EnvironmentP core) {
+  static const std::pair<const char *, Primitive> names[] = {
+      {"+", Primitive::ADD}, {"-", Primitive::SUB}, {"*", Primitive::MUL},
+      {"<", Primitive::LT},  {">", Primitive::GT},  {"<=", Primitive::LE},
+      {">=", Primitive::GE}, {"=", Primitive::EQ},  {"not", Primitive::NOT}};
+  for (const auto &[name, primitive] : names) {
+    const ElementP *binding = core->lookup(name);
+    if (binding and (*binding)->type == FUNCTION)
+      primitives.emplace_back((*binding)->to<Function>(), primitive);
+  }
+}
+
+static Assembler::Condition condition(Primitive p) {
+  switch (p) {
+  case Primitive::LT:
+    return Assembler::LT;
+  case Primitive::GT:
+    return Assembler::GT;
+  case Primitive::LE:
+    return Assembler::LE;
+  case Primitive::GE:
+    return Assembler::GE;
+  default:
+    return Assembler::EQ;
+  }
+}
+
+//**************************************************************************
+//
+//                                COMPILER
+//
+//**************************************************************************
+
+struct Jit_Code {
+  // A global the code depends on: bound to value (a primitive or a macro
+  // it expanded), or to the function itself when value is null
+  struct Guard {
+    std::string name;
+    ElementP value;
+  };
+  using Entry = std::int64_t (*)(const std::int32_t *args);
+
+  std::unique_ptr<Executable_Memory> memory;
+  std::vector<Guard> guards;
+  Entry entry;
+};
+
+static constexpr unsigned int MAX_PARAMS = 6;
+static constexpr std::int32_t MAX_CALLS = 10000;
+// native stack the calls of a piece of code may take at most
+static constexpr std::int32_t MAX_STACK_BYTES = 512 * 1024;
+
+// Translates arities of f, whose closure is the global environment
+// globals. Every method returns false for forms outside the integer subset
+// the JIT handles.
+//
+// The code has two entries. The outer one, at offset 0, is called from C++
+// with a pointer to the arguments; it sets up the call budget and the
+// bail-out flag and calls the inner one, which takes the arguments pushed
+// on the stack and returns its value in eax. Each inner call spends one
+// call of the budget and sets the flag when there is none left, which
+// makes every call it is nested in return straight away.
+class Jit_Compiler {
+public:
+  Jit_Compiler(Function &f, EnvironmentP globals)
+      : f(f), globals(std::move(globals)) {}
+  std::shared_ptr<const Jit_Code> compile(const Arity &arity);
+
+private:
+  struct Loop {
+    std::vector<std::int32_t> slots;
+    Assembler::Label start;
+  };
+
+  bool expr(ElementP ast, bool tail, const Loop *loop);
+  bool operand(ElementP ast, Assembler::Op op);
+  bool branch(ElementP condition, Assembler::Label otherwise, bool negate);
+  bool arithmetic(ListP form, Primitive p);
+  bool bind_locals(ListP form, std::vector<std::int32_t> &slots);
+  bool jump_with(ListP form, const std::vector<std::int32_t> &slots,
+                 Assembler::Label target);
+  bool call_self(ListP form);
+  ElementP expand(ListP form);
+  Primitive resolve(ElementP head);
+  void guard(std::string_view name, ElementP value);
+  bool local(std::string_view name, std::int32_t &disp) const;
+
+  Function &f;
+  EnvironmentP globals;
+  Assembler a;
+  Assembler::Label inner = 0, body = 0, epilogue = 0;
+  std::vector<std::pair<std::string_view, std::int32_t>> scope;
+  std::vector<std::int32_t> params;
+  unsigned int n_locals = 0;
+  std::vector<Jit_Code::Guard> guards;
+};
+
+std::shared_ptr<const Jit_Code> Jit_Compiler::compile(const Arity &arity) {
+  unsigned int n = arity.binds->size();
+  if (arity.last_is_variadic or n > MAX_PARAMS)
+    return nullptr;
+  inner = a.new_label();
+  body = a.new_label();
+  epilogue = a.new_label();
+  Assembler::Label bail = a.new_label();
+
+  // outer entry
+  a.push_callee_saved();
+  std::size_t budget_at = a.size() + 2;
+  a.set_budget(0);
+  a.clear_bail();
+  for (unsigned int i = 0; i < n; i++) {
+    a.load_eax_arg(4 * i);
+    a.push_rax();
+  }
+  a.call(inner);
+  a.add_rsp(8 * n);
+  a.pack_result();
+  a.pop_callee_saved();
+  a.ret();
+
+  // inner entry: arguments are above the return address, the first deepest
+  a.bind(inner);
+  a.dec_budget();
+  a.jcc(Assembler::EQ, bail);
+  a.enter();
+  std::size_t frame_at = a.reserve_stack();
+  a.bind(body);
+  for (unsigned int i = 0; i < n; i++) {
+    params.push_back(16 + 8 * (n - 1 - i));
+    scope.emplace_back(arity.binds->at(i)->to<Symbol>()->value(),
+                       params.back());
+  }
+  if (not expr(arity.exprs, true, nullptr))
+    return nullptr;
+  a.bind(epilogue);
+  a.leave();
+  a.inc_budget();
+  a.ret();
+  a.bind(bail);
+  a.set_bail();
+  a.ret();
+
+  a.patch32(frame_at, 8 * n_locals);
+  // locals, arguments, return address, rbp and a few temporaries
+  std::int32_t frame_bytes = 8 * (n_locals + n + 8);
+  a.patch32(budget_at, std::min(MAX_CALLS, MAX_STACK_BYTES / frame_bytes));
+
+  auto code = std::make_shared<Jit_Code>();
+  code->memory = std::make_unique<Executable_Memory>(a.finish());
+  if (not code->memory->is_ready())
+    return nullptr;
+  code->guards = std::move(guards);
+  code->entry = reinterpret_cast<Jit_Code::Entry>(
+      const_cast<void *>(code->memory->address()));
+  return code;
+}
+
+bool Jit_Compiler::local(std::string_view name, std::int32_t &disp) const {
+  for (std::size_t i = scope.size(); i > 0; i--)
+    if (scope[i - 1].first == name) {
+      disp = scope[i - 1].second;
+      return true;
+    }
+  return false;
+}
+
+// What a call head names, adding the guard the code needs for it
+Primitive Jit_Compiler::resolve(ElementP head) {
+  std::int32_t disp;
+  if (head->type != SYMBOL)
+    return Primitive::NONE;
+  std::string_view name = head->to<Symbol>()->value();
+  if (local(name, disp))
+    return Primitive::NONE;
+  const ElementP *binding = globals->lookup(name);
+  if (not binding or (*binding)->type != FUNCTION)
+    return Primitive::NONE;
+  const Function *callee = static_cast<const Function *>(binding->get());
+  Primitive ret = Primitive::NONE;
+  if (callee == &f)
+    ret = Primitive::SELF;
+  else
+    for (const auto &[fn, primitive] : primitives)
+      if (fn.get() == callee) {
+        ret = primitive;
+        break;
+      }
+  if (ret != Primitive::NONE)
+    guard(name, ret == Primitive::SELF ? nullptr : *binding);
+  return ret;
+}
+
+void Jit_Compiler::guard(std::string_view name, ElementP value) {
+  for (const Jit_Code::Guard &g : guards)
+    if (g.name == name)
+      return;
+  guards.push_back({std::string(name), std::move(value)});
+}
+
+// The expansion of a macro call, null when form isn't one or it fails
+ElementP Jit_Compiler::expand(ListP form) {
+  std::int32_t disp;
+  if (not form->check_nth(0, SYMBOL))
+    return nullptr;
+  std::string_view name = form->at(0)->to<Symbol>()->value();
+  if (local(name, disp) or globals->find(name)->type == NIL or
+      not is_macro_call(form, globals))
+    return nullptr;
+  Macro_Uses uses;
+  ElementP expanded = macroexpand(form, globals, &uses);
+  if (Runtime::raised) {
+    Runtime::take_exception();
+    return nullptr;
+  }
+  // the expansion is baked into the code: redefining a macro it used
+  // sends the calls back to the interpreter
+  for (auto &[macro, fn] : uses)
+    guard(macro, std::move(fn));
+  return expanded;
+}
+
+bool Jit_Compiler::expr(ElementP ast, bool tail, const Loop *loop) {
+  std::int32_t disp;
+  if (ast->type == NUMBER) {
+    a.mov_eax(ast->to<Number>()->value());
+    return true;
+  }
+  if (ast->type == SYMBOL) {
+    if (not local(ast->to<Symbol>()->value(), disp))
+      return false;
+    a.load_eax(disp);
+    return true;
+  }
+  if (ast->type != LIST or ast->to<List>()->size() == 0 or
+      not ast->to<List>()->check_nth(0, SYMBOL))
+    return false;
+  ListP form = ast->to<List>();
+  std::string_view name = form->at(0)->to<Symbol>()->value();
+  std::size_t outer = scope.size();
+  if (name == "if") {
+    if (form->size() != 3 and form->size() != 4)
+      return false;
+    ElementP c = form->at(1);
+    if (c->type != LIST and c->type != SYMBOL) {
+      // a constant, as in the last clause of cond
+      if (c->type != NIL and
+          not(c->type == BOOLEAN and not c->to<Boolean>()->value()))
+        return expr(form->at(2), tail, loop);
+      return form->size() == 4 and expr(form->at(3), tail, loop);
+    }
+    if (form->size() != 4)
+      return false;
+    Assembler::Label otherwise = a.new_label(), end = a.new_label();
+    if (not branch(c, otherwise, false) or not expr(form->at(2), tail, loop))
+      return false;
+    a.jmp(end);
+    a.bind(otherwise);
+    if (not expr(form->at(3), tail, loop))
+      return false;
+    a.bind(end);
+    return true;
+  }
+  if (name == "do") {
+    if (form->size() < 2)
+      return false;
+    for (unsigned int i = 1; i < form->size(); i++) {
+      bool last = i == form->size() - 1;
+      if (not expr(form->at(i), tail and last, last ? loop : nullptr))
+        return false;
+    }
+    return true;
+  }
+  if (name == "let*" or name == "loop") {
+    std::vector<std::int32_t> slots;
+    if (not form->at_least(3) or not bind_locals(form, slots))
+      return false;
+    bool ok;
+    if (name == "loop") {
+      Loop inner_loop{std::move(slots), a.new_label()};
+      a.bind(inner_loop.start);
+      ok = expr(form->at(2), tail, &inner_loop);
+    } else
+      ok = expr(form->at(2), tail, loop);
+    scope.resize(outer);
+    return ok;
+  }
+  if (name == "recur")
+    return loop and form->size() - 1 == loop->slots.size() and
+           jump_with(form, loop->slots, loop->start);
+  if (name == "fn*" or name == "def!" or name == "defmacro!" or
+      name == "quote" or name == "quasiquote" or
+      name == "quasiquoteexpand" or name == "macroexpand" or
+      name == "try*" or name == "lazy-seq")
+    return false;
+  if (ElementP expanded = expand(form))
+    return expr(expanded, tail, loop);
+  Primitive p = resolve(form->at(0));
+  switch (p) {
+  case Primitive::ADD:
+  case Primitive::SUB:
+  case Primitive::MUL:
+    return arithmetic(form, p);
+  case Primitive::SELF:
+    if (form->size() - 1 != params.size())
+      return false;
+    if (tail)
+      return jump_with(form, params, body);
+    return call_self(form);
+  default:
+    return false;
+  }
+}
+
+// eax = eax op ast, without a temporary when ast is a constant or a local
+bool Jit_Compiler::operand(ElementP ast, Assembler::Op op) {
+  std::int32_t disp;
+  if (ast->type == NUMBER) {
+    a.op_eax(op, ast->to<Number>()->value());
+    return true;
+  }
+  if (ast->type == SYMBOL and local(ast->to<Symbol>()->value(), disp)) {
+    a.op_eax_local(op, disp);
+    return true;
+  }
+  a.push_rax();
+  if (not expr(ast, false, nullptr))
+    return false;
+  a.pop_rcx();
+  a.op_ecx_eax(op);
+  return true;
+}
+
+// Jumps to otherwise when the comparison condition is false, or true when
+// negated
+bool Jit_Compiler::branch(ElementP condition_form, Assembler::Label otherwise,
+                          bool negate) {
+  if (condition_form->type != LIST)
+    return false;
+  ListP form = condition_form->to<List>();
+  if (ElementP expanded = expand(form))
+    return branch(expanded, otherwise, negate);
+  Primitive p = resolve(form->at(0));
+  if (p == Primitive::NOT)
+    return form->size() == 2 and branch(form->at(1), otherwise, not negate);
+  if (form->size() != 3 or
+      (p != Primitive::LT and p != Primitive::GT and p != Primitive::LE and
+       p != Primitive::GE and p != Primitive::EQ))
+    return false;
+  if (not expr(form->at(1), false, nullptr) or
+      not operand(form->at(2), Assembler::Op::CMP))
+    return false;
+  Assembler::Condition c = condition(p);
+  a.jcc(negate ? c : Assembler::Condition(c ^ 1), otherwise);
+  return true;
+}
+
+// As the builtins do it: no arguments give 0, one gives itself
+bool Jit_Compiler::arithmetic(ListP form, Primitive p) {
+  if (form->size() == 1) {
+    a.mov_eax(0);
+    return true;
+  }
+  Assembler::Op op = p == Primitive::ADD   ? Assembler::Op::ADD
+                     : p == Primitive::SUB ? Assembler::Op::SUB
+                                           : Assembler::Op::IMUL;
+  if (not expr(form->at(1), false, nullptr))
+    return false;
+  for (unsigned int i = 2; i < form->size(); i++)
+    if (not operand(form->at(i), op))
+      return false;
+  return true;
+}
+
+// Evaluates the binds of a let* or loop into new locals
+bool Jit_Compiler::bind_locals(ListP form, std::vector<std::int32_t> &slots) {
+  if (form->at(1)->type != LIST and form->at(1)->type != VEC)
+    return false;
+  ListP binds = form->at(1)->type == VEC ? form->at(1)->to<Vec>()->listed()
+                                         : form->at(1)->to<List>();
+  if (binds->size() % 2 != 0)
+    return false;
+  for (unsigned int i = 0; i < binds->size(); i += 2) {
+    if (not binds->check_nth(i, SYMBOL) or
+        not expr(binds->at(i + 1), false, nullptr))
+      return false;
+    n_locals++;
+    slots.push_back(-8 * std::int32_t(n_locals));
+    a.store_eax(slots.back());
+    scope.emplace_back(binds->at(i)->to<Symbol>()->value(), slots.back());
+  }
+  return true;
+}
+
+// A tail call to the function itself or a recur: the arguments are
+// evaluated, stored over slots, and target runs again
+bool Jit_Compiler::jump_with(ListP form, const std::vector<std::int32_t> &slots,
+                             Assembler::Label target) {
+  for (unsigned int i = 1; i < form->size(); i++) {
+    if (not expr(form->at(i), false, nullptr))
+      return false;
+    a.push_rax();
+  }
+  for (std::size_t i = slots.size(); i > 0; i--) {
+    a.pop_rax();
+    a.store_eax(slots[i - 1]);
+  }
+  a.jmp(target);
+  return true;
+}
+
+bool Jit_Compiler::call_self(ListP form) {
+  for (unsigned int i = 1; i < form->size(); i++) {
+    if (not expr(form->at(i), false, nullptr))
+      return false;
+    a.push_rax();
+  }
+  a.call(inner);
+  a.add_rsp(8 * (form->size() - 1));
+  a.test_bail();
+  a.jcc(Assembler::NE, epilogue);
+  return true;
+}
+
+//**************************************************************************
+//
+//                                 DRIVER
+//
+//**************************************************************************
+
+static void write_perf_map(const Executable_Memory &memory,
+                           const std::string &name) {
+  static const bool wanted = std::getenv("LMLISP_PERF_MAP") != nullptr;
+  if (not wanted)
+    return;
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  static std::ofstream map("/tmp/perf-" + std::to_string(getpid()) + ".map",
+                           std::ios::app);
+  map << std::hex << reinterpret_cast<std::uintptr_t>(memory.address()) << ' '
+      << memory.size() << std::dec << " lmlisp:" << name << std::endl;
+}
+
+// Whether calling binding runs the same code as calling f
+static bool is_same_code(const ElementP &binding, const Function &f) {
+  if (binding->type != FUNCTION)
+    return false;
+  const Function *g = static_cast<const Function *>(binding.get());
+  return not g->is_macro and g->info == f.info and g->closure() == f.closure();
+}
+
+// Where the last call that ran out of budget was made on this thread. The
+// interpreter runs it again, and the calls nested in it, deeper on the
+// stack, stay in the interpreter too: entering native code at every level
+// would run out of budget at each of them, making deep recursion quadratic.
+static thread_local const char *bailed_at = nullptr;
+
+bool Jit::call(Function &f, const Arity &arity, const ListP &args,
+               ElementP &ret) {
+  char here = 0;
+  if (bailed_at) {
+    if (&here < bailed_at)
+      return false;
+    bailed_at = nullptr;
+  }
+  const Closure_Info *info = f.info.get();
+  if (not info or f.closure()->get_level() != 0)
+    return false;
+  const std::vector<Arity> &arities = f.get_arities();
+  if (not info->jitted.load(std::memory_order_acquire)) {
+    if (info->calls.fetch_add(1, std::memory_order_relaxed) + 1 < THRESHOLD)
+      return false;
+    std::lock_guard<std::recursive_mutex> lock(info->code_mutex);
+    if (not info->jitted.load(std::memory_order_relaxed)) {
+      std::vector<std::shared_ptr<const Jit_Code>> code;
+      for (const Arity &a : arities) {
+        code.push_back(Jit_Compiler(f, f.closure()).compile(a));
+        if (code.back())
+          write_perf_map(*code.back()->memory, Runtime::frame_label(&f));
+      }
+      info->jit_code = std::move(code);
+      info->jitted.store(true, std::memory_order_release);
+    }
+  }
+  const Jit_Code *code = info->jit_code[&arity - arities.data()].get();
+  if (not code)
+    return false;
+  Environment *globals = f.closure().get();
+  for (const Jit_Code::Guard &guard : code->guards) {
+    const ElementP *binding = globals->lookup(guard.name);
+    if (not binding or (guard.value ? *binding != guard.value
+                                    : not is_same_code(*binding, f)))
+      return false;
+  }
+  std::int32_t values[MAX_PARAMS];
+  for (unsigned int i = 0; i < args->size(); i++) {
+    const ElementP &arg = args->at(i);
+    if (arg->type != NUMBER)
+      return false;
+    values[i] = static_cast<const Number *>(arg.get())->value();
+  }
+  if (Runtime::stack_exhausted())
+    return false;
+  // One frame and one counted call however often the code calls itself
+  Call_Frame frame;
+  frame.enter(std::static_pointer_cast<Function>(f.shared_from_this()));
+  std::int64_t result = code->entry(values);
+  if (Profiler::tick.load(std::memory_order_relaxed))
+    Profiler::sample();
+  if (result >> 32) {
+    bailed_at = &here;
+    return false;
+  }
+  ret = num(std::int32_t(result));
+  return true;
+}
+#endif
+} // namespace lmlisp
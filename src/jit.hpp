@@ -0,0 +1,35 @@
+#pragma once
+#include "types.hpp"
+#include <atomic>
+
+namespace lmlisp {
+// TEMPLATE JIT
+// Counts the calls of each fn* form and, past a threshold, translates its
+// arities to x86-64 machine code when they only compute with integers:
+// arithmetic on their parameters and locals, comparisons in if, let*,
+// loop/recur and calls to themselves. Such bodies have no side effects, so
+// a call that can't finish natively (its arguments aren't numbers, a
+// global or macro it uses was rebound, the call budget ran out) is simply
+// run again by the interpreter; after running out of budget, so are the
+// calls nested in it, keeping deep recursion linear. A native call shows
+// as one frame and one user call however often it recurses: its
+// self-calls aren't counted or traced, and profiler samples land on its
+// outermost frame.
+//
+// With LMLISP_PERF_MAP set in the environment the code is listed in
+// /tmp/perf-<pid>.map, so perf can name it.
+class Jit {
+public:
+  // Runs arity of f natively when it is compiled, compiling it once it is
+  // hot; false when the call is left to the interpreter
+  static bool call(Function &f, const Arity &arity, const ListP &args,
+                   ElementP &ret);
+  // Remembers the arithmetic and comparison builtins of the core
+  // environment, the only globals compiled code calls besides itself
+  static void register_primitives(EnvironmentP core);
+  static bool available(); // built with LMLISP_JIT
+
+  static constexpr unsigned int THRESHOLD = 1000;
+  static std::atomic<bool> enabled;
+};
+} // namespace lmlisp
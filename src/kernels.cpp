@@ -0,0 +1,436 @@
+#include "kernels.hpp"
+
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define _LM_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace lmlisp {
+namespace kernels {
+
+//**************************************************************************
+//
+//                                 SCALAR
+//
+//**************************************************************************
+
+template <class T> static T sum_scalar(const T *a, std::size_t n) {
+  T ret = 0;
+  for (std::size_t i = 0; i < n; i++)
+    ret += a[i];
+  return ret;
+}
+
+template <class T> static T dot_scalar(const T *a, const T *b, std::size_t n) {
+  T ret = 0;
+  for (std::size_t i = 0; i < n; i++)
+    ret += a[i] * b[i];
+  return ret;
+}
+
+template <class T> static T min_scalar(const T *a, std::size_t n) {
+  T ret = a[0];
+  for (std::size_t i = 1; i < n; i++)
+    ret = a[i] < ret ? a[i] : ret;
+  return ret;
+}
+
+template <class T> static T max_scalar(const T *a, std::size_t n) {
+  T ret = a[0];
+  for (std::size_t i = 1; i < n; i++)
+    ret = a[i] > ret ? a[i] : ret;
+  return ret;
+}
+
+template <class T>
+static void add_scalar(const T *a, const T *b, T *out, std::size_t n) {
+  for (std::size_t i = 0; i < n; i++)
+    out[i] = a[i] + b[i];
+}
+
+template <class T>
+static void add_scalar(const T *a, T x, T *out, std::size_t n) {
+  for (std::size_t i = 0; i < n; i++)
+    out[i] = a[i] + x;
+}
+
+template <class T>
+static void mul_scalar(const T *a, const T *b, T *out, std::size_t n) {
+  for (std::size_t i = 0; i < n; i++)
+    out[i] = a[i] * b[i];
+}
+
+template <class T>
+static void mul_scalar(const T *a, T x, T *out, std::size_t n) {
+  for (std::size_t i = 0; i < n; i++)
+    out[i] = a[i] * x;
+}
+
+template <class T>
+static void less_scalar(const T *a, T x, std::int64_t *mask, std::size_t n) {
+  for (std::size_t i = 0; i < n; i++)
+    mask[i] = a[i] < x;
+}
+
+template <class T>
+static void greater_scalar(const T *a, T x, std::int64_t *mask,
+                           std::size_t n) {
+  for (std::size_t i = 0; i < n; i++)
+    mask[i] = a[i] > x;
+}
+
+// branchless: every value is written, the output only advances on a hit
+template <class T>
+static std::size_t compress_scalar(const T *a, const std::int64_t *mask,
+                                   T *out, std::size_t n) {
+  std::size_t k = 0;
+  for (std::size_t i = 0; i < n; i++) {
+    out[k] = a[i];
+    k += mask[i] != 0;
+  }
+  return k;
+}
+
+//**************************************************************************
+//
+//                                  AVX2
+//
+//**************************************************************************
+
+#ifdef _LM_KERNELS_X86
+#define AVX2 __attribute__((target("avx2,fma")))
+
+static bool has_avx2() {
+  static const bool ret =
+      __builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma");
+  return ret;
+}
+
+AVX2 static double hsum(__m256d v) {
+  double lanes[4];
+  _mm256_storeu_pd(lanes, v);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+AVX2 static std::int64_t hsum(__m256i v) {
+  std::int64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), v);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+AVX2 static double sum_avx2(const double *a, std::size_t n) {
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+    acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+  }
+  double ret = hsum(_mm256_add_pd(acc0, acc1));
+  for (; i < n; i++)
+    ret += a[i];
+  return ret;
+}
+
+AVX2 static std::int64_t sum_avx2(const std::int64_t *a, std::size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_add_epi64(
+        acc, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)));
+  std::int64_t ret = hsum(acc);
+  for (; i < n; i++)
+    ret += a[i];
+  return ret;
+}
+
+AVX2 static double dot_avx2(const double *a, const double *b, std::size_t n) {
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i),
+                           acc0);
+    acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4),
+                           _mm256_loadu_pd(b + i + 4), acc1);
+  }
+  double ret = hsum(_mm256_add_pd(acc0, acc1));
+  for (; i < n; i++)
+    ret += a[i] * b[i];
+  return ret;
+}
+
+AVX2 static double min_avx2(const double *a, std::size_t n) {
+  if (n < 4)
+    return min_scalar(a, n);
+  __m256d acc = _mm256_loadu_pd(a);
+  std::size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  double ret = min_scalar(lanes, 4);
+  for (; i < n; i++)
+    ret = a[i] < ret ? a[i] : ret;
+  return ret;
+}
+
+AVX2 static double max_avx2(const double *a, std::size_t n) {
+  if (n < 4)
+    return max_scalar(a, n);
+  __m256d acc = _mm256_loadu_pd(a);
+  std::size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  double ret = max_scalar(lanes, 4);
+  for (; i < n; i++)
+    ret = a[i] > ret ? a[i] : ret;
+  return ret;
+}
+
+// AVX2 has no 64 bit min and max: compare, then blend
+AVX2 static std::int64_t min_avx2(const std::int64_t *a, std::size_t n) {
+  if (n < 4)
+    return min_scalar(a, n);
+  const __m256i *v = reinterpret_cast<const __m256i *>(a);
+  __m256i acc = _mm256_loadu_si256(v);
+  std::size_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256(v + i / 4);
+    acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(acc, x));
+  }
+  std::int64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+  std::int64_t ret = min_scalar(lanes, 4);
+  for (; i < n; i++)
+    ret = a[i] < ret ? a[i] : ret;
+  return ret;
+}
+
+AVX2 static std::int64_t max_avx2(const std::int64_t *a, std::size_t n) {
+  if (n < 4)
+    return max_scalar(a, n);
+  const __m256i *v = reinterpret_cast<const __m256i *>(a);
+  __m256i acc = _mm256_loadu_si256(v);
+  std::size_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256(v + i / 4);
+    acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(x, acc));
+  }
+  std::int64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+  std::int64_t ret = max_scalar(lanes, 4);
+  for (; i < n; i++)
+    ret = a[i] > ret ? a[i] : ret;
+  return ret;
+}
+
+AVX2 static void add_avx2(const double *a, const double *b, double *out,
+                          std::size_t n) {
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  add_scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void add_avx2(const double *a, double x, double *out,
+                          std::size_t n) {
+  __m256d vx = _mm256_set1_pd(x);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), vx));
+  add_scalar(a + i, x, out + i, n - i);
+}
+
+AVX2 static void add_avx2(const std::int64_t *a, const std::int64_t *b,
+                          std::int64_t *out, std::size_t n) {
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(out + i),
+        _mm256_add_epi64(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i))));
+  add_scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void add_avx2(const std::int64_t *a, std::int64_t x,
+                          std::int64_t *out, std::size_t n) {
+  __m256i vx = _mm256_set1_epi64x(x);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(out + i),
+        _mm256_add_epi64(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)), vx));
+  add_scalar(a + i, x, out + i, n - i);
+}
+
+AVX2 static void mul_avx2(const double *a, const double *b, double *out,
+                          std::size_t n) {
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  mul_scalar(a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void mul_avx2(const double *a, double x, double *out,
+                          std::size_t n) {
+  __m256d vx = _mm256_set1_pd(x);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vx));
+  mul_scalar(a + i, x, out + i, n - i);
+}
+
+template <int PREDICATE>
+AVX2 static void compare_avx2(const double *a, double x, std::int64_t *mask,
+                              std::size_t n) {
+  __m256d vx = _mm256_set1_pd(x);
+  __m256i one = _mm256_set1_epi64x(1);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d hit = _mm256_cmp_pd(_mm256_loadu_pd(a + i), vx, PREDICATE);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i),
+                        _mm256_and_si256(_mm256_castpd_si256(hit), one));
+  }
+  if (PREDICATE == _CMP_LT_OQ)
+    less_scalar(a + i, x, mask + i, n - i);
+  else
+    greater_scalar(a + i, x, mask + i, n - i);
+}
+
+template <bool LESS>
+AVX2 static void compare_avx2(const std::int64_t *a, std::int64_t x,
+                              std::int64_t *mask, std::size_t n) {
+  __m256i vx = _mm256_set1_epi64x(x);
+  __m256i one = _mm256_set1_epi64x(1);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    __m256i hit = LESS ? _mm256_cmpgt_epi64(vx, v) : _mm256_cmpgt_epi64(v, vx);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i),
+                        _mm256_and_si256(hit, one));
+  }
+  if (LESS)
+    less_scalar(a + i, x, mask + i, n - i);
+  else
+    greater_scalar(a + i, x, mask + i, n - i);
+}
+
+#define DISPATCH(AVX2_CALL, SCALAR_CALL)                                      \
+  return has_avx2() ? AVX2_CALL : SCALAR_CALL
+#else
+#define DISPATCH(AVX2_CALL, SCALAR_CALL) return SCALAR_CALL
+#endif
+
+//**************************************************************************
+//
+//                                DISPATCH
+//
+//**************************************************************************
+
+double sum(const double *a, std::size_t n) {
+  DISPATCH(sum_avx2(a, n), sum_scalar(a, n));
+}
+
+std::int64_t sum(const std::int64_t *a, std::size_t n) {
+  DISPATCH(sum_avx2(a, n), sum_scalar(a, n));
+}
+
+double dot(const double *a, const double *b, std::size_t n) {
+  DISPATCH(dot_avx2(a, b, n), dot_scalar(a, b, n));
+}
+
+// no 64 bit multiply in AVX2
+std::int64_t dot(const std::int64_t *a, const std::int64_t *b,
+                 std::size_t n) {
+  return dot_scalar(a, b, n);
+}
+
+double min(const double *a, std::size_t n) {
+  DISPATCH(min_avx2(a, n), min_scalar(a, n));
+}
+
+std::int64_t min(const std::int64_t *a, std::size_t n) {
+  DISPATCH(min_avx2(a, n), min_scalar(a, n));
+}
+
+double max(const double *a, std::size_t n) {
+  DISPATCH(max_avx2(a, n), max_scalar(a, n));
+}
+
+std::int64_t max(const std::int64_t *a, std::size_t n) {
+  DISPATCH(max_avx2(a, n), max_scalar(a, n));
+}
+
+void add(const double *a, const double *b, double *out, std::size_t n) {
+  DISPATCH(add_avx2(a, b, out, n), add_scalar(a, b, out, n));
+}
+
+void add(const std::int64_t *a, const std::int64_t *b, std::int64_t *out,
+         std::size_t n) {
+  DISPATCH(add_avx2(a, b, out, n), add_scalar(a, b, out, n));
+}
+
+void add(const double *a, double x, double *out, std::size_t n) {
+  DISPATCH(add_avx2(a, x, out, n), add_scalar(a, x, out, n));
+}
+
+void add(const std::int64_t *a, std::int64_t x, std::int64_t *out,
+         std::size_t n) {
+  DISPATCH(add_avx2(a, x, out, n), add_scalar(a, x, out, n));
+}
+
+void mul(const double *a, const double *b, double *out, std::size_t n) {
+  DISPATCH(mul_avx2(a, b, out, n), mul_scalar(a, b, out, n));
+}
+
+void mul(const std::int64_t *a, const std::int64_t *b, std::int64_t *out,
+         std::size_t n) {
+  mul_scalar(a, b, out, n);
+}
+
+void mul(const double *a, double x, double *out, std::size_t n) {
+  DISPATCH(mul_avx2(a, x, out, n), mul_scalar(a, x, out, n));
+}
+
+void mul(const std::int64_t *a, std::int64_t x, std::int64_t *out,
+         std::size_t n) {
+  mul_scalar(a, x, out, n);
+}
+
+void less(const double *a, double x, std::int64_t *mask, std::size_t n) {
+  DISPATCH(compare_avx2<_CMP_LT_OQ>(a, x, mask, n),
+           less_scalar(a, x, mask, n));
+}
+
+void less(const std::int64_t *a, std::int64_t x, std::int64_t *mask,
+          std::size_t n) {
+  DISPATCH(compare_avx2<true>(a, x, mask, n), less_scalar(a, x, mask, n));
+}
+
+void greater(const double *a, double x, std::int64_t *mask, std::size_t n) {
+  DISPATCH(compare_avx2<_CMP_GT_OQ>(a, x, mask, n),
+           greater_scalar(a, x, mask, n));
+}
+
+void greater(const std::int64_t *a, std::int64_t x, std::int64_t *mask,
+             std::size_t n) {
+  DISPATCH(compare_avx2<false>(a, x, mask, n),
+           greater_scalar(a, x, mask, n));
+}
+
+std::size_t compress(const double *a, const std::int64_t *mask, double *out,
+                     std::size_t n) {
+  return compress_scalar(a, mask, out, n);
+}
+
+std::size_t compress(const std::int64_t *a, const std::int64_t *mask,
+                     std::int64_t *out, std::size_t n) {
+  return compress_scalar(a, mask, out, n);
+}
+} // namespace kernels
+} // namespace lmlisp
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace lmlisp {
+// Loops over contiguous numbers for the numeric array builtins. Each kernel
+// picks, on first use, a vectorized version for the CPU it runs on (AVX2 on
+// x86-64) and falls back to a scalar loop elsewhere.
+namespace kernels {
+double sum(const double *a, std::size_t n);
+std::int64_t sum(const std::int64_t *a, std::size_t n);
+double dot(const double *a, const double *b, std::size_t n);
+std::int64_t dot(const std::int64_t *a, const std::int64_t *b, std::size_t n);
+double min(const double *a, std::size_t n); // n > 0
+std::int64_t min(const std::int64_t *a, std::size_t n);
+double max(const double *a, std::size_t n);
+std::int64_t max(const std::int64_t *a, std::size_t n);
+
+// out[i] = a[i] op b[i], out[i] = a[i] op x; out may alias a
+void add(const double *a, const double *b, double *out, std::size_t n);
+void add(const std::int64_t *a, const std::int64_t *b, std::int64_t *out,
+         std::size_t n);
+void add(const double *a, double x, double *out, std::size_t n);
+void add(const std::int64_t *a, std::int64_t x, std::int64_t *out,
+         std::size_t n);
+void mul(const double *a, const double *b, double *out, std::size_t n);
+void mul(const std::int64_t *a, const std::int64_t *b, std::int64_t *out,
+         std::size_t n);
+void mul(const double *a, double x, double *out, std::size_t n);
+void mul(const std::int64_t *a, std::int64_t x, std::int64_t *out,
+         std::size_t n);
+
+// mask[i] = a[i] < x (less) or a[i] > x (greater), as 0 or 1
+void less(const double *a, double x, std::int64_t *mask, std::size_t n);
+void less(const std::int64_t *a, std::int64_t x, std::int64_t *mask,
+          std::size_t n);
+void greater(const double *a, double x, std::int64_t *mask, std::size_t n);
+void greater(const std::int64_t *a, std::int64_t x, std::int64_t *mask,
+             std::size_t n);
+
+// Copies the a[i] whose mask[i] is not 0 to out, in order; returns how many
+std::size_t compress(const double *a, const std::int64_t *mask, double *out,
+                     std::size_t n);
+std::size_t compress(const std::int64_t *a, const std::int64_t *mask,
+                     std::int64_t *out, std::size_t n);
+} // namespace kernels
+} // namespace lmlisp
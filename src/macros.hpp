@@ -1,8 +1,7 @@
 #pragma once
 
 #define THROW(EXC) { \
-  Runtime::raised = true; \
-  Runtime::exc_value = str(EXC); \
+  Runtime::raise(str(EXC)); \
   return nil()->el(); \
 }
 
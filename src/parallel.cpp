@@ -0,0 +1,97 @@
+#include "parallel.hpp"
+#include "stats.hpp"
+#include <algorithm>
+
+namespace lmlisp {
+static thread_local bool in_task = false;
+
+Thread_Pool::Thread_Pool(unsigned int n_workers) {
+  for (unsigned int i = 0; i < n_workers; i++)
+    workers.emplace_back([this]() { work(); });
+}
+
+Thread_Pool::~Thread_Pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+Thread_Pool &Thread_Pool::shared() {
+  static Thread_Pool pool(std::max(1u, std::thread::hardware_concurrency()) -
+                          1);
+  return pool;
+}
+
+unsigned int Thread_Pool::size() const { return workers.size() + 1; }
+
+// Runs the next task of the current job, if any is left; called and
+// returns with the lock held.
+bool Thread_Pool::run_next(std::unique_lock<std::mutex> &lock) {
+  if (task == nullptr or next_task == n_tasks)
+    return false;
+  unsigned int i = next_task++;
+  const std::function<void(unsigned int)> &f = *task;
+  lock.unlock();
+  in_task = true;
+#ifdef _LM_WITH_STATS
+  Runtime_Stats outside = runtime_stats;
+  runtime_stats = {};
+#endif
+  try {
+    f(i);
+  } catch (...) {
+    std::lock_guard<std::mutex> error_lock(mutex);
+    if (not error)
+      error = std::current_exception();
+  }
+  in_task = false;
+  lock.lock();
+#ifdef _LM_WITH_STATS
+  add_stats(*job_stats, runtime_stats);
+  runtime_stats = outside;
+#endif
+  if (--pending == 0)
+    done.notify_all();
+  return true;
+}
+
+void Thread_Pool::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (not stopping) {
+    if (not run_next(lock))
+      wake.wait(lock);
+  }
+}
+
+void Thread_Pool::run(unsigned int n_tasks,
+                      const std::function<void(unsigned int)> &task) {
+  if (in_task or workers.empty() or n_tasks <= 1) {
+    for (unsigned int i = 0; i < n_tasks; i++)
+      task(i);
+    return;
+  }
+  std::lock_guard<std::mutex> job_lock(job_mutex);
+  std::unique_lock<std::mutex> lock(mutex);
+  Runtime_Stats stats = {};
+  job_stats = &stats;
+  this->task = &task;
+  this->n_tasks = n_tasks;
+  next_task = 0;
+  pending = n_tasks;
+  error = nullptr;
+  wake.notify_all();
+  while (run_next(lock))
+    ;
+  done.wait(lock, [this]() { return pending == 0; });
+  this->task = nullptr;
+  std::exception_ptr failed = error;
+  lock.unlock();
+  add_stats(runtime_stats, stats);
+  if (failed)
+    std::rethrow_exception(failed);
+}
+} // namespace lmlisp
@@ -0,0 +1,43 @@
+#pragma once
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lmlisp {
+struct Runtime_Stats;
+
+// A fixed set of worker threads running fork/join jobs. run() hands the
+// tasks of a job out to the workers and to the calling thread, and returns
+// once all of them are done; a job started from inside a task runs inline
+// on its thread, so nested jobs can't deadlock the pool.
+class Thread_Pool {
+public:
+  explicit Thread_Pool(unsigned int n_workers);
+  Thread_Pool(const Thread_Pool &o) = delete;
+  ~Thread_Pool();
+  static Thread_Pool &shared();
+  unsigned int size() const; // threads working on a job, caller included
+  void run(unsigned int n_tasks,
+           const std::function<void(unsigned int)> &task);
+
+private:
+  void work();
+  bool run_next(std::unique_lock<std::mutex> &lock);
+
+  std::vector<std::thread> workers;
+  std::mutex job_mutex; // one job at a time
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(unsigned int)> *task = nullptr;
+  unsigned int n_tasks = 0;
+  unsigned int next_task = 0;
+  unsigned int pending = 0;
+  std::exception_ptr error;
+  Runtime_Stats *job_stats = nullptr; // what the tasks of the job counted
+  bool stopping = false;
+};
+} // namespace lmlisp
@@ -1,89 +1,152 @@
 #include "printer.hpp"
 #include "externals.hpp"
+#include <charconv>
 
 namespace lmlisp {
 
-  inline void replace_str(std::string &s, const std::string &old_s,
-			  const std::string &new_s) {
-    size_t index = s.find(old_s, 0);
-    while (index != std::string::npos) {
-      s.replace(index, old_s.length(), new_s);
-      index = s.find(old_s, index + new_s.length());
-    }
-  }
-
 std::string pr_str(ElementP el, bool print_readably) {
+  std::string ret;
+  pr_str(el, print_readably, ret);
+  return ret;
+}
+
+void pr_str(ElementP el, bool print_readably, std::string &out) {
     switch (el->type) {
     case NIL:
-      return "nil";
+      out += "nil";
+      break;
     case BOOLEAN:
-      return el->to<Boolean>()->value() ? "true" : "false";
+      out += el->to<Boolean>()->value() ? "true" : "false";
+      break;
     case NUMBER:
-      return std::to_string(el->to<Number>()->value());
+      out += std::to_string(el->to<Number>()->value());
+      break;
     case STRING:
       {
-	std::string ret = el->to<String>()->value();
-	if (print_readably) {
-	  replace_str(ret, "\\", "\\\\");
-	  replace_str(ret, "\"", "\\\"");
-	  replace_str(ret, "\n", "\\n");
-	  ret = "\"" + ret + "\"";	  
-	} 
-	return ret;
+	std::string_view s = el->to<String>()->value();
+	if (not print_readably) {
+	  out += s;
+	  break;
+	}
+	out.reserve(out.size() + s.size() + 2);
+	out += '"';
+	for (char c : s) {
+	  if (c == '\\')
+	    out += "\\\\";
+	  else if (c == '"')
+	    out += "\\\"";
+	  else if (c == '\n')
+	    out += "\\n";
+	  else
+	    out += c;
+	}
+	out += '"';
+	break;
       }
     case SYMBOL:
-      return el->to<Symbol>()->value();
+      out += el->to<Symbol>()->value();
+      break;
     case KEYWORD:
-      return ":" + el->to<Keyword>()->value();
+      out += ':';
+      out += el->to<Keyword>()->value();
+      break;
     case LIST: {
       ListP l = el->to<List>();
-      std::string ret = "(";
+      out += "(";
       for (unsigned int i = 0; i < l->size(); i++) {
-	ret += pr_str(l->at(i), print_readably);
-	if (i < (l->size() - 1))
-	  ret += " ";
+	if (i > 0)
+	  out += " ";
+	pr_str(l->at(i), print_readably, out);
       }
-      ret += ")";
-      return ret;
+      out += ")";
+      break;
     }
     case VEC: {
       VecP l = el->to<Vec>();
-      std::string ret = "[";
+      out += "[";
       for (unsigned int i = 0; i < l->size(); i++) {
-	ret += pr_str(l->at(i), print_readably);
-	if (i < (l->size() - 1))
-	  ret += " ";
+	if (i > 0)
+	  out += " ";
+	pr_str(l->at(i), print_readably, out);
+      }
+      out += "]";
+      break;
+    }
+    case LAZY_SEQ: {
+      out += "(";
+      bool first = true;
+      for (Lazy_SeqP s = el->to<Lazy_Seq>(); s; s = s->chunk_more()) {
+	for (unsigned int i = 0; i < s->chunk_size(); i++) {
+	  if (not first)
+	    out += " ";
+	  first = false;
+	  pr_str(s->chunk_at(i), print_readably, out);
+	}
       }
-      ret += "]";
-      return ret;
+      out += ")";
+      break;
     }
     case DICT: {
-      std::string ret = "{";
+      out += "{";
       DictP d = el->to<Dict>();
       ListP keys = d->keys()->to<List>();
       for (unsigned int i = 0; i < keys->size(); ++i) {
-	ret += pr_str(keys->at(i), true) + " " +
-	  pr_str(d->get(keys->at(i)), print_readably);
-	if (i < (keys->size() - 1))
-	  ret += " ";
+	if (i > 0)
+	  out += " ";
+	pr_str(keys->at(i), true, out);
+	out += " ";
+	pr_str(d->get(keys->at(i)), print_readably, out);
       }
-      ret += "}";
-      return ret;
-    }
-    case FUNCTION: {
-      FunctionP f_el = el->to<Function>();
-      if (f_el->is_macro) {
-	return std::string("Macro");
-      } else
-	return std::string("Function");
+      out += "}";
+      break;
     }
+    case FUNCTION:
+      out += el->to<Function>()->is_macro ? "Macro" : "Function";
+      break;
     case ATOM:
-      return std::string("(atom " + pr_str(el->to<Atom>()->ref) + ")");
+      out += "(atom ";
+      pr_str(el->to<Atom>()->ref, false, out);
+      out += ")";
+      break;
+    case REDUCED:
+      out += "(reduced ";
+      pr_str(el->to<Reduced>()->ref, false, out);
+      out += ")";
+      break;
+    case TRANSIENT:
+      out += "#<transient>";
+      break;
+    case STRING_BUILDER:
+      out += "#<string-builder>";
+      break;
+    case ARRAY: {
+      ArrayP a = el->to<Array>();
+      out += a->kind == Array::DOUBLE ? "(double-array [" : "(long-array [";
+      char buffer[32];
+      for (std::size_t i = 0; i < a->size(); i++) {
+	char *end = a->kind == Array::DOUBLE
+			? std::to_chars(buffer, buffer + 32, a->doubles[i]).ptr
+			: std::to_chars(buffer, buffer + 32, a->longs[i]).ptr;
+	if (i > 0)
+	  out += " ";
+	out.append(buffer, end);
+      }
+      out += "])";
+      break;
+    }
+    case TABLE: {
+      TableP t = el->to<Table>();
+      out += "#<table " + std::to_string(t->rows()) + " rows [";
+      for (unsigned int i = 0; i < t->names.size(); i++)
+	out += (i > 0 ? " :" : ":") + t->names[i];
+      out += "]>";
+      break;
+    }
     case EXCEPTION:
-      return el->to<Exception>()->value();
+      out += el->to<Exception>()->value();
       break;
     default:
-      return std::string("printer ERROR: something else");
+      out += "printer ERROR: something else";
     }
   }
 } // namespace lmlisp
@@ -5,4 +5,6 @@
 
 namespace lmlisp {
 std::string pr_str(ElementP el, bool print_readably = false);
+// Appends the printed form of el to out
+void pr_str(ElementP el, bool print_readably, std::string &out);
 } // namespace lmlisp
@@ -0,0 +1,77 @@
+#include "profiler.hpp"
+#include "runtime.hpp"
+#include "types.hpp"
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace lmlisp {
+std::atomic<bool> Profiler::tick = false;
+
+static std::atomic<bool> active = false;
+static std::mutex samples_mutex;
+static std::unordered_map<std::string, unsigned long> samples;
+
+// Owns the ticker thread, stopping it if the program exits while the
+// profiler is running
+static struct Ticker {
+  std::thread thread;
+  ~Ticker() {
+    active = false;
+    if (thread.joinable())
+      thread.join();
+  }
+} ticker;
+
+bool Profiler::start(unsigned int interval_ms) {
+  if (active.exchange(true))
+    return false;
+  {
+    // a thread may still be recording a sample of the last run
+    std::lock_guard<std::mutex> lock(samples_mutex);
+    samples.clear();
+  }
+  ticker.thread = std::thread([interval_ms]() {
+    while (active.load(std::memory_order_relaxed)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+      tick.store(true, std::memory_order_relaxed);
+    }
+  });
+  return true;
+}
+
+std::string Profiler::stop() {
+  if (not active.exchange(false))
+    return "";
+  ticker.thread.join();
+  tick = false;
+  // folded stacks, one "root;caller;callee count" line per distinct stack
+  std::string ret;
+  std::lock_guard<std::mutex> lock(samples_mutex);
+  for (const auto &[stack, count] : samples)
+    ret += stack + " " + std::to_string(count) + "\n";
+  samples.clear();
+  return ret;
+}
+
+bool Profiler::running() { return active; }
+
+// Frame labels name source files, whose paths may hold the separators of
+// the folded format
+static void append_label(std::string &stack, const Function *f) {
+  for (char c : Runtime::frame_label(f))
+    stack += c == ' ' or c == ';' ? '_' : c;
+}
+
+void Profiler::sample() {
+  tick.store(false, std::memory_order_relaxed);
+  std::string stack = "toplevel";
+  for (Function *f : Runtime::call_stack) {
+    stack += ";";
+    append_label(stack, f);
+  }
+  std::lock_guard<std::mutex> lock(samples_mutex);
+  samples[stack]++;
+}
+} // namespace lmlisp
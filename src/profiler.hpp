@@ -0,0 +1,18 @@
+#pragma once
+#include <atomic>
+#include <string>
+
+namespace lmlisp {
+// Sampling profiler. A ticker thread raises `tick` every interval and EVAL
+// records the Lisp call stack the next time it goes around its loop, so the
+// only cost on the hot path is a relaxed load.
+class Profiler {
+public:
+  static bool start(unsigned int interval_ms = 1);
+  static std::string stop();
+  static bool running();
+  static void sample();
+
+  static std::atomic<bool> tick;
+};
+} // namespace lmlisp
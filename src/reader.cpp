@@ -1,6 +1,7 @@
 #include "reader.hpp"
 #include "types.hpp"
 #include "externals.hpp"
+#include <algorithm>
 // #include "debug.hpp"
 
 // #define LM_DEBUG
@@ -31,8 +32,13 @@ std::string Reader::next() {
 
 std::string Reader::peek() { return tokens[pos]; }
 
-ElementP read_str(const std::string &input) {
+ElementP read_str(const std::string &input, const std::string &filename) {
   Reader r;
+  r.file = source_file(filename);
+  r.line_starts.push_back(0);
+  for (unsigned int i = 0; i < input.length(); i++)
+    if (input[i] == '\n')
+      r.line_starts.push_back(i + 1);
   auto tokens_ = r.tokenize(input);
   if (tokens_.index() == 0) {
     r.tokens = std::get<std::vector<std::string>>(tokens_);
@@ -148,7 +154,20 @@ BRACKETS_BALANCING_ERROR Reader::Brackets_Checker::check_stack(char br) {
   }
 }
 
-void Reader::add_token(std::string token) { tokens.push_back(token); }
+void Reader::add_token(std::string token, unsigned int start) {
+  tokens.push_back(token);
+  offsets.push_back(start);
+}
+
+Source_Span Reader::span_at(int token) const {
+  unsigned int offset = offsets[token];
+  auto line = std::upper_bound(line_starts.begin(), line_starts.end(), offset);
+  Source_Span span;
+  span.file = file;
+  span.line = line - line_starts.begin();
+  span.column = offset - *(line - 1) + 1;
+  return span;
+}
   
 #define PUSH_AND_RETURN(br) {					\
     std::optional<ExceptionP> err = bc.push_bracket(br);	\
@@ -172,7 +191,7 @@ Reader::tokenize(std::string input) {
         last_is_escape = false;
         bc.push_bracket('"');
         current_token = UNKNOWN;
-        add_token(input.substr(index, offset + 1));
+        add_token(input.substr(index, offset + 1), index);
         index += offset + 1;
         offset = 0;
       } else if (ch == '\\') {
@@ -219,7 +238,7 @@ Reader::tokenize(std::string input) {
       switch (ch) {
       case ' ':
         if (offset != 0) {
-          add_token(input.substr(index, offset));
+          add_token(input.substr(index, offset), index);
           index += offset;
           offset = 0;
         }
@@ -234,15 +253,15 @@ Reader::tokenize(std::string input) {
       case '~':
         if (input.at(index + offset + 1) == '@') {
           if (offset != 0)
-            add_token(input.substr(index, offset));
-          add_token(input.substr(index + offset, 2));
+            add_token(input.substr(index, offset), index);
+          add_token(input.substr(index + offset, 2), index + offset);
           index += offset + 2;
           offset = 0;
           break;
         } else {
           if (offset != 0)
-            add_token(input.substr(index, offset));
-          add_token(input.substr(index + offset, 1));
+            add_token(input.substr(index, offset), index);
+          add_token(input.substr(index + offset, 1), index + offset);
           index += offset + 1;
           offset = 0;
           break;
@@ -250,47 +269,47 @@ Reader::tokenize(std::string input) {
       case '(':
         PUSH_AND_RETURN('(');
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         break;
       case ')':
         PUSH_AND_RETURN(')');
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         break;
       case '[':
         PUSH_AND_RETURN('[');
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         break;
       case ']':
         PUSH_AND_RETURN(']');
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         break;
       case '{':
         PUSH_AND_RETURN('{');
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         break;
       case '}':
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         PUSH_AND_RETURN('}');
@@ -301,8 +320,8 @@ Reader::tokenize(std::string input) {
       case '`':
       case '^':
         if (offset != 0)
-          add_token(input.substr(index, offset));
-        add_token(input.substr(index + offset, 1));
+          add_token(input.substr(index, offset), index);
+        add_token(input.substr(index + offset, 1), index + offset);
         index += offset + 1;
         offset = 0;
         break;
@@ -310,14 +329,14 @@ Reader::tokenize(std::string input) {
       case '\t':
       case ',': // TODO test if ignoring comma is correct
         if (offset > 0)
-          add_token(input.substr(index, offset));
+          add_token(input.substr(index, offset), index);
         index += offset + 1;
         offset = 0;
         break;
       case ';':
         current_token = COMMENT;
         if (offset > 0)
-          add_token(input.substr(index, offset));
+          add_token(input.substr(index, offset), index);
         index += offset + 1;
         offset = 0;
         break;
@@ -342,7 +361,7 @@ Reader::tokenize(std::string input) {
   if (input.length() > 0 and index < input.length()) {
     if (current_token == STRING)
       writeln("residue: " + input.substr(index, offset));
-    add_token(input.substr(index, offset));
+    add_token(input.substr(index, offset), index);
   }
   std::optional<ExceptionP> err = bc.close();
   if (err.has_value()) return err.value();
@@ -366,6 +385,7 @@ ElementP Reader::read_form() {
 
 ElementP Reader::read_list() {
   ElementP ret_list = list();
+  set_span(ret_list->to<List>(), span_at(pos));
 #ifdef _LM_DEBUG
   writeln("starting list");
 #endif
@@ -34,7 +34,8 @@ namespace lmlisp {
       ElementP read_dict();
       ElementP read_atom();
 
-      friend ElementP read_str(const std::string& input);
+      friend ElementP read_str(const std::string &input,
+                               const std::string &filename);
 
     private:
       enum TOKEN_TYPE {
@@ -44,11 +45,15 @@ namespace lmlisp {
         COMMENT,
       };
 
-      void add_token(std::string token);
+      void add_token(std::string token, unsigned int start);
+      Source_Span span_at(int token) const;
       std::variant<std::vector<std::string>, ExceptionP>
         tokenize(const std::string input);
 
       std::vector<std::string> tokens;
+      std::vector<unsigned int> offsets;
+      std::vector<unsigned int> line_starts;
+      unsigned int file;
       int pos;
 
       class Brackets_Checker {
@@ -66,5 +71,6 @@ namespace lmlisp {
       };
   };
 
-  ElementP read_str(const std::string &input);
+  ElementP read_str(const std::string &input,
+                    const std::string &filename = "");
 }
@@ -1,17 +1,33 @@
 #include "runtime.hpp"
+#include "compiler.hpp"
 #include "core.hpp"
+#include "jit.hpp"
 #include "macros.hpp"
 #include "printer.hpp"
+#include "profiler.hpp"
 #include "reader.hpp"
+#include "stats.hpp"
 #include "types.hpp"
 #include <cstdlib>
+#include <mutex>
 #include <stdlib.h>
+#include <string_view>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
 namespace lmlisp {
 Runtime *Runtime::current = nullptr;
-ElementP Runtime::exc_value = nil();
-bool Runtime::raised = false;
-bool Runtime::handled = false;
+thread_local ElementP Runtime::exc_value = nil();
+thread_local bool Runtime::raised = false;
+thread_local bool Runtime::handled = false;
+thread_local std::vector<Function *> Runtime::call_stack;
+thread_local std::vector<FunctionP> Runtime::exc_trace;
+thread_local Tail_Call Runtime::tail;
+std::size_t Runtime::max_stack_bytes = 6 * 1024 * 1024;
+thread_local EnvironmentP Runtime::globals;
+std::atomic<Engine> Runtime::engine = Engine::TREE;
 
 void error(std::string message) {
   writeln(message);
@@ -27,10 +43,13 @@ void error(std::string message) {
 Runtime::Runtime(std::string filename, std::vector<std::string> argv) {
   running = false;
   core_runtime = init_core(argv);
+  Jit::register_primitives(core_runtime);
 
   core_runtime->set("eval", func([this](ListP args) {
                       if (args->size() == 1) {
-                        return EVAL(args->at(0), this->core_runtime);
+                        return tail_eval(args->at(0),
+                                         Runtime::globals ? Runtime::globals
+                                                          : this->core_runtime);
                       } else {
                         THROW("eval: accept one argument");
                       }
@@ -61,21 +80,149 @@ Runtime::Runtime(std::string filename, std::vector<std::string> argv) {
                           return ret->el();
                         } else if (el0->type == VEC)
                           return el0;
+                        else if (el0->type == ARRAY) {
+                          ArrayP a = el0->to<Array>();
+                          VecP ret = vec();
+                          ret->reserve(a->size());
+                          for (std::size_t i = 0; i < a->size(); i++)
+                            ret->append(a->at(i));
+                          return ret->el();
+                        } else if (el0->type == LAZY_SEQ) {
+                          VecP ret = vec();
+                          for (Lazy_SeqP s = el0->to<Lazy_Seq>(); s;
+                               s = s->chunk_more())
+                            for (unsigned int i = 0; i < s->chunk_size(); i++)
+                              ret->append(s->chunk_at(i));
+                          return ret->el();
+                        }
                         else
                           THROW("vec: accepted values are list or vecs");
                       } else
                         return vec()->el();
                     }));
 
-  post_init(*this, filename);
+  post_init(*this, core_runtime, filename);
+}
+
+static void take_tail_call(ElementP &ast, EnvironmentP &env,
+                           Call_Frame &frame) {
+  ast = std::move(Runtime::tail.ast);
+  Environment::release(env);
+  env = std::move(Runtime::tail.env);
+  if (Runtime::tail.f)
+    frame.enter(std::move(Runtime::tail.f));
+  Runtime::tail.pending = false;
+  STAT_INC(tail_calls);
 }
 
-ElementP apply(FunctionP f, ListP args, std::optional<EnvironmentP> env) {
+ElementP apply(FunctionP f, ListP args,
+               [[maybe_unused]] std::optional<EnvironmentP> env) {
   if (f->is_native()) {
-    return f->apply(args);
+    STAT_INC(native_calls);
+    ElementP ret = f->apply(args);
+    if (not Runtime::tail.pending)
+      return ret;
+    Call_Frame frame;
+    ElementP ast;
+    EnvironmentP t_env;
+    take_tail_call(ast, t_env, frame);
+    return EVAL(ast, std::move(t_env));
   } else {
-    return EVAL(f->get_exprs(), f->create_env(env.value(), args));
+    STAT_INC(user_calls);
+    const Arity *arity = f->arity(args->size());
+    if (not arity)
+      return nil();
+    ElementP ret;
+    if (Jit::enabled.load(std::memory_order_relaxed) and
+        Jit::call(*f, *arity, args, ret))
+      return ret;
+    if (Runtime::engine.load(std::memory_order_relaxed) == Engine::CLOSURES)
+      if (const Code *code = compiled(*f, *arity))
+        return run(std::move(f), code, std::move(args));
+    Call_Frame frame;
+    ElementP exprs = arity->exprs;
+    EnvironmentP f_env = f->create_env(*arity, args);
+    frame.enter(std::move(f));
+    return EVAL(exprs, std::move(f_env));
+  }
+}
+
+ElementP tail_call(FunctionP f, ListP args) {
+  if (f->is_native()) {
+    STAT_INC(native_calls);
+    return f->apply(args);
+  }
+  STAT_INC(user_calls);
+  const Arity *arity = f->arity(args->size());
+  if (not arity)
+    return nil();
+  Runtime::tail.ast = arity->exprs;
+  Runtime::tail.env = f->create_env(*arity, args);
+  Runtime::tail.f = std::move(f);
+  Runtime::tail.pending = true;
+  return nil();
+}
+
+ElementP tail_eval(ElementP ast, EnvironmentP env) {
+  Runtime::tail.ast = std::move(ast);
+  Runtime::tail.env = std::move(env);
+  Runtime::tail.f = nullptr;
+  Runtime::tail.pending = true;
+  return nil();
+}
+
+//**************************************************************************
+//
+//                               CALL STACK
+//
+//**************************************************************************
+
+// How deep evaluations may nest below here on this thread: down to the end
+// of its stack, less a quarter of the stack left to the natives and C++
+// frames run between two checks; max_stack_bytes where the stack can't be
+// read.
+static std::size_t stack_limit(const char *here) {
+#ifdef __linux__
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void *low;
+    std::size_t size;
+    bool read = pthread_attr_getstack(&attr, &low, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if (read and here >= low and here - static_cast<const char *>(low) <=
+                                     static_cast<std::ptrdiff_t>(size)) {
+      std::size_t below = here - static_cast<const char *>(low);
+      return below > size / 4 ? below - size / 4 : 0;
+    }
   }
+#endif
+  return Runtime::max_stack_bytes;
+}
+
+// The first evaluation on a thread marks the top of its stack; nested
+// evaluations fail once they are deeper than the thread's limit below it.
+bool Runtime::stack_exhausted() {
+  static thread_local const char *stack_top = nullptr;
+  static thread_local std::size_t limit = 0;
+  char here = 0;
+  if (stack_top == nullptr) {
+    stack_top = &here;
+    limit = stack_limit(&here);
+  }
+  std::size_t used = stack_top > &here ? stack_top - &here : &here - stack_top;
+  return used > limit;
+}
+
+Call_Frame::Call_Frame() : depth(Runtime::call_stack.size()) {}
+
+Call_Frame::~Call_Frame() { Runtime::call_stack.resize(depth); }
+
+void Call_Frame::enter(FunctionP f) {
+  if (Runtime::call_stack.size() > depth)
+    Runtime::call_stack.back() = f.get();
+  else
+    Runtime::call_stack.push_back(f.get());
+  this->f = std::move(f);
 }
 
 void Runtime::quit() {
@@ -85,6 +232,42 @@ void Runtime::quit() {
 
 Runtime &Runtime::get_current() { return *Runtime::current; }
 
+// The first exception wins: callers unwinding from it may fail again
+// (e.g. on the nil it left behind) and must not replace it.
+void Runtime::raise(ElementP value) {
+  if (raised)
+    return;
+  STAT_INC(exceptions);
+  raised = true;
+  exc_value = value;
+  exc_trace.clear();
+  for (Function *f : call_stack)
+    exc_trace.push_back(f->to<Function>());
+}
+
+// Clears the pending exception and returns its value, so it can be raised
+// again on another thread.
+ElementP Runtime::take_exception() {
+  ElementP ret = exc_value;
+  raised = false;
+  exc_value = nil();
+  return ret;
+}
+
+std::vector<std::string> Runtime::stack_trace() {
+  std::vector<std::string> ret;
+  for (int i = exc_trace.size() - 1; i >= 0; i--)
+    ret.push_back(frame_label(exc_trace[i].get()));
+  return ret;
+}
+
+std::string Runtime::frame_label(const Function *f) {
+  std::string label = f->name.empty() ? "fn*" : f->name;
+  if (f->site.line != 0)
+    label += "@" + span_str(f->site);
+  return label;
+}
+
 void Runtime::repl() {
   running = true;
   while (running) {
@@ -99,7 +282,7 @@ void Runtime::repl() {
 //
 //**************************************************************************
 
-static bool is_special_form(ElementP el, std::string form) {
+static bool is_special_form(ElementP el, std::string_view form) {
   return (el->type == SYMBOL and el->to<Symbol>()->value() == form);
 }
 
@@ -112,6 +295,8 @@ static bool is_special_form(ElementP el, std::string form) {
 ElementP cons(ElementP el, ElementP l) {
   ListP ret = list();
   ret->append(el);
+  if (l->type == LAZY_SEQ)
+    return lazy_seq(ret, 0, 1, l->to<Lazy_Seq>());
   if (l->type == LIST) {
     for (unsigned int i = 0; i < l->to<List>()->size(); i++)
       ret->append(l->to<List>()->at(i));
@@ -123,7 +308,30 @@ ElementP cons(ElementP el, ElementP l) {
   return ret->el();
 }
 
+// Chains the chunks of each sequence in turn, realizing them as they are
+// reached.
+static Lazy_SeqP lazy_concat(std::vector<ElementP> args) {
+  return lazy_seq([args]() -> ElementP {
+    for (unsigned int i = 0; i < args.size(); i++) {
+      Lazy_SeqP s = as_lazy_seq(args[i]);
+      if (not s)
+        THROW("concat: arguments must be sequences");
+      if (s->empty())
+        continue;
+      std::vector<ElementP> rest(args.begin() + i + 1, args.end());
+      if (Lazy_SeqP more = s->chunk_more())
+        rest.insert(rest.begin(), more);
+      return s->slice(0, s->chunk_size(),
+                      rest.empty() ? nullptr : lazy_concat(std::move(rest)));
+    }
+    return nil();
+  });
+}
+
 ElementP concat(std::vector<ElementP> args) {
+  for (ElementP l : args)
+    if (l->type == LAZY_SEQ)
+      return lazy_concat(std::move(args));
   bool valid = true;
   ListP ret = list();
   for (ElementP l : args) {
@@ -230,28 +438,462 @@ bool is_macro_call(ElementP ast, EnvironmentP env) {
   return true;
 }
 
-ElementP macroexpand(ElementP ast, EnvironmentP env) {
+// The expansion of form, a call of macro
+static ElementP expand_call(const ListP &form, const FunctionP &macro) {
+  ListP args = list();
+  for (unsigned int i = 1; i < form->size(); i++) {
+    args->append(form->at(i));
+  }
+  STAT_INC(macro_expansions);
+  const Arity *arity = macro->arity(args->size());
+  if (not arity)
+    return nil();
+  return EVAL(arity->exprs, macro->create_env(*arity, args));
+}
+
+ElementP macroexpand(ElementP ast, EnvironmentP env, Macro_Uses *uses) {
   while (is_macro_call(ast, env)) {
     ListP l_ast = ast->to<List>();
     FunctionP macro =
         env->get(l_ast->at(0)->to<Symbol>()->value())->to<Function>();
-    ListP args = list();
-    for (unsigned int i = 1; i < l_ast->size(); i++) {
-      args->append(l_ast->at(i));
-    }
-    ast = EVAL(macro->get_exprs(), macro->create_env(env, args));
+    if (uses)
+      uses->emplace_back(l_ast->at(0)->to<Symbol>()->value(), macro);
+    ast = expand_call(l_ast, macro);
   }
   return ast;
 }
 
 ElementP READ(std::string input) { return read_str(input); }
 
+// Checks that every recur in ast is in tail position. Bodies of nested fn*
+// and loop forms are skipped, they are checked when they are entered.
+static bool recur_in_tail(ElementP ast, EnvironmentP env, bool tail) {
+  if (ast->type == VEC) {
+    VecP v_ast = ast->to<Vec>();
+    for (unsigned int i = 0; i < v_ast->size(); i++)
+      if (not recur_in_tail(v_ast->at(i), env, false))
+        return false;
+    return true;
+  }
+  if (ast->type != LIST or ast->to<List>()->size() == 0)
+    return true;
+  ListP l_ast = ast->to<List>();
+  unsigned int first_tail = l_ast->size(); // elements from here are in tail
+  unsigned int skip_from = l_ast->size();  // elements from here are skipped
+  if (l_ast->at(0)->type == SYMBOL) {
+    std::string_view name = l_ast->at(0)->to<Symbol>()->value();
+    ElementP found_env = env->find(name);
+    if (name == "quote" or name == "quasiquote" or name == "fn*" or
+        name == "lazy-seq")
+      return true;
+    else if (name == "recur" and not tail)
+      return false;
+    else if (name == "if")
+      first_tail = 2;
+    else if (name == "do")
+      first_tail = l_ast->size() - 1;
+    else if (name == "let*")
+      first_tail = 2;
+    else if (name == "loop")
+      skip_from = 2;
+    else if (found_env->type != NIL and
+             found_env->to<Environment>()->get(name)->type == FUNCTION and
+             found_env->to<Environment>()->get(name)->to<Function>()->is_macro)
+      return recur_in_tail(macroexpand(ast, env), env, tail);
+  }
+  for (unsigned int i = 0; i < l_ast->size() and i < skip_from; i++) {
+    ElementP el = l_ast->at(i);
+    // let* and loop bindings
+    if (i == 1 and (is_special_form(l_ast->at(0), "let*") or
+                    is_special_form(l_ast->at(0), "loop"))) {
+      ListP binds = el->type == VEC ? el->to<Vec>()->listed()
+                                    : el->type == LIST ? el->to<List>() : list();
+      for (unsigned int j = 1; j < binds->size(); j += 2)
+        if (not recur_in_tail(binds->at(j), env, false))
+          return false;
+    } else if (not recur_in_tail(el, env, tail and i >= first_tail))
+      return false;
+  }
+  return true;
+}
+
+// (fn* ([x] ...) ([x y] ...)): the first element after fn* is a clause
+// rather than a binds list
+static bool is_multi_arity(ListP form) {
+  if (not form->check_nth(1, LIST))
+    return false;
+  ListP first = form->at(1)->to<List>();
+  return first->size() > 0 and
+         (first->at(0)->type == LIST or first->at(0)->type == VEC);
+}
+
+// Reads the binds of one arity of fn*; raises and returns false when they
+// aren't a list or vec of symbols
+static bool read_arity(ElementP binds, ElementP body, Arity &arity) {
+  if (binds->type != LIST and binds->type != VEC) {
+    Runtime::raise(str("fn*: clojure arguments must be a list or a vec"));
+    return false;
+  }
+  ListP u_binds = binds->type == VEC ? binds->to<Vec>()->listed()
+                                     : binds->to<List>();
+  arity.binds = list();
+  arity.exprs = body;
+  for (unsigned int i = 0; i < u_binds->size(); i++) {
+    if (u_binds->at(i)->type != SYMBOL) {
+      Runtime::raise(str("fn*: binds element must all be symbols"));
+      return false;
+    }
+    if (i == u_binds->size() - 2 and
+        u_binds->at(i)->to<Symbol>()->value() == "&") {
+      arity.last_is_variadic = true;
+      arity.binds->append(u_binds->at(i + 1));
+      break;
+    }
+    arity.binds->append(u_binds->at(i));
+  }
+  return true;
+}
+
+// Every call must pick exactly one arity
+static bool check_arities(const std::vector<Arity> &arities) {
+  const Arity *variadic = nullptr;
+  for (const Arity &a : arities)
+    if (a.last_is_variadic) {
+      if (variadic) {
+        Runtime::raise(str("fn*: can't have more than one variadic arity"));
+        return false;
+      }
+      variadic = &a;
+    }
+  for (unsigned int i = 0; i < arities.size(); i++) {
+    if (arities[i].last_is_variadic)
+      continue;
+    unsigned int n = arities[i].binds->size();
+    for (unsigned int j = i + 1; j < arities.size(); j++)
+      if (not arities[j].last_is_variadic and arities[j].binds->size() == n) {
+        Runtime::raise(str("fn*: two arities take " + std::to_string(n) +
+                           " arguments"));
+        return false;
+      }
+    if (variadic and n + 1 > variadic->binds->size()) {
+      Runtime::raise(str("fn*: an arity takes more arguments than the "
+                         "variadic one requires"));
+      return false;
+    }
+  }
+  return true;
+}
+
+// Collects into info the symbols ast evaluates that aren't in bound. Macro
+// calls are expanded as they would be when evaluated; quoted forms and the
+// names special forms bind are skipped.
+static void free_symbols(ElementP ast, EnvironmentP env,
+                         std::vector<std::string_view> &bound,
+                         Closure_Info &info) {
+  if (not info.flat)
+    return;
+  if (ast->type == SYMBOL) {
+    std::string_view name = ast->to<Symbol>()->value();
+    for (std::string_view b : bound)
+      if (b == name)
+        return;
+    for (const std::string &f : info.free)
+      if (f == name)
+        return;
+    info.free.emplace_back(name);
+    return;
+  }
+  if (ast->type == VEC) {
+    VecP v_ast = ast->to<Vec>();
+    for (unsigned int i = 0; i < v_ast->size(); i++)
+      free_symbols(v_ast->at(i), env, bound, info);
+    return;
+  }
+  if (ast->type == DICT) {
+    ast->to<Dict>()->for_each([&](ElementP, ElementP value) {
+      free_symbols(value, env, bound, info);
+    });
+    return;
+  }
+  if (ast->type != LIST or ast->to<List>()->size() == 0)
+    return;
+  ListP l_ast = ast->to<List>();
+  std::size_t scope = bound.size();
+  unsigned int first = 0; // elements from here are walked as expressions
+  if (l_ast->at(0)->type == SYMBOL) {
+    std::string_view name = l_ast->at(0)->to<Symbol>()->value();
+    first = 1;
+    if (name == "quote" or name == "quasiquoteexpand")
+      return;
+    if (name == "def!" or name == "defmacro!") {
+      info.flat = false;
+      info.frame_escapes = true;
+      return;
+    }
+    if (name == "fn*" or name == "lazy-seq")
+      info.frame_escapes = true;
+    if (name == "quasiquote") {
+      if (l_ast->size() == 2)
+        free_symbols(quasiquote(l_ast->at(1)), env, bound, info);
+      return;
+    }
+    if (name == "fn*" and is_multi_arity(l_ast)) {
+      for (unsigned int i = 1; i < l_ast->size(); i++) {
+        Arity arity;
+        if (l_ast->at(i)->type != LIST or
+            l_ast->at(i)->to<List>()->size() != 2 or
+            not read_arity(l_ast->at(i)->to<List>()->at(0),
+                           l_ast->at(i)->to<List>()->at(1), arity)) {
+          // the error is raised again when the form is evaluated
+          Runtime::take_exception();
+          continue;
+        }
+        for (unsigned int j = 0; j < arity.binds->size(); j++)
+          bound.push_back(arity.binds->at(j)->to<Symbol>()->value());
+        free_symbols(arity.exprs, env, bound, info);
+        bound.resize(scope);
+      }
+      return;
+    }
+    if (name == "fn*" and l_ast->size() >= 3 and
+        (l_ast->at(1)->type == LIST or l_ast->at(1)->type == VEC)) {
+      ListP params = l_ast->at(1)->type == VEC
+                         ? l_ast->at(1)->to<Vec>()->listed()
+                         : l_ast->at(1)->to<List>();
+      for (unsigned int i = 0; i < params->size(); i++)
+        if (params->at(i)->type == SYMBOL)
+          bound.push_back(params->at(i)->to<Symbol>()->value());
+      first = 2;
+    } else if ((name == "let*" or name == "loop") and l_ast->size() >= 3 and
+               (l_ast->at(1)->type == LIST or l_ast->at(1)->type == VEC)) {
+      ListP binds = l_ast->at(1)->type == VEC
+                        ? l_ast->at(1)->to<Vec>()->listed()
+                        : l_ast->at(1)->to<List>();
+      for (unsigned int i = 0; i + 1 < binds->size(); i += 2) {
+        if (binds->at(i)->type == SYMBOL)
+          bound.push_back(binds->at(i)->to<Symbol>()->value());
+        free_symbols(binds->at(i + 1), env, bound, info);
+      }
+      first = 2;
+    } else if (name == "try*" and l_ast->size() == 3 and
+               l_ast->at(2)->type == LIST and
+               l_ast->at(2)->to<List>()->size() == 3 and
+               l_ast->at(2)->to<List>()->at(1)->type == SYMBOL) {
+      ListP catch_form = l_ast->at(2)->to<List>();
+      free_symbols(l_ast->at(1), env, bound, info);
+      bound.push_back(catch_form->at(1)->to<Symbol>()->value());
+      free_symbols(catch_form->at(2), env, bound, info);
+      bound.resize(scope);
+      return;
+    } else if (name != "if" and name != "do" and name != "recur" and
+               name != "lazy-seq" and name != "macroexpand") {
+      bool shadowed = false;
+      for (std::string_view b : bound)
+        shadowed = shadowed or b == name;
+      if (not shadowed and env->find(name)->type != NIL and
+          is_macro_call(ast, env)) {
+        FunctionP macro = env->get(name)->to<Function>();
+        if (not macro->pure_macro) {
+          // user macros run when the body is, and may expand differently
+          // by then: the closure keeps its frames
+          info.flat = false;
+          info.frame_escapes = true;
+          return;
+        }
+        bool seen = false;
+        for (const auto &[used, fn] : info.macros)
+          seen = seen or used == name;
+        if (not seen)
+          info.macros.emplace_back(name, macro);
+        ElementP expanded = expand_call(l_ast, macro);
+        if (Runtime::raised) {
+          // the error is raised again when the form is evaluated
+          Runtime::take_exception();
+          info.flat = false;
+          info.frame_escapes = true;
+          return;
+        }
+        free_symbols(expanded, env, bound, info);
+        return;
+      }
+      first = 0;
+    }
+  }
+  for (unsigned int i = first; i < l_ast->size(); i++)
+    free_symbols(l_ast->at(i), env, bound, info);
+  bound.resize(scope);
+}
+
+bool read_fn(ListP form, std::vector<Arity> &arities) {
+  if (is_multi_arity(form)) {
+    for (unsigned int i = 1; i < form->size(); i++) {
+      if (not form->check_nth(i, LIST) or
+          form->at(i)->to<List>()->size() != 2) {
+        Runtime::raise(str("fn*: each arity must be a binds list and a body"));
+        return false;
+      }
+      ListP clause = form->at(i)->to<List>();
+      arities.emplace_back();
+      if (not read_arity(clause->at(0), clause->at(1), arities.back()))
+        return false;
+    }
+  } else if (form->size() >= 3) {
+    arities.emplace_back();
+    if (not read_arity(form->at(1), form->at(2), arities.back()))
+      return false;
+  } else {
+    Runtime::raise(str("fn*: require at least two parameters"));
+    return false;
+  }
+  return check_arities(arities);
+}
+
+// Whether the macros info was worked out with are still those env binds
+static bool macros_hold(const Closure_Info &info, const EnvironmentP &env) {
+  for (const auto &[name, macro] : info.macros)
+    if (env->get(name) != macro)
+      return false;
+  return true;
+}
+
+Closure_InfoP closure_info(ListP form, const std::vector<Arity> &arities,
+                           EnvironmentP env) {
+  Closure_InfoP info = get_closure_info(form);
+  if (info and macros_hold(*info, env))
+    return info;
+  auto analysis = std::make_shared<Closure_Info>();
+  std::vector<std::string_view> bound;
+  for (const Arity &arity : arities) {
+    bound.clear();
+    for (unsigned int i = 0; i < arity.binds->size(); i++)
+      bound.push_back(arity.binds->at(i)->to<Symbol>()->value());
+    free_symbols(arity.exprs, env, bound, *analysis);
+  }
+  set_closure_info(form, analysis);
+  return analysis;
+}
+
+// The let* and loop frames whose binds are being evaluated on this thread,
+// each with the bind under way. The names from there on aren't in the
+// frame yet, but closures made meanwhile are to see them once they are.
+struct Pending_Binds {
+  const Environment *env;
+  ElementP binds; // the list or vector of the form
+  unsigned int from;
+};
+static thread_local std::vector<Pending_Binds> pending_binds;
+
+struct Pending_Guard {
+  Pending_Guard(const Environment *env, ElementP binds)
+      : index(pending_binds.size()) {
+    pending_binds.push_back({env, std::move(binds), 0});
+  }
+  ~Pending_Guard() { pending_binds.pop_back(); }
+  void at(unsigned int i) { pending_binds[index].from = i; }
+  std::size_t index;
+};
+
+static bool is_pending(const Environment *env, std::string_view name) {
+  for (const Pending_Binds &p : pending_binds) {
+    if (p.env != env)
+      continue;
+    bool is_vec = p.binds->type == VEC;
+    unsigned int size = is_vec ? p.binds->to<Vec>()->size()
+                               : p.binds->to<List>()->size();
+    for (unsigned int i = p.from; i < size; i += 2) {
+      ElementP key = is_vec ? p.binds->to<Vec>()->at(i)
+                            : p.binds->to<List>()->at(i);
+      if (key->type == SYMBOL and key->to<Symbol>()->value() == name)
+        return true;
+    }
+  }
+  return false;
+}
+
+// A let*, loop or catch frame in env. Top-level code isn't analyzed, so
+// its frames are open to def! like those of the functions that aren't flat.
+static EnvironmentP local_frame(const EnvironmentP &env) {
+  EnvironmentP ret = environment(env)->to<Environment>();
+  ret->open = env->open or env->get_level() == 0;
+  return ret;
+}
+
+bool closure_binding(const Environment *env, std::string_view name,
+                     ElementP &value) {
+  for (; env->get_level() > 0; env = env->get_outer()) {
+    if (env->open or (not pending_binds.empty() and is_pending(env, name)))
+      return false;
+    if (const ElementP *binding = env->lookup(name)) {
+      value = *binding;
+      return true;
+    }
+  }
+  value = nullptr;
+  return true;
+}
+
+// The environment a closure created by a fn* form in env keeps. Rather
+// than the whole chain of frames, it keeps the values of the free
+// variables bound in local frames, over the global environment where the
+// others are looked up as the closure runs.
+static EnvironmentP closure_env(const Closure_Info &info, EnvironmentP env) {
+  if (env->get_level() == 0 or not info.flat)
+    return env;
+  EnvironmentP captured;
+  for (const std::string &name : info.free) {
+    ElementP value;
+    if (not closure_binding(env.get(), name, value))
+      return env;
+    if (not value)
+      continue;
+    if (not captured)
+      captured = environment(env->root());
+    captured->set(name, std::move(value));
+  }
+  return captured ? captured : env->root();
+}
+
+// The loop an EVAL invocation is running. A recur can only be in tail
+// position of its loop body, so it is always evaluated by the invocation
+// that entered the loop: it rebinds the slots of the loop frame in place
+// and jumps back to the body.
+struct Loop_Frame {
+  EnvironmentP env; // null when no loop is running
+  EnvironmentP outer;
+  ListP binds;
+  ElementP body;
+  std::vector<ElementP *> slots;
+  std::vector<ElementP> values;
+
+  void bind(EnvironmentP new_env) {
+    env = std::move(new_env);
+    slots.clear();
+    for (unsigned int i = 0; i < binds->size(); i += 2)
+      slots.push_back(&env->slot(binds->at(i)->to<Symbol>()->value()));
+  }
+};
+
+// Gives the frame an EVAL invocation ends in back to the pool
+struct Frame_Guard {
+  EnvironmentP &env;
+  ~Frame_Guard() { Environment::release(env); }
+};
+
 ElementP EVAL(ElementP ast, EnvironmentP env) {
+  Frame_Guard guard{env};
+  Call_Frame frame;
+  Loop_Frame loop;
+  if (Runtime::stack_exhausted())
+    THROW("stack overflow: evaluation nested too deeply");
   while (true) {
     // EXCEPTION CHECK
     if (Runtime::raised and not Runtime::handled) {
       return nil();
     }
+    STAT_INC(eval_iterations);
+    // PROFILER
+    if (Profiler::tick.load(std::memory_order_relaxed))
+      Profiler::sample();
     // NOT A LIST
     if (ast->type != LIST) {
       return eval_ast(ast, env);
@@ -271,11 +913,13 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
           //***************************** let ******************************//
           if (is_special_form(ast_first, "let*")) {
             if (u_ast->at_least(3)) {
-              EnvironmentP new_env = environment(env)->to<Environment>();
+              EnvironmentP new_env = local_frame(env);
+              Pending_Guard pending(new_env.get(), u_ast->at(1));
               if (u_ast->check_nth(1, LIST)) {
                 ListP let_binds_l = u_ast->at(1)->to<List>();
                 if (let_binds_l->size() % 2 == 0) {
                   for (unsigned int i = 0; i < let_binds_l->size(); i += 2) {
+                    pending.at(i);
                     if (let_binds_l->check_nth(i, SYMBOL)) {
                       new_env->set(let_binds_l->at(i)->to<Symbol>()->value(),
                                    EVAL(let_binds_l->at(i + 1), new_env));
@@ -290,6 +934,7 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
                 VecP let_binds_v = u_ast->at(1)->to<Vec>();
                 if (let_binds_v->size() % 2 == 0) {
                   for (unsigned int i = 0; i < let_binds_v->size(); i += 2) {
+                    pending.at(i);
                     if (let_binds_v->check_nth(i, SYMBOL)) {
                       new_env->set(let_binds_v->at(i)->to<Symbol>()->value(),
                                    EVAL(let_binds_v->at(i + 1), new_env));
@@ -310,6 +955,73 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
               THROW("let*: needed at least 3 arguments");
             }
           }
+          //***************************** loop *****************************//
+          else if (is_special_form(ast_first, "loop")) {
+            if (u_ast->at_least(3) and (u_ast->check_nth(1, LIST) or
+                                        u_ast->check_nth(1, VEC))) {
+              ListP binds = u_ast->at(1)->type == VEC
+                                ? u_ast->at(1)->to<Vec>()->listed()
+                                : u_ast->at(1)->to<List>();
+              if (binds->size() % 2 != 0)
+                THROW("loop: key-value binds not in pairs");
+              for (unsigned int i = 0; i < binds->size(); i += 2)
+                if (not binds->check_nth(i, SYMBOL))
+                  THROW("loop: a key was not a symbol");
+              if (not is_tail_checked(u_ast)) {
+                if (not recur_in_tail(u_ast->at(2), env, true)) {
+                  if (CHECK_EXC)
+                    return nil();
+                  THROW("loop: recur is not in tail position");
+                }
+                set_tail_checked(u_ast);
+              }
+              loop.outer = env;
+              loop.binds = binds;
+              loop.body = u_ast->at(2);
+              loop.bind(local_frame(env));
+              Pending_Guard pending(loop.env.get(), binds);
+              for (unsigned int i = 0; i < loop.slots.size(); i++) {
+                pending.at(2 * i);
+                *loop.slots[i] = EVAL(binds->at(2 * i + 1), loop.env);
+              }
+              env = loop.env;
+              ast = loop.body;
+              continue;
+            } else {
+              THROW("loop: requires a binding list or vec and a body");
+            }
+          }
+          //**************************** recur *****************************//
+          else if (is_special_form(ast_first, "recur")) {
+            if (not loop.env)
+              THROW("recur: used outside of a loop");
+            if (u_ast->size() - 1 != loop.slots.size())
+              THROW("recur: expected " + std::to_string(loop.slots.size()) +
+                    " arguments, got " + std::to_string(u_ast->size() - 1));
+            loop.values.clear();
+            for (unsigned int i = 1; i < u_ast->size(); i++)
+              loop.values.push_back(EVAL(u_ast->at(i), env));
+            if (CHECK_EXC)
+              return nil();
+            env = loop.env;
+            // a closure kept the frame: the next pass gets its own
+            if (loop.env.use_count() > 2) {
+              loop.bind(local_frame(loop.outer));
+              env = loop.env;
+            }
+            for (unsigned int i = 0; i < loop.slots.size(); i++)
+              *loop.slots[i] = std::move(loop.values[i]);
+            ast = loop.body;
+            continue;
+          }
+          //*************************** lazy-seq ***************************//
+          else if (is_special_form(ast_first, "lazy-seq")) {
+            if (u_ast->size() == 2) {
+              ElementP body = u_ast->at(1);
+              return lazy_seq([body, env]() { return EVAL(body, env); });
+            } else
+              THROW("lazy-seq: requires one argument");
+          }
           //**************************** def! ******************************//
           else if (is_special_form(ast_first, "def!")) {
             if (u_ast->at_least(3) and u_ast->check_nth(1, SYMBOL)) {
@@ -317,6 +1029,9 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
               if (CHECK_EXC) {
                 return nil();
               } else {
+                if (ret->type == FUNCTION and ret->to<Function>()->name.empty())
+                  ret->to<Function>()->name =
+                      u_ast->at(1)->to<Symbol>()->value();
                 env->set(u_ast->at(1)->to<Symbol>()->value(), ret);
                 return ret;
               }
@@ -354,38 +1069,15 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
           }
           //***************************** fn* ******************************//
           else if (is_special_form(ast_first, "fn*")) {
-            if (u_ast->size() >= 3) {
-              if (u_ast->at(1)->type == LIST or u_ast->at(1)->type == VEC) {
-                bool args_all_symbols = true;
-                bool last_is_variadic = false;
-                ListP args = list();
-                ListP u_args = u_ast->at(1)->type == VEC
-                                   ? u_ast->at(1)->to<Vec>()->listed()
-                                   : u_ast->at(1)->to<List>();
-                for (unsigned int i = 0; i < u_args->size(); i++) {
-                  if (u_args->at(i)->type == SYMBOL) {
-                    if (i == u_args->size() - 2 and
-                        u_args->at(i)->to<Symbol>()->value() == "&") {
-                      last_is_variadic = true;
-                      args->append(u_args->at(i + 1));
-                      break;
-                    } else
-                      args->append(u_args->at(i));
-                  } else {
-                    args_all_symbols = false;
-                    break;
-                  }
-                }
-                if (args_all_symbols) {
-                  return func(env, args, u_ast->at(2), last_is_variadic);
-                } else {
-                  THROW("fn*: binds element must all be symbols");
-                }
-              } else {
-                THROW("fn*: clojure arguments must be a list or a vec");
-              }
-            } else
-              THROW("fn*: require at least two parameters");
+            std::vector<Arity> arities;
+            if (not read_fn(u_ast, arities))
+              return nil();
+            Closure_InfoP info = closure_info(u_ast, arities, env);
+            FunctionP f = func(closure_env(*info, env), std::move(arities));
+            f->frame_escapes = info->frame_escapes;
+            f->site = get_span(ast);
+            f->info = std::move(info);
+            return f;
           }
           //***************************** quote ****************************//
           else if (is_special_form(ast_first, "quote")) {
@@ -426,18 +1118,18 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
               Runtime::handled = true;
               ElementP ret = EVAL(u_ast->at(1), env);
               if (Runtime::raised) {
-                EnvironmentP catch_env = environment(env);
+                EnvironmentP catch_env = local_frame(env);
                 catch_env->set(
                     u_ast->at(2)->to<List>()->at(1)->to<Symbol>()->value(),
                     Runtime::exc_value);
                 Runtime::raised = false;
                 Runtime::handled = false;
-                ast = EVAL(u_ast->at(2)->to<List>()->at(2), catch_env);
+                ast = u_ast->at(2)->to<List>()->at(2);
+                env = catch_env;
                 continue;
               } else {
                 Runtime::handled = false;
-                ast = ret;
-                continue;
+                return ret;
               }
             } else if (u_ast->size() == 2) {
               ast = u_ast->at(1);
@@ -454,6 +1146,8 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
               if (ret->type == FUNCTION) {
                 ElementP ret_as_m = copy(ret);
                 ret_as_m->to<Function>()->is_macro = true;
+                ret_as_m->to<Function>()->name =
+                    u_ast->at(1)->to<Symbol>()->value();
                 env->set(u_ast->at(1)->to<Symbol>()->value(), ret_as_m);
                 return ret;
               } else
@@ -463,19 +1157,44 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
           }
           // *********************** APPLY SECTION **************************//
           else {
-            ListP e_ast = eval_ast(ast, env)->to<List>();
-            ElementP e_f = e_ast->at(0);
+            // the arguments are only referenced by args, so natives that
+            // walk a lazy sequence can let go of its head
+            ElementP e_f = EVAL(u_ast->at(0), env);
             if (e_f->type == FUNCTION) {
-              FunctionP f = e_ast->at(0)->to<Function>();
+              FunctionP f = e_f->to<Function>();
               ListP args = list()->to<List>();
-              for (unsigned int i = 1; i < e_ast->size(); i++) {
-                args->append(e_ast->at(i));
+              args->reserve(u_ast->size() - 1);
+              for (unsigned int i = 1; i < u_ast->size(); i++) {
+                args->append(EVAL(u_ast->at(i), env));
               }
               if (f->is_native()) {
-                return f->apply(args);
+                STAT_INC(native_calls);
+                ElementP ret = f->apply(std::move(args));
+                if (not Runtime::tail.pending)
+                  return ret;
+                take_tail_call(ast, env, frame);
+                loop.env = nullptr;
+                continue;
               } else {
-                ast = f->get_exprs();
-                env = f->create_env(env, args);
+                STAT_INC(user_calls);
+                STAT_INC(tail_calls);
+                const Arity *arity = f->arity(args->size());
+                if (not arity)
+                  return nil();
+                ElementP ret;
+                if (Jit::enabled.load(std::memory_order_relaxed) and
+                    Jit::call(*f, *arity, args, ret))
+                  return ret;
+                if (Runtime::engine.load(std::memory_order_relaxed) ==
+                    Engine::CLOSURES)
+                  if (const Code *code = compiled(*f, *arity))
+                    return run(std::move(f), code, std::move(args));
+                loop.env = nullptr;
+                ast = arity->exprs;
+                EnvironmentP f_env = f->create_env(*arity, args);
+                Environment::release(env);
+                env = std::move(f_env);
+                frame.enter(std::move(f));
                 continue;
               }
             } else
@@ -488,16 +1207,48 @@ ElementP EVAL(ElementP ast, EnvironmentP env) {
 }
 
 std::string PRINT(ElementP res) {
+  // printing realizes lazy sequences, which may raise too
+  std::string printed = Runtime::raised ? "" : pr_str(res, true);
   if (Runtime::raised) {
     Runtime::raised = false;
     writeln("Exception: " + pr_str(Runtime::exc_value));
+    std::vector<std::string> trace = Runtime::stack_trace();
+    for (unsigned int i = 0; i < trace.size();) {
+      unsigned int repeated = 1;
+      while (i + repeated < trace.size() and trace[i + repeated] == trace[i])
+        repeated++;
+      writeln("  at " + trace[i] +
+              (repeated > 1 ? " (" + std::to_string(repeated) + " times)"
+                            : ""));
+      i += repeated;
+    }
     return pr_str(nil());
   } else
-    return pr_str(res, true);
+    return printed;
 }
 
 std::string Runtime::rep(std::string expr) {
-  return PRINT(EVAL(READ(expr), core_runtime));
+  evaluating++;
+  std::string ret = PRINT(EVAL(READ(expr), core_runtime));
+  evaluating--;
+  return ret;
+}
+
+Sandbox Runtime::fork() {
+  static std::mutex fork_mutex;
+  std::lock_guard<std::mutex> lock(fork_mutex);
+  if (evaluating > 0)
+    error("fork: called while the runtime is evaluating");
+  return Sandbox(copy(core_runtime)->to<Environment>());
+}
+
+Sandbox::Sandbox(EnvironmentP globals) : globals(std::move(globals)) {}
+
+std::string Sandbox::rep(std::string expr) {
+  EnvironmentP outer = std::exchange(Runtime::globals, globals);
+  std::string ret = PRINT(EVAL(READ(expr), globals));
+  Runtime::globals = std::move(outer);
+  return ret;
 }
 
 ElementP eval_ast(ElementP ast, EnvironmentP env) {
@@ -506,24 +1257,27 @@ ElementP eval_ast(ElementP ast, EnvironmentP env) {
     return env->get(ast->to<Symbol>()->value());
   }
   case LIST: {
-    ListP ret = list()->to<List>();
-    for (unsigned int i = 0; i < ast->to<List>()->size(); i++) {
-      ret->append(EVAL(ast->to<List>()->at(i), env));
+    ListP l = ast->to<List>(), ret = list();
+    ret->reserve(l->size());
+    for (unsigned int i = 0; i < l->size(); i++) {
+      ret->append(EVAL(l->at(i), env));
     }
     return ret;
   }
   case VEC: {
-    VecP ret = vec()->to<Vec>();
-    for (unsigned int i = 0; i < ast->to<List>()->size(); i++) {
-      ret->append(EVAL(ast->to<List>()->at(i), env));
+    VecP v = ast->to<Vec>(), ret = vec();
+    ret->reserve(v->size());
+    for (unsigned int i = 0; i < v->size(); i++) {
+      ret->append(EVAL(v->at(i), env));
     }
     return ret;
   }
   case DICT: {
-    DictP ret = dict()->to<Dict>();
-    ListP keys = ast->to<Dict>()->keys()->to<List>();
-    for (unsigned int i = 0; i < keys->size(); i++)
-      ret->append(keys->at(i), EVAL(ast->to<Dict>()->get(keys->at(i)), env));
+    DictP d = ast->to<Dict>(), ret = dict();
+    ret->reserve(d->size());
+    d->for_each([&ret, &env](ElementP key, ElementP value) {
+      ret->append(key, EVAL(value, env));
+    });
     return ret;
   }
   default:
@@ -1,7 +1,13 @@
 #pragma once
 #include "externals.hpp"
 #include "types.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <utility>
+#include <vector>
 
 namespace lmlisp {
 ElementP READ(std::string input);
@@ -11,8 +17,87 @@ std::string PRINT(ElementP input);
 
 ElementP apply(FunctionP f, ListP args,
                std::optional<EnvironmentP> env = std::nullopt);
+ElementP tail_call(FunctionP f, ListP args);
+ElementP tail_eval(ElementP ast, EnvironmentP env);
 ElementP cons(ElementP el, ElementP l);
 ElementP concat(std::vector<ElementP> args);
+ElementP quasiquote(ElementP ast);
+bool is_macro_call(ElementP ast, EnvironmentP env);
+// The macros an expansion applied, each with the name it was called by
+using Macro_Uses = std::vector<std::pair<std::string, FunctionP>>;
+ElementP macroexpand(ElementP ast, EnvironmentP env,
+                     Macro_Uses *uses = nullptr);
+
+// What the evaluator works out about a fn* form the first time it is
+// evaluated: the symbols its body uses without binding them, whether
+// closing over just their values is safe, and whether the frames of its
+// calls can outlive them
+struct Code;
+struct Jit_Code;
+struct Closure_Info {
+  std::vector<std::string> free;
+  bool flat = true; // false when the body defines names with def!
+  bool frame_escapes = false; // the body creates closures or lazy seqs
+  // The macros expanded to find the free names, as they were bound then;
+  // the form is analyzed again once one of them is rebound. Only the
+  // runtime's pure macros are expanded: a body calling any other one
+  // isn't flat.
+  Macro_Uses macros;
+
+  // The body of each arity as compiled by the closure engine on the first
+  // call, null for those it leaves to EVAL
+  mutable std::recursive_mutex code_mutex;
+  mutable std::vector<std::shared_ptr<const Code>> code;
+  mutable std::atomic<bool> compiled = false;
+
+  // Calls counted by the JIT, and the machine code of each arity once they
+  // pass its threshold, null for those it can't translate
+  mutable std::atomic<unsigned int> calls = 0;
+  mutable std::atomic<bool> jitted = false;
+  mutable std::vector<std::shared_ptr<const Jit_Code>> jit_code;
+};
+
+// Reads the arities of a fn* form; raises and returns false when it is
+// malformed
+bool read_fn(ListP form, std::vector<Arity> &arities);
+Closure_InfoP closure_info(ListP form, const std::vector<Arity> &arities,
+                           EnvironmentP env);
+// Sets value to the binding of name a closure made in env can keep: that
+// of the innermost local frame holding it, or null when the name is left
+// to the globals. False when a frame on the way may still bind it, by def!
+// or by a let* or loop evaluating its binds, so the closure has to keep
+// the frames themselves.
+bool closure_binding(const Environment *env, std::string_view name,
+                     ElementP &value);
+
+// A call left by a native function for the evaluator to complete in its
+// own loop, so natives in tail position (apply, eval) don't nest EVAL.
+struct Tail_Call {
+  bool pending = false;
+  ElementP ast;
+  EnvironmentP env;
+  FunctionP f; // frame to enter, null for a plain evaluation
+};
+
+// A global environment forked from the runtime's. Its definitions shadow
+// the runtime's without touching them and are freed with it.
+// It is NOT isolated from the runtime: values bound before the fork are
+// shared, not copied, so what reset!, swap!, conj! or sb-append! do to an
+// atom, transient or string builder reachable from the runtime's globals
+// is seen by the runtime and by every other sandbox.
+class Sandbox {
+public:
+  std::string rep(std::string input);
+
+private:
+  friend class Runtime;
+  Sandbox(EnvironmentP globals);
+  EnvironmentP globals;
+};
+
+// How user functions are run: by EVAL walking their forms, or by the code
+// the closure engine compiles them to
+enum class Engine { TREE, CLOSURES };
 
 class Runtime {
 public:
@@ -20,6 +105,10 @@ public:
   Runtime(const Runtime &&o) = delete;
 
   std::string rep(std::string input);
+  // O(1) once the runtime's definitions are frozen by a first fork. Aborts
+  // when called while rep is evaluating, as freezing moves the bindings the
+  // evaluation may hold; it must not run concurrently with rep either.
+  Sandbox fork();
 
   void repl();
   friend Runtime &init(std::string filename, std::vector<std::string> argv);
@@ -27,16 +116,51 @@ public:
   void quit();
 
   // EXCEPTIONS
-  static ElementP exc_value;
-  static bool raised;
-  static bool handled;
+  // Evaluation state is per thread, so parallel builtins can evaluate on
+  // worker threads.
+  static void raise(ElementP value);
+  static ElementP take_exception();
+  static std::vector<std::string> stack_trace();
+  static thread_local ElementP exc_value;
+  static thread_local bool raised;
+  static thread_local bool handled;
+
+  // CALL STACK
+  static std::string frame_label(const Function *f);
+  static bool stack_exhausted();
+  static thread_local std::vector<Function *> call_stack;
+  static thread_local Tail_Call tail;
+  // The limit of threads whose stack size can't be read; the others get
+  // one from their own stack
+  static std::size_t max_stack_bytes;
+
+  // The global environment of the sandbox being evaluated on this thread,
+  // where eval works; null for the runtime's own
+  static thread_local EnvironmentP globals;
+
+  static std::atomic<Engine> engine;
 
 private:
   Runtime(std::string filename, std::vector<std::string> argv);
   static Runtime *current;
+  static thread_local std::vector<FunctionP> exc_trace;
 
   // STATUS
   bool running;
+  std::atomic<unsigned int> evaluating = 0; // rep calls under way
   EnvironmentP core_runtime;
 };
+
+// A frame of the Lisp call stack. Each EVAL invocation owns at most one
+// frame: a tail call replaces it in place and it is dropped on return.
+class Call_Frame {
+public:
+  Call_Frame();
+  ~Call_Frame();
+  void enter(FunctionP f);
+
+private:
+  std::size_t depth;
+  FunctionP f;
+};
 } // namespace lmlisp
@@ -0,0 +1,65 @@
+#include "stats.hpp"
+#include <climits>
+
+namespace lmlisp {
+thread_local Runtime_Stats runtime_stats = {};
+
+#ifdef _LM_WITH_STATS
+// Counters past the largest number an integer build holds are reported as
+// that number, so long runs see them saturate rather than wrap negative
+static NumberP counter(unsigned long n) {
+#ifdef _LM_WITH_FLOAT
+  return num(float(n));
+#else
+  return num(n > INT_MAX ? INT_MAX : int(n));
+#endif
+}
+#endif
+
+DictP stats_dict() {
+  DictP ret = dict();
+#ifdef _LM_WITH_STATS
+  static const char *type_names[TYPES_COUNT] = {
+      "nil",     "symbol", "function", "environment", "keyword",
+      "boolean", "number", "string",   "list",        "vector",
+      "dict",    "atom",   "lazy-seq", "reduced",     "transient",
+      "array",   "table",  "string-builder", "exception"};
+  ret->append(kw("enabled"), boolean(true));
+  ret->append(kw("eval-iterations"), counter(runtime_stats.eval_iterations));
+  ret->append(kw("tail-calls"), counter(runtime_stats.tail_calls));
+  ret->append(kw("macro-expansions"), counter(runtime_stats.macro_expansions));
+  ret->append(kw("env-lookups"), counter(runtime_stats.env_lookups));
+  VecP depths = vec();
+  for (unsigned long n : runtime_stats.lookup_depth)
+    depths->append(counter(n));
+  ret->append(kw("lookup-depth"), depths);
+  DictP allocations = dict();
+  for (unsigned int i = 0; i < TYPES_COUNT; i++)
+    allocations->append(kw(type_names[i]),
+                        counter(runtime_stats.allocations[i]));
+  ret->append(kw("allocations"), allocations);
+  ret->append(kw("native-calls"), counter(runtime_stats.native_calls));
+  ret->append(kw("user-calls"), counter(runtime_stats.user_calls));
+  ret->append(kw("exceptions"), counter(runtime_stats.exceptions));
+#else
+  ret->append(kw("enabled"), boolean(false));
+#endif
+  return ret;
+}
+
+void reset_stats() { runtime_stats = {}; }
+
+void add_stats(Runtime_Stats &to, const Runtime_Stats &from) {
+  to.eval_iterations += from.eval_iterations;
+  to.tail_calls += from.tail_calls;
+  to.macro_expansions += from.macro_expansions;
+  to.env_lookups += from.env_lookups;
+  for (unsigned int i = 0; i < Runtime_Stats::LOOKUP_DEPTHS; i++)
+    to.lookup_depth[i] += from.lookup_depth[i];
+  for (unsigned int i = 0; i < TYPES_COUNT; i++)
+    to.allocations[i] += from.allocations[i];
+  to.native_calls += from.native_calls;
+  to.user_calls += from.user_calls;
+  to.exceptions += from.exceptions;
+}
+} // namespace lmlisp
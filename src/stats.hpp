@@ -0,0 +1,35 @@
+#pragma once
+#include "types.hpp"
+
+namespace lmlisp {
+// Evaluator counters. They are thread local, so counting is a plain
+// increment, and compile to nothing unless _LM_WITH_STATS is defined.
+// Thread_Pool adds what the tasks of a job counted to the thread that ran
+// the job.
+// stats_dict saturates them at the largest Number of integer builds.
+struct Runtime_Stats {
+  static constexpr unsigned int LOOKUP_DEPTHS = 9; // last bucket is 8+
+
+  unsigned long eval_iterations;
+  unsigned long tail_calls;
+  unsigned long macro_expansions;
+  unsigned long env_lookups;
+  unsigned long lookup_depth[LOOKUP_DEPTHS];
+  unsigned long allocations[TYPES_COUNT];
+  unsigned long native_calls;
+  unsigned long user_calls;
+  unsigned long exceptions;
+};
+
+extern thread_local Runtime_Stats runtime_stats;
+
+DictP stats_dict();
+void reset_stats();
+void add_stats(Runtime_Stats &to, const Runtime_Stats &from);
+} // namespace lmlisp
+
+#ifdef _LM_WITH_STATS
+#define STAT_INC(COUNTER) (++lmlisp::runtime_stats.COUNTER)
+#else
+#define STAT_INC(COUNTER) ((void)0)
+#endif
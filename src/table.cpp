@@ -0,0 +1,623 @@
+#include "table.hpp"
+#include "kernels.hpp"
+#include "macros.hpp"
+#include "runtime.hpp"
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+
+namespace lmlisp {
+using Number_Value = decltype(std::declval<Number>().value());
+
+//**************************************************************************
+//
+//                                COLUMNS
+//
+//**************************************************************************
+
+static bool column_name(ElementP el, std::string &out) {
+  if (el->type == KEYWORD)
+    out = el->to<Keyword>()->value();
+  else if (el->type == STRING)
+    out = el->to<String>()->value();
+  else
+    return false;
+  return true;
+}
+
+static ColumnP numeric_column(ArrayP numbers) {
+  std::shared_ptr<Column> ret = std::make_shared<Column>();
+  ret->kind = Column::NUMERIC;
+  ret->numbers = numbers;
+  return ret;
+}
+
+// A column of numbers, strings or keywords; null when the values are of
+// any other or of mixed types.
+static ColumnP build_column(const std::vector<ElementP> &values) {
+  TYPES type = values.empty() ? NUMBER : values[0]->type;
+  if (type == NUMBER) {
+    ArrayP numbers = array(std::is_floating_point_v<Number_Value>
+                               ? Array::DOUBLE
+                               : Array::LONG,
+                           values.size());
+    for (std::size_t i = 0; i < values.size(); i++) {
+      if (values[i]->type != NUMBER)
+        return nullptr;
+      if (numbers->kind == Array::DOUBLE)
+        numbers->doubles[i] = values[i]->to<Number>()->value();
+      else
+        numbers->longs[i] = values[i]->to<Number>()->value();
+    }
+    return numeric_column(numbers);
+  } else if (type != STRING and type != KEYWORD)
+    return nullptr;
+  std::shared_ptr<Column> ret = std::make_shared<Column>();
+  ret->kind = type == STRING ? Column::STRING : Column::KEYWORD;
+  ret->codes.reserve(values.size());
+  std::unordered_map<std::string_view, std::uint32_t> codes;
+  for (ElementP el : values) {
+    if (el->type != type)
+      return nullptr;
+    std::string_view value = type == STRING ? el->to<String>()->value()
+                                       : el->to<Keyword>()->value();
+    auto [it, added] = codes.try_emplace(value, ret->dictionary.size());
+    if (added)
+      ret->dictionary.emplace_back(value);
+    ret->codes.push_back(it->second);
+  }
+  return ret;
+}
+
+// The rows of c listed in rows, as a new column.
+static ColumnP gather(const Column &c,
+                      const std::vector<std::uint32_t> &rows) {
+  if (c.kind == Column::NUMERIC) {
+    ArrayP numbers = array(c.numbers->kind, rows.size());
+    for (std::size_t i = 0; i < rows.size(); i++) {
+      if (numbers->kind == Array::DOUBLE)
+        numbers->doubles[i] = c.numbers->doubles[rows[i]];
+      else
+        numbers->longs[i] = c.numbers->longs[rows[i]];
+    }
+    return numeric_column(numbers);
+  }
+  std::shared_ptr<Column> ret = std::make_shared<Column>();
+  ret->kind = c.kind;
+  ret->dictionary = c.dictionary;
+  ret->codes.resize(rows.size());
+  for (std::size_t i = 0; i < rows.size(); i++)
+    ret->codes[i] = c.codes[rows[i]];
+  return ret;
+}
+
+static bool passes(FunctionP pred, ElementP value) {
+  ListP args = list();
+  args->append(value);
+  ElementP ret = apply(pred, args);
+  return not(ret->type == NIL or
+             (ret->type == BOOLEAN and not ret->to<Boolean>()->value()));
+}
+
+//**************************************************************************
+//
+//                              CONVERSIONS
+//
+//**************************************************************************
+
+ElementP make_table(ElementP from) {
+  std::vector<std::pair<std::string, ColumnP>> columns;
+  if (from->type == DICT) {
+    bool valid = true;
+    from->to<Dict>()->for_each([&](ElementP key, ElementP values) {
+      ColumnP c;
+      if (values->type == ARRAY) {
+        c = numeric_column(values->to<Array>());
+      } else if (Lazy_SeqP s = as_lazy_seq(values)) {
+        std::vector<ElementP> items;
+        for (; s; s = s->chunk_more())
+          for (unsigned int i = 0; i < s->chunk_size(); i++)
+            items.push_back(s->chunk_at(i));
+        c = build_column(items);
+      }
+      std::string name;
+      column_name(key, name);
+      valid = valid and c;
+      columns.emplace_back(name, c);
+    });
+    if (Runtime::raised)
+      return nil();
+    if (not valid)
+      THROW("table: columns must be sequences of numbers, strings or "
+            "keywords");
+  } else {
+    Lazy_SeqP s = as_lazy_seq(from);
+    if (not s)
+      THROW("table: argument must be a dict of columns or a sequence of "
+            "row dicts");
+    std::vector<ElementP> keys;
+    std::vector<std::vector<ElementP>> values;
+    for (bool first = true; s; s = s->chunk_more()) {
+      for (unsigned int i = 0; i < s->chunk_size(); i++) {
+        if (s->chunk_at(i)->type != DICT)
+          THROW("table: rows must be dicts");
+        DictP row = s->chunk_at(i)->to<Dict>();
+        if (first) {
+          row->for_each(
+              [&keys](ElementP key, ElementP) { keys.push_back(key); });
+          values.resize(keys.size());
+          first = false;
+        }
+        if (row->size() != keys.size())
+          THROW("table: rows must have the same keys");
+        for (std::size_t k = 0; k < keys.size(); k++) {
+          ElementP value = row->get(keys[k]);
+          if (value->type == NIL)
+            THROW("table: rows must have the same keys");
+          values[k].push_back(value);
+        }
+      }
+    }
+    if (Runtime::raised)
+      return nil();
+    for (std::size_t k = 0; k < keys.size(); k++) {
+      std::string name;
+      column_name(keys[k], name);
+      ColumnP c = build_column(values[k]);
+      if (not c)
+        THROW("table: values of column " + name +
+              " must all be numbers, strings or keywords");
+      columns.emplace_back(name, c);
+    }
+  }
+  std::sort(columns.begin(), columns.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  TableP ret = table();
+  for (const auto &[name, c] : columns) {
+    if (c->size() != columns[0].second->size())
+      THROW("table: columns must have the same length");
+    ret->names.push_back(name);
+    ret->columns.push_back(c);
+  }
+  return ret->el();
+}
+
+ElementP table_column(TableP t, ElementP name) {
+  std::string n;
+  int index;
+  if (not column_name(name, n) or (index = t->find(n)) < 0)
+    THROW("column: no such column");
+  const Column &c = *t->columns[index];
+  if (c.kind == Column::NUMERIC)
+    return t->selection ? gather(c, *t->selection)->numbers->el()
+                        : c.numbers->el();
+  VecP ret = vec();
+  ret->reserve(t->rows());
+  for (std::size_t i = 0; i < t->rows(); i++)
+    ret->append(c.at(t->row(i)));
+  return ret->el();
+}
+
+ElementP table_rows(TableP t) {
+  VecP ret = vec();
+  ret->reserve(t->rows());
+  for (std::size_t i = 0; i < t->rows(); i++) {
+    DictP row = dict();
+    for (unsigned int c = 0; c < t->columns.size(); c++)
+      row->append(kw(t->names[c]), t->columns[c]->at(t->row(i)));
+    ret->append(row);
+  }
+  return ret->el();
+}
+
+//**************************************************************************
+//
+//                           SELECT AND WHERE
+//
+//**************************************************************************
+
+ElementP table_select(TableP t, ElementP names) {
+  Lazy_SeqP s = as_lazy_seq(names);
+  if (not s)
+    THROW("select: column names must be a sequence");
+  TableP ret = table();
+  ret->selection = t->selection;
+  for (; s; s = s->chunk_more()) {
+    for (unsigned int i = 0; i < s->chunk_size(); i++) {
+      std::string n;
+      int index;
+      if (not column_name(s->chunk_at(i), n) or (index = t->find(n)) < 0)
+        THROW("select: no such column");
+      ret->names.push_back(n);
+      ret->columns.push_back(t->columns[index]);
+    }
+  }
+  return ret->el();
+}
+
+enum Operator { LT, GT, LE, GE, EQ, NE, UNKNOWN };
+
+static Operator operator_of(std::string_view op) {
+  if (op == "<")
+    return LT;
+  else if (op == ">")
+    return GT;
+  else if (op == "<=")
+    return LE;
+  else if (op == ">=")
+    return GE;
+  else if (op == "=")
+    return EQ;
+  else if (op == "not=")
+    return NE;
+  return UNKNOWN;
+}
+
+static bool test(Operator op, int cmp) {
+  switch (op) {
+  case LT:
+    return cmp < 0;
+  case GT:
+    return cmp > 0;
+  case LE:
+    return cmp <= 0;
+  case GE:
+    return cmp >= 0;
+  case EQ:
+    return cmp == 0;
+  default:
+    return cmp != 0;
+  }
+}
+
+// <= and >= are the complements of the > and < kernels
+template <class T>
+static void numeric_mask(const std::vector<T> &a, Operator op, T x,
+                         std::vector<std::int64_t> &mask) {
+  switch (op) {
+  case LT:
+  case GE:
+    kernels::less(a.data(), x, mask.data(), a.size());
+    break;
+  case GT:
+  case LE:
+    kernels::greater(a.data(), x, mask.data(), a.size());
+    break;
+  default:
+    for (std::size_t i = 0; i < a.size(); i++)
+      mask[i] = (a[i] == x) == (op == EQ);
+    return;
+  }
+  if (op == GE or op == LE)
+    for (std::int64_t &m : mask)
+      m ^= 1;
+}
+
+ElementP table_where(TableP t, ElementP name, ElementP op, ElementP value) {
+  std::string n;
+  int index;
+  if (not column_name(name, n) or (index = t->find(n)) < 0)
+    THROW("where: no such column");
+  const Column &c = *t->columns[index];
+  std::vector<std::int64_t> mask(c.size()); // by column row
+  std::vector<std::int64_t> hits;           // by dictionary code
+  if (op->type == FUNCTION and c.kind == Column::NUMERIC) {
+    for (std::size_t i = 0; i < t->rows(); i++) {
+      std::size_t row = t->row(i);
+      mask[row] = passes(op->to<Function>(), c.at(row));
+      if (Runtime::raised)
+        return nil();
+    }
+  } else if (op->type == FUNCTION) {
+    // strings and keywords are tested once per distinct value
+    hits.resize(c.dictionary.size());
+    for (std::size_t code = 0; code < hits.size(); code++) {
+      hits[code] = passes(op->to<Function>(),
+                          c.kind == Column::STRING
+                              ? str(c.dictionary[code])->el()
+                              : kw(c.dictionary[code])->el());
+      if (Runtime::raised)
+        return nil();
+    }
+  } else if (op->type != KEYWORD or
+             operator_of(op->to<Keyword>()->value()) == UNKNOWN) {
+    THROW("where: operator must be one of :< :> :<= :>= := :not= or a "
+          "function");
+  } else if (c.kind == Column::NUMERIC) {
+    if (value->type != NUMBER)
+      THROW("where: " + n + " must be compared with a number");
+    Operator o = operator_of(op->to<Keyword>()->value());
+    Number_Value x = value->to<Number>()->value();
+    const Array &a = *c.numbers;
+    if (a.kind == Array::DOUBLE)
+      numeric_mask(a.doubles, o, double(x), mask);
+    else if (double(x) == double(std::int64_t(x)))
+      numeric_mask(a.longs, o, std::int64_t(x), mask);
+    else
+      numeric_mask(std::vector<double>(a.longs.begin(), a.longs.end()), o,
+                   double(x), mask);
+  } else {
+    if ((c.kind == Column::STRING and value->type != STRING) or
+        (c.kind == Column::KEYWORD and value->type != KEYWORD))
+      THROW("where: " + n + " must be compared with a value of its type");
+    Operator o = operator_of(op->to<Keyword>()->value());
+    std::string_view x = value->type == STRING
+                             ? value->to<String>()->value()
+                             : value->to<Keyword>()->value();
+    hits.resize(c.dictionary.size());
+    for (std::size_t code = 0; code < hits.size(); code++)
+      hits[code] = test(o, c.dictionary[code].compare(x));
+  }
+  if (c.kind != Column::NUMERIC)
+    for (std::size_t row = 0; row < mask.size(); row++)
+      mask[row] = hits[c.codes[row]];
+
+  std::shared_ptr<std::vector<std::uint32_t>> selection =
+      std::make_shared<std::vector<std::uint32_t>>();
+  for (std::size_t i = 0; i < t->rows(); i++)
+    if (mask[t->row(i)])
+      selection->push_back(t->row(i));
+  TableP ret = table();
+  ret->names = t->names;
+  ret->columns = t->columns;
+  ret->selection = selection;
+  return ret->el();
+}
+
+//**************************************************************************
+//
+//                                GROUP BY
+//
+//**************************************************************************
+
+enum Aggregate { SUM, COUNT, MEAN, MIN, MAX };
+
+template <class T> static constexpr Array::Kind kind_of() {
+  return std::is_same_v<T, double> ? Array::DOUBLE : Array::LONG;
+}
+
+template <class T> static std::vector<T> &values_of(Array &a) {
+  if constexpr (std::is_same_v<T, double>)
+    return a.doubles;
+  else
+    return a.longs;
+}
+
+// One value per group of the rows seen by t, group[i] being the group of
+// its i-th row.
+template <class T>
+static ArrayP aggregate(Aggregate op, const std::vector<T> &values,
+                        const Table &t,
+                        const std::vector<std::uint32_t> &group,
+                        std::uint32_t groups) {
+  if (op == MEAN) {
+    ArrayP ret = array(Array::DOUBLE, groups);
+    std::vector<std::size_t> counts(groups);
+    for (std::size_t i = 0; i < group.size(); i++) {
+      ret->doubles[group[i]] += values[t.row(i)];
+      counts[group[i]]++;
+    }
+    for (std::uint32_t g = 0; g < groups; g++)
+      ret->doubles[g] /= counts[g];
+    return ret;
+  }
+  ArrayP ret = array(kind_of<T>(), groups);
+  std::vector<T> &out = values_of<T>(*ret);
+  std::vector<bool> seen(groups);
+  for (std::size_t i = 0; i < group.size(); i++) {
+    T x = values[t.row(i)];
+    std::uint32_t g = group[i];
+    if (op == SUM)
+      out[g] += x;
+    else if (not seen[g] or (op == MIN ? x < out[g] : x > out[g]))
+      out[g] = x;
+    seen[g] = true;
+  }
+  return ret;
+}
+
+// Dense ids, in order of first appearance, for the key values of column c
+// in the rows seen by t.
+static std::vector<std::uint32_t> key_ids(const Table &t, const Column &c,
+                                          std::uint32_t &distinct) {
+  std::vector<std::uint32_t> ret(t.rows());
+  if (c.kind != Column::NUMERIC) {
+    distinct = c.dictionary.size();
+    for (std::size_t i = 0; i < ret.size(); i++)
+      ret[i] = c.codes[t.row(i)];
+    return ret;
+  }
+  std::unordered_map<double, std::uint32_t> ids;
+  for (std::size_t i = 0; i < ret.size(); i++)
+    ret[i] = ids.try_emplace(c.numbers->double_at(t.row(i)), ids.size())
+                 .first->second;
+  distinct = ids.size();
+  return ret;
+}
+
+ElementP table_group_by(TableP t, ElementP keys, DictP aggregates) {
+  std::vector<int> key_columns;
+  Lazy_SeqP s = keys->type == KEYWORD or keys->type == STRING
+                    ? nullptr
+                    : as_lazy_seq(keys);
+  std::vector<ElementP> key_names;
+  if (s) {
+    for (; s; s = s->chunk_more())
+      for (unsigned int i = 0; i < s->chunk_size(); i++)
+        key_names.push_back(s->chunk_at(i));
+  } else
+    key_names.push_back(keys);
+  for (ElementP key : key_names) {
+    std::string n;
+    int index;
+    if (not column_name(key, n) or (index = t->find(n)) < 0)
+      THROW("group-by: no such key column");
+    key_columns.push_back(index);
+  }
+  if (key_columns.empty())
+    THROW("group-by: pass at least one key column");
+
+  struct Output {
+    std::string name;
+    Aggregate op;
+    int column;
+  };
+  std::vector<Output> outputs;
+  bool valid = true;
+  aggregates->for_each([&](ElementP name, ElementP spec) {
+    std::string out_name, op, column;
+    column_name(name, out_name);
+    int index = -1;
+    if (spec->type != VEC or spec->to<Vec>()->size() < 1 or
+        spec->to<Vec>()->at(0)->type != KEYWORD) {
+      valid = false;
+      return;
+    }
+    op = spec->to<Vec>()->at(0)->to<Keyword>()->value();
+    if (spec->to<Vec>()->size() == 2 and
+        column_name(spec->to<Vec>()->at(1), column))
+      index = t->find(column);
+    Aggregate a = op == "sum"     ? SUM
+                  : op == "count" ? COUNT
+                  : op == "mean"  ? MEAN
+                  : op == "min"   ? MIN
+                                  : MAX;
+    if ((op != "sum" and op != "count" and op != "mean" and op != "min" and
+         op != "max") or
+        (a != COUNT and
+         (index < 0 or t->columns[index]->kind != Column::NUMERIC)))
+      valid = false;
+    outputs.push_back({out_name, a, index});
+  });
+  if (not valid)
+    THROW("group-by: aggregates are [:sum col], [:count], [:mean col], "
+          "[:min col] or [:max col] on numeric columns");
+  std::sort(outputs.begin(), outputs.end(),
+            [](const Output &a, const Output &b) { return a.name < b.name; });
+
+  // groups of the first key column, refined by each of the others
+  std::size_t n = t->rows();
+  std::vector<std::uint32_t> group(n, 0), first;
+  std::uint32_t groups = 1;
+  for (int index : key_columns) {
+    std::uint32_t distinct;
+    std::vector<std::uint32_t> ids = key_ids(*t, *t->columns[index], distinct);
+    std::vector<std::int64_t> dense;
+    std::unordered_map<std::uint64_t, std::uint32_t> sparse;
+    bool use_dense = std::uint64_t(groups) * distinct <= 4 * n + 1024;
+    if (use_dense)
+      dense.assign(std::size_t(groups) * distinct, -1);
+    std::uint32_t next = 0;
+    first.clear();
+    for (std::size_t i = 0; i < n; i++) {
+      std::uint64_t pair = std::uint64_t(group[i]) * distinct + ids[i];
+      std::int64_t g;
+      if (use_dense) {
+        g = dense[pair];
+        if (g < 0)
+          g = dense[pair] = next;
+      } else
+        g = sparse.try_emplace(pair, next).first->second;
+      if (std::uint32_t(g) == next) {
+        first.push_back(t->row(i));
+        next++;
+      }
+      group[i] = g;
+    }
+    groups = next;
+  }
+
+  TableP ret = table();
+  for (int index : key_columns) {
+    ret->names.push_back(t->names[index]);
+    ret->columns.push_back(gather(*t->columns[index], first));
+  }
+  for (const Output &out : outputs) {
+    ArrayP values;
+    if (out.op == COUNT) {
+      values = array(Array::LONG, groups);
+      for (std::uint32_t g : group)
+        values->longs[g]++;
+    } else {
+      const Array &a = *t->columns[out.column]->numbers;
+      values = a.kind == Array::DOUBLE
+                   ? aggregate(out.op, a.doubles, *t, group, groups)
+                   : aggregate(out.op, a.longs, *t, group, groups);
+    }
+    ret->names.push_back(out.name);
+    ret->columns.push_back(numeric_column(values));
+  }
+  return ret->el();
+}
+
+//**************************************************************************
+//
+//                                  JOIN
+//
+//**************************************************************************
+
+// Inner join: a row for each pair of rows with equal keys, in the order of
+// the left table, with the columns of the left table followed by those of
+// the right one it doesn't have.
+ElementP table_join(TableP left, TableP right, ElementP key) {
+  std::string n;
+  int l_index, r_index;
+  if (not column_name(key, n) or (l_index = left->find(n)) < 0 or
+      (r_index = right->find(n)) < 0)
+    THROW("join: both tables must have the key column");
+  const Column &l_key = *left->columns[l_index];
+  const Column &r_key = *right->columns[r_index];
+  if (l_key.kind != r_key.kind)
+    THROW("join: key columns must be of the same type");
+
+  std::vector<std::uint32_t> l_rows, r_rows;
+  auto emit = [&](std::uint32_t l, const std::vector<std::uint32_t> &rs) {
+    for (std::uint32_t r : rs) {
+      l_rows.push_back(l);
+      r_rows.push_back(r);
+    }
+  };
+  if (l_key.kind == Column::NUMERIC) {
+    std::unordered_map<double, std::vector<std::uint32_t>> index;
+    for (std::size_t i = 0; i < right->rows(); i++)
+      index[r_key.numbers->double_at(right->row(i))].push_back(right->row(i));
+    for (std::size_t i = 0; i < left->rows(); i++) {
+      auto it = index.find(l_key.numbers->double_at(left->row(i)));
+      if (it != index.end())
+        emit(left->row(i), it->second);
+    }
+  } else {
+    // right rows are bucketed by the left code of their key
+    std::unordered_map<std::string, std::uint32_t> l_codes;
+    for (std::size_t code = 0; code < l_key.dictionary.size(); code++)
+      l_codes.emplace(l_key.dictionary[code], code);
+    std::vector<std::int64_t> translate(r_key.dictionary.size(), -1);
+    for (std::size_t code = 0; code < translate.size(); code++) {
+      auto it = l_codes.find(r_key.dictionary[code]);
+      if (it != l_codes.end())
+        translate[code] = it->second;
+    }
+    std::vector<std::vector<std::uint32_t>> buckets(l_key.dictionary.size());
+    for (std::size_t i = 0; i < right->rows(); i++) {
+      std::int64_t code = translate[r_key.codes[right->row(i)]];
+      if (code >= 0)
+        buckets[code].push_back(right->row(i));
+    }
+    for (std::size_t i = 0; i < left->rows(); i++)
+      emit(left->row(i), buckets[l_key.codes[left->row(i)]]);
+  }
+
+  TableP ret = table();
+  for (unsigned int c = 0; c < left->columns.size(); c++) {
+    ret->names.push_back(left->names[c]);
+    ret->columns.push_back(gather(*left->columns[c], l_rows));
+  }
+  for (unsigned int c = 0; c < right->columns.size(); c++) {
+    if (left->find(right->names[c]) >= 0)
+      continue;
+    ret->names.push_back(right->names[c]);
+    ret->columns.push_back(gather(*right->columns[c], r_rows));
+  }
+  return ret->el();
+}
+} // namespace lmlisp
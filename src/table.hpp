@@ -0,0 +1,18 @@
+#pragma once
+#include "types.hpp"
+
+namespace lmlisp {
+// Builds a table from a dict of columns or a sequence of row dicts
+ElementP make_table(ElementP from);
+ElementP table_column(TableP t, ElementP name);
+ElementP table_rows(TableP t);
+ElementP table_select(TableP t, ElementP names);
+// Keeps the rows whose value in a column passes op (:< :> :<= :>= := or
+// :not= against value) or a predicate function
+ElementP table_where(TableP t, ElementP name, ElementP op, ElementP value);
+// Aggregates maps output column names to [:sum col], [:count], [:mean col],
+// [:min col] or [:max col]. Means are doubles, so integer builds read them
+// rounded to the nearest integer.
+ElementP table_group_by(TableP t, ElementP keys, DictP aggregates);
+ElementP table_join(TableP left, TableP right, ElementP key);
+} // namespace lmlisp
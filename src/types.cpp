@@ -1,15 +1,85 @@
 #include "types.hpp"
 #include "externals.hpp"
 #include "macros.hpp"
+#include "printer.hpp"
 #include "runtime.hpp"
+#include "stats.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <stdlib.h>
 
 namespace lmlisp {
+static std::shared_mutex files_mutex;
+static std::vector<std::string> source_files = {"<input>"};
+
+// Walks two sequences side by side, a chunk at a time.
+static bool seq_compare(ElementP a, ElementP b) {
+  Lazy_SeqP s_a = as_lazy_seq(a), s_b = as_lazy_seq(b);
+  unsigned int i_a = 0, i_b = 0;
+  while (true) {
+    while (s_a and i_a == s_a->chunk_size()) {
+      s_a = s_a->chunk_more();
+      i_a = 0;
+    }
+    while (s_b and i_b == s_b->chunk_size()) {
+      s_b = s_b->chunk_more();
+      i_b = 0;
+    }
+    if (not s_a or not s_b)
+      return not s_a and not s_b;
+    if (not s_a->chunk_at(i_a++)->compare(s_b->chunk_at(i_b++)))
+      return false;
+  }
+}
+
+// TEXT
+Text::Text(const char *text) : Text(std::string_view(text)) {}
+
+Text::Text(std::string_view text) : length(text.size()) {
+  if (length <= INLINE_SIZE)
+    std::memcpy(small, text.data(), length);
+  else
+    buffer = std::make_shared<const std::string>(text);
+}
+
+Text::Text(std::string text) : length(text.size()) {
+  if (length <= INLINE_SIZE)
+    std::memcpy(small, text.data(), length);
+  else
+    buffer = std::make_shared<const std::string>(std::move(text));
+}
+
+std::string_view Text::view() const {
+  return buffer ? std::string_view(buffer->data() + offset, length)
+                : std::string_view(small, length);
+}
+
+std::size_t Text::size() const { return length; }
+
+// Short substrings are copied, so they don't keep a large buffer alive
+Text Text::substr(std::size_t pos, std::size_t n) const {
+  std::string_view part = view().substr(pos, n);
+  if (part.size() <= INLINE_SIZE)
+    return Text(part);
+  Text ret = *this;
+  ret.offset = offset + pos;
+  ret.length = part.size();
+  return ret;
+}
 
 // ELEMENT
-Element::Element(TYPES type) { this->type = type; }
+Element::Element(TYPES type) {
+  this->type = type;
+  STAT_INC(allocations[type]);
+}
 ElementP Element::el() {
   return std::static_pointer_cast<Element>(shared_from_this());
 }
@@ -54,9 +124,10 @@ bool Element::compare(ElementP el) {
     case NUMBER:
       return this->to<Number>()->value() == el->to<Number>()->value();
     case STRING:
-      return this->to<String>()->value() == el->to<String>()->value();
+      return this->to<String>()->size() == el->to<String>()->size() and
+             this->to<String>()->value() == el->to<String>()->value();
     case KEYWORD:
-      return this->to<Keyword>()->value() == el->to<Keyword>()->value();
+      return this == el.get();
     case SYMBOL:
       return this->to<Symbol>()->value() == el->to<Symbol>()->value();
     case FUNCTION:
@@ -74,7 +145,18 @@ bool Element::compare(ElementP el) {
     case EXCEPTION:
       return this->to<Exception>()->value() == el->to<Exception>()->value();
     case ATOM:
+    case REDUCED:
+    case TRANSIENT:
+    case TABLE:
+    case STRING_BUILDER:
       return this->el() == el;
+    case ARRAY: {
+      ArrayP a = this->to<Array>(), b = el->to<Array>();
+      return a->kind == b->kind and a->doubles == b->doubles and
+             a->longs == b->longs;
+    }
+    case LAZY_SEQ:
+      return seq_compare(this->el(), el);
     }
   } else {
     if (this->type == LIST and el->type == VEC) {
@@ -99,6 +181,11 @@ bool Element::compare(ElementP el) {
             return false;
         return true;
       }
+    } else if ((this->type == LAZY_SEQ and
+                (el->type == LIST or el->type == VEC)) or
+               (el->type == LAZY_SEQ and
+                (this->type == LIST or this->type == VEC))) {
+      return seq_compare(this->el(), el);
     } else {
       return false;
     }
@@ -111,56 +198,87 @@ Nil::Nil() : Element(NIL) {}
 
 // FUNCTION
 Function::Function(std::function<ElementP(ListP)> f_native)
-    : Element(FUNCTION) {
+    : Element(FUNCTION), is_macro(false) {
   native = true;
   this->f_native = f_native;
-  meta = nil();
 }
 
-Function::Function(EnvironmentP outer, ListP binds, ElementP exprs,
-                   bool last_is_variadic)
-    : Element(FUNCTION), is_macro(false) {
+Function::Function(EnvironmentP outer, std::vector<Arity> arities)
+    : Element(FUNCTION), is_macro(false), arities(std::move(arities)) {
   native = false;
-  this->env = environment(outer);
-  this->exprs = exprs;
-  this->binds = binds;
-  this->last_is_variadic = last_is_variadic;
-  meta = nil();
+  this->env = outer;
+  for (unsigned int i = 0; i < this->arities.size(); i++) {
+    const Arity &a = this->arities[i];
+    if (a.last_is_variadic) {
+      variadic = i;
+      continue;
+    }
+    if (by_count.size() <= a.binds->size())
+      by_count.resize(a.binds->size() + 1, -1);
+    by_count[a.binds->size()] = i;
+  }
 }
 
 bool Function::is_native() const { return native; }
 
-EnvironmentP Function::create_env([[maybe_unused]] EnvironmentP outer,
-                                  ListP args) {
-  EnvironmentP apply_env = environment(env);
+// Shares the closure, body and metadata with the original
+FunctionP Function::clone() const {
+  return std::make_shared<Function>(*this);
+}
+
+const Arity *Function::find_arity(unsigned int n_args) const {
+  if (n_args < by_count.size() and by_count[n_args] >= 0)
+    return &arities[by_count[n_args]];
+  if (variadic >= 0 and n_args + 1 >= arities[variadic].binds->size())
+    return &arities[variadic];
+  return nullptr;
+}
+
+// Natives check their arguments themselves.
+bool Function::accepts(unsigned int n_args) const {
+  return native or find_arity(n_args);
+}
+
+const Arity *Function::arity(unsigned int n_args) {
+  const Arity *ret = find_arity(n_args);
+  if (not ret)
+    Runtime::raise(str("wrong number of arguments (" +
+                       std::to_string(n_args) + ") passed to " +
+                       Runtime::frame_label(this)));
+  return ret;
+}
+
+EnvironmentP Function::create_env(const Arity &arity, ListP args) {
+  const ListP &binds = arity.binds;
+  EnvironmentP apply_env = frame_escapes
+                               ? environment(env)
+                               : Environment::pooled_frame(env, binds);
+  apply_env->open = not info or not info->flat;
   if (binds->size() > 0) {
-    for (unsigned int i = 0; i < binds->size() - 1; i++) {
-      apply_env->set(binds->at(i)->to<Symbol>()->value(),
-                     args->to<List>()->at(i));
-    }
-    if (last_is_variadic) {
+    unsigned int last = binds->size() - 1;
+    for (unsigned int i = 0; i < last; i++)
+      apply_env->set(binds->at(i)->to<Symbol>()->value(), args->at(i));
+    if (arity.last_is_variadic) {
       ListP varargs = list();
-      for (unsigned int i = binds->size() - 1; i < args->to<List>()->size();
-           i++) {
-        varargs->append(args->to<List>()->at(i));
-      }
-      apply_env->set(binds->at(binds->size() - 1)->to<Symbol>()->value(),
-                     varargs);
+      for (unsigned int i = last; i < args->size(); i++)
+        varargs->append(args->at(i));
+      apply_env->set(binds->at(last)->to<Symbol>()->value(), varargs);
     } else {
-      apply_env->set(binds->at(binds->size() - 1)->to<Symbol>()->value(),
-                     args->to<List>()->at(binds->size() - 1));
+      apply_env->set(binds->at(last)->to<Symbol>()->value(), args->at(last));
     }
   }
   return apply_env;
 }
 
+const EnvironmentP &Function::closure() const { return env; }
+
+const std::vector<Arity> &Function::get_arities() const { return arities; }
+
 ElementP Function::apply(ListP args) {
   assert(is_native() && "PANIC: function is not native");
-  return f_native(args);
+  return f_native(std::move(args));
 }
 
-ElementP Function::get_exprs() { return exprs; }
-
 // ENVIRONMENT
 Environment::Environment(ElementP outer) : Element(ENVIRONMENT) {
   if (outer->type == NIL)
@@ -170,8 +288,69 @@ Environment::Environment(ElementP outer) : Element(ENVIRONMENT) {
   this->outer = outer->to<Environment>();
 }
 
-ElementP Environment::find(std::string key) {
-  if (env.contains(key))
+std::uint64_t Environment::version() const {
+  static std::atomic<std::uint64_t> versions = 0;
+  std::uint64_t ret = version_.value.load(std::memory_order_acquire);
+  if (ret == 0) {
+    std::uint64_t fresh = versions.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (version_.value.compare_exchange_strong(ret, fresh))
+      ret = fresh;
+  }
+  return ret;
+}
+
+void Environment::changed() {
+  version_.value.store(0, std::memory_order_release);
+}
+
+// One of 64 bits picked from the length and ends of key, which tell most
+// of the few names of a frame apart without hashing them
+std::uint64_t Environment::key_bit(std::string_view key) {
+  if (key.empty())
+    return 1;
+  return std::uint64_t(1) << ((key.size() * 31 + key.front() * 7 +
+                               key.back()) & 63);
+}
+
+const ElementP *Environment::lookup(std::string_view key) const {
+  auto it = env.find(key);
+  if (it != env.end())
+    return &it->second;
+  for (const Frozen_Bindings *layer = frozen.get(); layer;
+       layer = layer->below.get()) {
+    auto found = layer->env.find(key);
+    if (found != layer->env.end())
+      return &found->second;
+  }
+  return nullptr;
+}
+
+static constexpr unsigned int MAX_FROZEN_LAYERS = 4;
+
+// Moves the local bindings into a new frozen layer that copies can share.
+// Once there are MAX_FROZEN_LAYERS of them, the layers above the bottom
+// one, usually the runtime's own definitions, are merged into the new one
+// so lookups through copies of copies stay shallow.
+void Environment::freeze() {
+  if (env.empty())
+    return;
+  if (frozen and frozen->depth >= MAX_FROZEN_LAYERS) {
+    std::shared_ptr<const Frozen_Bindings> bottom = frozen;
+    for (; bottom->below; bottom = bottom->below)
+      for (const auto &[key, value] : bottom->env)
+        env.emplace(key, value); // keeps the bindings of upper layers
+    frozen = bottom;
+  }
+  unsigned int depth = frozen ? frozen->depth + 1 : 1;
+  frozen = std::make_shared<const Frozen_Bindings>(
+      Frozen_Bindings{std::move(env), frozen, depth});
+  env.clear();
+  key_bits = 0;
+  changed();
+}
+
+ElementP Environment::find(std::string_view key) {
+  if (lookup(key))
     return shared_from_this();
   else if (not is_nil(outer))
     return outer->find(key);
@@ -179,39 +358,166 @@ ElementP Environment::find(std::string key) {
     return nil();
 }
 
-ElementP Environment::get(std::string key) {
+ElementP Environment::get(std::string_view key) {
   if (key == "let*" or key == "if" or key == "def!" or key == "fn*" or
       key == "defmacro!" or key == "do" or key == "quote" or
       key == "quasiquoteexpand" or key == "quasiquote" or
-      key == "macroexpand" or key == "try*" or key == "catch*") {
+      key == "macroexpand" or key == "try*" or key == "catch*" or
+      key == "loop" or key == "recur" or key == "lazy-seq") {
     return nil();
   }
   ElementP found_env = find(key);
+  STAT_INC(env_lookups);
   if (not is_nil(found_env)) {
-    return found_env->to<Environment>()->env.at(key);
+#ifdef _LM_WITH_STATS
+    unsigned int depth = level - found_env->to<Environment>()->level;
+    if (depth >= Runtime_Stats::LOOKUP_DEPTHS)
+      depth = Runtime_Stats::LOOKUP_DEPTHS - 1;
+    runtime_stats.lookup_depth[depth]++;
+#endif
+    return *found_env->to<Environment>()->lookup(key);
   } else {
-    Runtime::raised = true;
-    Runtime::exc_value = str("'" + key + "' not found");
+    // appended rather than "'" + key, on which GCC 12 reports a false
+    // -Wrestrict in optimized builds (GCC bug 105329)
+    Runtime::raise(str(std::string("'").append(key) + "' not found"));
     return nil();
   }
 }
 
-void Environment::set(std::string key, ElementP value) {
-  env.insert_or_assign(key, value);
+static bool is_macro(const ElementP &el) {
+  return el and el->type == FUNCTION and
+         static_cast<const Function &>(*el).is_macro;
+}
+
+void Environment::set(std::string_view key, ElementP value) {
+  auto it = env.find(key);
+  if (it != env.end()) {
+    if (level == 0 and (is_macro(it->second) or is_macro(value)))
+      changed();
+    it->second = value;
+  } else {
+    // the new binding shadows any in the frozen layers
+    if (frozen or (level == 0 and is_macro(value)))
+      changed();
+    key_bits |= key_bit(key);
+    env.emplace(key, value);
+  }
+}
+
+// The value cell of key, created if missing; a frozen binding is first
+// copied into the local map. Cells stay where they are when other keys are
+// added, so callers may keep the reference.
+ElementP &Environment::slot(std::string_view key) {
+  auto it = env.find(key);
+  if (it != env.end())
+    return it->second;
+  const ElementP *shared = lookup(key);
+  if (frozen)
+    changed();
+  key_bits |= key_bit(key);
+  ElementP &cell = env[std::string(key)];
+  if (shared)
+    cell = *shared;
+  return cell;
 }
 
 int Environment::get_level() const { return level; }
 
+Environment *Environment::get_outer() const { return outer.get(); }
+
+static constexpr std::size_t FRAME_POOL_SIZE = 64;
+static thread_local std::vector<EnvironmentP> frame_pool;
+
+EnvironmentP Environment::pooled_frame(EnvironmentP outer,
+                                       const ListP &binds) {
+  if (frame_pool.empty()) {
+    EnvironmentP ret = environment(outer);
+    ret->pooled = true;
+    ret->shape = binds;
+    return ret;
+  }
+  EnvironmentP ret = std::move(frame_pool.back());
+  frame_pool.pop_back();
+  ret->level = outer->level + 1;
+  ret->outer = std::move(outer);
+  // a frame made for the same binds is refilled without allocating
+  if (ret->shape != binds) {
+    ret->env.clear();
+    ret->key_bits = 0;
+    ret->shape = binds;
+  }
+  return ret;
+}
+
+void Environment::release(EnvironmentP &env) {
+  while (env and env.use_count() == 1 and env->level > 0) {
+    if (env->pooled) {
+      if (frame_pool.size() < FRAME_POOL_SIZE) {
+        env->outer = nullptr;
+        for (auto &binding : env->env)
+          binding.second = nullptr;
+        frame_pool.push_back(std::move(env));
+      }
+      env = nullptr;
+      return;
+    }
+    // a let*, loop or catch frame: the frame it is nested in may be pooled
+    EnvironmentP outer = std::move(env->outer);
+    env = std::move(outer);
+  }
+  env = nullptr;
+}
+
+// The global environment at the bottom of the chain
+EnvironmentP Environment::root() {
+  return std::static_pointer_cast<Environment>(
+      global_env()->shared_from_this());
+}
+
+Environment *Environment::global_env() {
+  Environment *e = this;
+  while (e->level > 0)
+    e = e->outer.get();
+  return e;
+}
+
 // BOOLEAN
 Boolean::Boolean(bool logic_value)
     : Element(BOOLEAN), logic_value(logic_value) {}
 bool Boolean::value() const { return logic_value; }
 
 // LIST
-List::List() : Element(LIST) { meta = nil(); }
-void List::append(ElementP el) { elements.push_back(el); }
-ElementP List::at(unsigned int i) const { return elements[i]; }
-unsigned int List::size() const { return elements.size(); }
+List::List() : Element(LIST) {}
+void List::append(ElementP el) {
+  unshare();
+  elements.push_back(el);
+}
+ListP List::clone() const {
+  ListP ret = list();
+  ret->elements = items();
+  ret->meta = meta;
+  return ret;
+}
+ListP List::with_meta(ElementP meta) const {
+  ListP ret = list();
+  ret->shared = shared ? shared
+                       : std::shared_ptr<const std::vector<ElementP>>(
+                             shared_from_this(), &elements);
+  ret->meta = meta;
+  return ret;
+}
+void List::unshare() {
+  if (shared) {
+    elements = *shared;
+    shared = nullptr;
+  }
+}
+void List::reserve(unsigned int n) {
+  unshare();
+  elements.reserve(n);
+}
+ElementP List::at(unsigned int i) const { return items()[i]; }
+unsigned int List::size() const { return items().size(); }
 bool List::at_least(unsigned int n) const { return size() >= n; }
 bool List::check_nth(int n, TYPES t) const {
   if (at_least(n + 1) and at(n)->type == t)
@@ -221,10 +527,45 @@ bool List::check_nth(int n, TYPES t) const {
 }
 
 // VEC
-Vec::Vec() : Element(VEC) { meta = nil(); }
-void Vec::append(ElementP el) { elements.push_back(el); }
-ElementP Vec::at(unsigned int i) const { return elements[i]; }
-unsigned int Vec::size() const { return elements.size(); }
+Vec::Vec() : Element(VEC) {}
+void Vec::append(ElementP el) {
+  unshare();
+  elements.push_back(el);
+}
+void Vec::reserve(unsigned int n) {
+  unshare();
+  elements.reserve(n);
+}
+void Vec::set(unsigned int i, ElementP el) {
+  unshare();
+  elements[i] = el;
+}
+void Vec::pop() {
+  unshare();
+  elements.pop_back();
+}
+VecP Vec::clone() const {
+  VecP ret = vec();
+  ret->elements = items();
+  ret->meta = meta;
+  return ret;
+}
+VecP Vec::with_meta(ElementP meta) const {
+  VecP ret = vec();
+  ret->shared = shared ? shared
+                       : std::shared_ptr<const std::vector<ElementP>>(
+                             shared_from_this(), &elements);
+  ret->meta = meta;
+  return ret;
+}
+void Vec::unshare() {
+  if (shared) {
+    elements = *shared;
+    shared = nullptr;
+  }
+}
+ElementP Vec::at(unsigned int i) const { return items()[i]; }
+unsigned int Vec::size() const { return items().size(); }
 bool Vec::at_least(unsigned int n) const { return size() >= n; }
 bool Vec::check_nth(int n, TYPES t) const {
   if (at_least(n) and at(n)->type == t)
@@ -240,69 +581,103 @@ ListP Vec::listed() {
 }
 
 // DICT
-Dict::Dict() : Element(DICT) { meta = nil(); }
+// Keywords are mixed so a keyword and the string of its name don't collide
+std::size_t Key_Hash::operator()(const ElementP &key) const {
+  if (key->type == KEYWORD)
+    return static_cast<const Keyword &>(*key).hash() ^ 0x9e3779b97f4a7c15;
+  return std::hash<std::string_view>{}(
+      static_cast<const String &>(*key).value());
+}
+
+bool Key_Equal::operator()(const ElementP &a, const ElementP &b) const {
+  if (a->type != b->type)
+    return false;
+  if (a->type == KEYWORD)
+    return a == b;
+  return static_cast<const String &>(*a).value() ==
+         static_cast<const String &>(*b).value();
+}
+
+Dict::Dict() : Element(DICT) {}
+
+bool Dict::is_key(const ElementP &key) {
+  return key->type == STRING or key->type == KEYWORD;
+}
 
 void Dict::append(ElementP key, ElementP value) {
-  switch (key->type) {
-  case STRING:
-    elements.insert_or_assign(key->to<String>()->value(), value);
-    break;
-  case KEYWORD:
-    elements.insert_or_assign("\xff" + key->to<Keyword>()->value(), value);
-    break;
-  default:
+  if (not is_key(key))
     exit(1);
+  unshare();
+  elements.insert_or_assign(key, value);
+}
+
+void Dict::remove(ElementP key) {
+  if (is_key(key)) {
+    unshare();
+    elements.erase(key);
   }
 }
 
-ElementP Dict::get(ElementP key) {
-  std::string key_string;
-  switch (key->type) {
-  case STRING:
-    key_string = key->to<String>()->value();
-    break;
-  case KEYWORD:
-    key_string = "\xff" + key->to<Keyword>()->value();
-    break;
-  default:
-    return exc("not a valid key passed")->el();
+void Dict::reserve(unsigned int n) {
+  unshare();
+  elements.reserve(n);
+}
+
+unsigned int Dict::size() const { return items().size(); }
+
+DictP Dict::clone() const {
+  DictP ret = dict();
+  ret->elements = items();
+  ret->meta = meta;
+  return ret;
+}
+
+DictP Dict::with_meta(ElementP meta) const {
+  DictP ret = dict();
+  ret->shared = shared ? shared
+                       : std::shared_ptr<const Map>(shared_from_this(),
+                                                    &elements);
+  ret->meta = meta;
+  return ret;
+}
+
+void Dict::unshare() {
+  if (shared) {
+    elements = *shared;
+    shared = nullptr;
   }
+}
 
-  if (elements.contains(key_string))
-    return this->elements[key_string];
+ElementP Dict::get(ElementP key) {
+  if (not is_key(key))
+    return exc("not a valid key passed")->el();
+  auto it = items().find(key);
+  if (it != items().end())
+    return it->second;
   else
     return nil();
 }
 
 ElementP Dict::contains(ElementP key) {
-  std::string key_string;
-  switch (key->type) {
-  case STRING:
-    key_string = key->to<String>()->value();
-    break;
-  case KEYWORD:
-    key_string = "\xff" + key->to<Keyword>()->value();
-    break;
-  default:
+  if (not is_key(key))
     return exc("not a valid key passed")->el();
-  }
+  return boolean(items().contains(key));
+}
 
-  return boolean(elements.contains(key_string));
+void Dict::for_each(const std::function<void(ElementP, ElementP)> &f) const {
+  for (const auto &[key, value] : items())
+    f(key, value);
 }
 
 ListP Dict::keys() const {
+  std::vector<ElementP> keys;
+  keys.reserve(items().size());
+  for (const auto &[key, value] : items())
+    keys.push_back(key);
   ListP ret = list();
-  std::vector<std::string> keys_strings;
-  for (std::pair<std::string, ElementP> el : elements) {
-    keys_strings.push_back(el.first);
-  }
-  for (int i = keys_strings.size() - 1; i >= 0; i--) {
-    if (keys_strings[i].starts_with("\xff")) {
-      ret->append(kw(keys_strings[i].substr(1)));
-    } else {
-      ret->append(str(keys_strings[i]));
-    }
-  }
+  ret->reserve(keys.size());
+  for (auto it = keys.rbegin(); it != keys.rend(); it++)
+    ret->append(*it);
   return ret;
 }
 
@@ -316,154 +691,532 @@ int Number::value() const { return data; }
 #endif
 
 // SYMBOL
-Symbol::Symbol(std::string symbol) : Element(SYMBOL) { this->data = symbol; }
-std::string Symbol::value() const { return data; }
+Symbol::Symbol(Text symbol) : Element(SYMBOL), data(std::move(symbol)) {}
+std::string_view Symbol::value() const { return data.view(); }
 
 // KEYWORD
-Keyword::Keyword(std::string keyword) : Element(KEYWORD) {
-  this->data = keyword;
-}
-std::string Keyword::value() const { return data; }
+Keyword::Keyword(Text keyword)
+    : Element(KEYWORD), data(std::move(keyword)),
+      name_hash(std::hash<std::string_view>{}(data.view())) {}
+std::string_view Keyword::value() const { return data.view(); }
+std::size_t Keyword::hash() const { return name_hash; }
 
 // STRING
-String::String(std::string string) : Element(STRING) { this->data = string; }
-std::string String::value() const { return data; }
+static std::mutex ropes_mutex;
+
+String::String(Text string)
+    : Element(STRING), data(std::move(string)), flat(true),
+      length(data.size()) {}
+
+String::String(StringP left, StringP right)
+    : Element(STRING), rope(new Rope{left, right}), flat(false),
+      length(left->size() + right->size()) {}
+
+// Unlinks long ropes a node at a time rather than recursively
+String::~String() {
+  if (not rope or not rope->left)
+    return;
+  std::vector<StringP> pending = {std::move(rope->left),
+                                  std::move(rope->right)};
+  while (not pending.empty()) {
+    StringP s = std::move(pending.back());
+    pending.pop_back();
+    if (s.use_count() == 1 and s->rope) {
+      pending.push_back(std::move(s->rope->left));
+      pending.push_back(std::move(s->rope->right));
+    }
+  }
+}
+
+void String::flatten() const {
+  std::lock_guard<std::mutex> lock(ropes_mutex);
+  if (flat.load(std::memory_order_relaxed))
+    return;
+  std::string out;
+  out.reserve(length);
+  std::vector<const String *> stack = {this};
+  while (not stack.empty()) {
+    const String *s = stack.back();
+    stack.pop_back();
+    if (s->flat.load(std::memory_order_relaxed)) {
+      out += s->data.view();
+    } else {
+      stack.push_back(s->rope->right.get());
+      stack.push_back(s->rope->left.get());
+    }
+  }
+  data = Text(std::move(out));
+  rope.reset();
+  flat.store(true, std::memory_order_release);
+}
+
+std::string_view String::value() const {
+  if (not flat.load(std::memory_order_acquire))
+    flatten();
+  return data.view();
+}
+
+const Text &String::text() const {
+  if (not flat.load(std::memory_order_acquire))
+    flatten();
+  return data;
+}
+
+std::size_t String::size() const { return length; }
 
 // ATOM
 
 Atom::Atom(ElementP ref) : Element(ATOM) { this->ref = ref; }
 
+// REDUCED
+
+Reduced::Reduced(ElementP ref) : Element(REDUCED) { this->ref = ref; }
+
+// TRANSIENT
+
+Transient::Transient(ElementP coll) : Element(TRANSIENT) {
+  this->coll = coll;
+  owner = std::this_thread::get_id();
+}
+
+// STRING BUILDER
+
+String_Builder::String_Builder() : Element(STRING_BUILDER) {
+  owner = std::this_thread::get_id();
+}
+
+// ARRAY
+
+Array::Array(Kind kind, std::size_t size) : Element(ARRAY), kind(kind) {
+  if (kind == DOUBLE)
+    doubles.resize(size);
+  else
+    longs.resize(size);
+}
+
+std::size_t Array::size() const {
+  return kind == DOUBLE ? doubles.size() : longs.size();
+}
+
+double Array::double_at(std::size_t i) const {
+  return kind == DOUBLE ? doubles[i] : longs[i];
+}
+
+ElementP Array::at(std::size_t i) const {
+  if (kind == DOUBLE)
+    return num_checked(doubles[i]);
+  return num_checked(longs[i]);
+}
+
+// TABLE
+
+std::size_t Column::size() const {
+  return kind == NUMERIC ? numbers->size() : codes.size();
+}
+
+ElementP Column::at(std::size_t row) const {
+  switch (kind) {
+  case NUMERIC:
+    return numbers->at(row);
+  case STRING:
+    return str(dictionary[codes[row]]);
+  default:
+    return kw(dictionary[codes[row]]);
+  }
+}
+
+Table::Table() : Element(TABLE) {}
+
+std::size_t Table::rows() const {
+  if (selection)
+    return selection->size();
+  return columns.empty() ? 0 : columns[0]->size();
+}
+
+std::size_t Table::row(std::size_t i) const {
+  return selection ? (*selection)[i] : i;
+}
+
+int Table::find(const std::string &name) const {
+  for (unsigned int i = 0; i < names.size(); i++)
+    if (names[i] == name)
+      return i;
+  return -1;
+}
+
 // EXCEPTION
 
 Exception::Exception(std::string msg) : Element(EXCEPTION) { this->msg = msg; }
 std::string Exception::value() const { return msg; }
 
+// LAZY SEQUENCE
+Lazy_Seq::Lazy_Seq(std::function<ElementP()> body)
+    : Element(LAZY_SEQ), body(std::move(body)), realized(false), start(0),
+      end(0) {}
+
+Lazy_Seq::Lazy_Seq(ElementP chunk, unsigned int start, unsigned int end,
+                   Lazy_SeqP more)
+    : Element(LAZY_SEQ), realized(true), chunk(std::move(chunk)),
+      start(start), end(end), more(std::move(more)) {
+  // an empty chunk stands for whatever follows it
+  if (start >= end) {
+    this->chunk = nullptr;
+    realized = false;
+    body = [next = std::move(this->more)]() -> ElementP {
+      if (next)
+        return next;
+      return nil();
+    };
+  }
+}
+
+// Long realized chains are released iteratively, a recursive release
+// would run out of stack.
+Lazy_Seq::~Lazy_Seq() {
+  Lazy_SeqP next = std::move(more);
+  while (next and next.use_count() == 1)
+    next = std::move(next->more);
+}
+
+// A body that raises leaves the sequence unrealized: forcing it again runs
+// the body again, which raises again.
+void Lazy_Seq::realize() {
+  if (realized)
+    return;
+  realized = true;
+  ElementP s = body();
+  if (s->type == LAZY_SEQ and not Runtime::raised)
+    s->to<Lazy_Seq>()->realize();
+  if (not Runtime::raised and s->type != NIL and s->type != LIST and
+      s->type != VEC and s->type != LAZY_SEQ)
+    Runtime::raise(str("lazy-seq: body must return a sequence or nil"));
+  if (Runtime::raised) {
+    realized = false;
+    return;
+  }
+  body = nullptr;
+  if (s->type == LAZY_SEQ) {
+    Lazy_SeqP l = s->to<Lazy_Seq>();
+    chunk = l->chunk;
+    start = l->start;
+    end = l->end;
+    more = l->more;
+  } else if (s->type == LIST and s->to<List>()->size() > 0) {
+    chunk = s;
+    end = s->to<List>()->size();
+  } else if (s->type == VEC and s->to<Vec>()->size() > 0) {
+    chunk = s;
+    end = s->to<Vec>()->size();
+  }
+}
+
+bool Lazy_Seq::empty() { return chunk_size() == 0; }
+
+ElementP Lazy_Seq::first() { return empty() ? nil() : chunk_at(0); }
+
+ElementP Lazy_Seq::rest() {
+  if (empty())
+    return list();
+  if (start + 1 < end)
+    return lazy_seq(chunk, start + 1, end, more);
+  if (more)
+    return more;
+  return list();
+}
+
+unsigned int Lazy_Seq::chunk_size() {
+  realize();
+  return end - start;
+}
+
+ElementP Lazy_Seq::chunk_at(unsigned int i) {
+  if (chunk->type == LIST)
+    return static_cast<List *>(chunk.get())->at(start + i);
+  else
+    return static_cast<Vec *>(chunk.get())->at(start + i);
+}
+
+Lazy_SeqP Lazy_Seq::chunk_more() {
+  realize();
+  return more;
+}
+
+// The values from..to of the current chunk, followed by more.
+Lazy_SeqP Lazy_Seq::slice(unsigned int from, unsigned int to,
+                          Lazy_SeqP more) {
+  realize();
+  return lazy_seq(chunk, start + from, start + to, std::move(more));
+}
+
 // POINTER CONSTRUCTORS
-ElementP nil() { return std::make_shared<Nil>(); }
+// Nil, booleans and small integers are immutable and carry no meta, so
+// every evaluation shares the same few instances of them
+ElementP nil() {
+  static const ElementP shared = std::make_shared<Nil>();
+  return shared;
+}
 ListP list() { return std::make_shared<List>(); }
 VecP vec() { return std::make_shared<Vec>(); }
 DictP dict() { return std::make_shared<Dict>(); }
-BooleanP boolean(bool value) { return std::make_shared<Boolean>(value); }
+BooleanP boolean(bool value) {
+  static const BooleanP shared[2] = {std::make_shared<Boolean>(false),
+                                     std::make_shared<Boolean>(true)};
+  return shared[value];
+}
+#ifdef _LM_WITH_FLOAT
 NumberP num(float number) { return std::make_shared<Number>(number); }
-SymbolP sym(std::string symbol) { return std::make_shared<Symbol>(symbol); }
-KeywordP kw(std::string keyword) { return std::make_shared<Keyword>(keyword); }
-StringP str(std::string string) { return std::make_shared<String>(string); }
+bool fits_number(double x) {
+  return not std::isfinite(x) or std::fabs(x) <= FLT_MAX;
+}
+bool fits_number(std::int64_t) { return true; }
+#else
+NumberP num(int number) {
+  static constexpr int LOW = -128, HIGH = 1024;
+  static const std::vector<NumberP> small = [] {
+    std::vector<NumberP> ret;
+    for (int i = LOW; i < HIGH; i++)
+      ret.push_back(std::make_shared<Number>(i));
+    return ret;
+  }();
+  if (number >= LOW and number < HIGH)
+    return small[number - LOW];
+  return std::make_shared<Number>(number);
+}
+bool fits_number(double x) {
+  return x == std::trunc(x) and x >= INT_MIN and x <= INT_MAX;
+}
+bool fits_number(std::int64_t x) { return x >= INT_MIN and x <= INT_MAX; }
+#endif
+ElementP num_checked(double x) {
+#ifndef _LM_WITH_FLOAT
+  x = std::round(x);
+#endif
+  if (fits_number(x))
+    return num(x);
+  char text[32];
+  *std::to_chars(text, text + sizeof(text) - 1, x).ptr = 0;
+  Runtime::raise(str((std::isnan(x) ? "not a number: "
+                                    : "number out of range: ") +
+                     std::string(text)));
+  return nil();
+}
+ElementP num_checked(std::int64_t x) {
+  if (fits_number(x))
+    return num(x);
+  Runtime::raise(str("number out of range: " + std::to_string(x)));
+  return nil();
+}
+SymbolP sym(Text symbol) { return std::make_shared<Symbol>(std::move(symbol)); }
+// Keywords live as long as the program, so the table can be keyed by views
+// of their own names
+KeywordP kw(Text keyword) {
+  static std::shared_mutex mutex;
+  static std::unordered_map<std::string_view, KeywordP> interned;
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = interned.find(keyword.view());
+    if (it != interned.end())
+      return it->second;
+  }
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  auto it = interned.find(keyword.view());
+  if (it != interned.end())
+    return it->second;
+  KeywordP ret = std::make_shared<Keyword>(std::move(keyword));
+  interned.emplace(ret->value(), ret);
+  return ret;
+}
+StringP str(Text string) { return std::make_shared<String>(std::move(string)); }
+StringP str_concat(StringP left, StringP right) {
+  return std::make_shared<String>(left, right);
+}
 FunctionP func(std::function<ElementP(ListP)> f) {
   return std::make_shared<Function>(f);
 }
 FunctionP func(EnvironmentP outer, ListP binds, ElementP exprs,
                bool last_is_variadic) {
-  return std::make_shared<Function>(outer, binds, exprs, last_is_variadic);
+  return func(outer, {Arity{binds, exprs, last_is_variadic}});
+}
+FunctionP func(EnvironmentP outer, std::vector<Arity> arities) {
+  return std::make_shared<Function>(outer, std::move(arities));
 }
 EnvironmentP environment(EnvironmentP outer) {
   return std::make_shared<Environment>(outer);
 }
 AtomP atom(ElementP ref) { return std::make_shared<Atom>(ref); }
+ReducedP reduced(ElementP ref) { return std::make_shared<Reduced>(ref); }
+TransientP transient(ElementP coll) {
+  return std::make_shared<Transient>(coll);
+}
+ArrayP array(Array::Kind kind, std::size_t size) {
+  return std::make_shared<Array>(kind, size);
+}
+TableP table() { return std::make_shared<Table>(); }
+String_BuilderP string_builder() { return std::make_shared<String_Builder>(); }
 ExceptionP exc(std::string msg) { return std::make_shared<Exception>(msg); }
+Lazy_SeqP lazy_seq(std::function<ElementP()> body) {
+  return std::make_shared<Lazy_Seq>(std::move(body));
+}
+Lazy_SeqP lazy_seq(ElementP chunk, unsigned int start, unsigned int end,
+                   Lazy_SeqP more) {
+  return std::make_shared<Lazy_Seq>(std::move(chunk), start, end,
+                                    std::move(more));
+}
+
+// A lazy view of a sequential collection, sharing its values. Null if coll
+// is not a sequence.
+// An array seen as a sequence is turned into numbers a chunk at a time.
+static Lazy_SeqP array_seq(ArrayP a, std::size_t from) {
+  return lazy_seq([a, from]() -> ElementP {
+    std::size_t to = std::min(a->size(), from + 32);
+    if (from >= to)
+      return nil();
+    VecP chunk = vec();
+    chunk->reserve(to - from);
+    for (std::size_t i = from; i < to; i++) {
+      chunk->append(a->at(i));
+      if (Runtime::raised)
+        return nil();
+    }
+    return lazy_seq(chunk, 0, to - from,
+                    to < a->size() ? array_seq(a, to) : nullptr);
+  });
+}
+
+Lazy_SeqP as_lazy_seq(ElementP coll) {
+  switch (coll->type) {
+  case ARRAY:
+    return array_seq(coll->to<Array>(), 0);
+  case LAZY_SEQ:
+    return coll->to<Lazy_Seq>();
+  case LIST:
+    return lazy_seq(coll, 0, coll->to<List>()->size(), nullptr);
+  case VEC:
+    return lazy_seq(coll, 0, coll->to<Vec>()->size(), nullptr);
+  case NIL:
+    return lazy_seq(nullptr, 0, 0, nullptr);
+  default:
+    return nullptr;
+  }
+}
 
 // UTILITY FUNCTIONS
 
 inline bool is_nil(ElementP el) { return el->type == NIL; }
 
+// Position of each kind of value in the ordering, -1 when it has none.
+static int order_rank(TYPES type) {
+  switch (type) {
+  case NIL:
+    return 0;
+  case BOOLEAN:
+    return 1;
+  case NUMBER:
+    return 2;
+  case STRING:
+    return 3;
+  case KEYWORD:
+    return 4;
+  case SYMBOL:
+    return 5;
+  case LIST:
+  case VEC:
+  case LAZY_SEQ:
+    return 6;
+  default:
+    return -1;
+  }
+}
+
+static int seq_order(ElementP a, ElementP b) {
+  Lazy_SeqP s_a = as_lazy_seq(a), s_b = as_lazy_seq(b);
+  unsigned int i_a = 0, i_b = 0;
+  while (true) {
+    while (s_a and i_a == s_a->chunk_size()) {
+      s_a = s_a->chunk_more();
+      i_a = 0;
+    }
+    while (s_b and i_b == s_b->chunk_size()) {
+      s_b = s_b->chunk_more();
+      i_b = 0;
+    }
+    if (not s_a or not s_b)
+      return (s_a ? 1 : 0) - (s_b ? 1 : 0);
+    int ret = order(s_a->chunk_at(i_a++), s_b->chunk_at(i_b++));
+    if (ret != 0)
+      return ret;
+  }
+}
+
+template <class T> static int three_way(const T &a, const T &b) {
+  return a < b ? -1 : (b < a ? 1 : 0);
+}
+
+// Total ordering: nil, booleans, numbers, strings, keywords, symbols and
+// sequences, which compare element by element. Other values raise.
+int order(ElementP a, ElementP b) {
+  int rank_a = order_rank(a->type), rank_b = order_rank(b->type);
+  if (rank_a < 0 or rank_b < 0) {
+    Runtime::raise(str("compare: can't order " + pr_str(rank_a < 0 ? a : b)));
+    return 0;
+  } else if (rank_a != rank_b)
+    return rank_a - rank_b;
+  switch (a->type) {
+  case BOOLEAN:
+    return three_way(a->to<Boolean>()->value(), b->to<Boolean>()->value());
+  case NUMBER:
+    return three_way(a->to<Number>()->value(), b->to<Number>()->value());
+  case STRING:
+    return three_way(a->to<String>()->value(), b->to<String>()->value());
+  case KEYWORD:
+    return three_way(a->to<Keyword>()->value(), b->to<Keyword>()->value());
+  case SYMBOL:
+    return three_way(a->to<Symbol>()->value(), b->to<Symbol>()->value());
+  case LIST:
+  case VEC:
+  case LAZY_SEQ:
+    return seq_order(a, b);
+  default:
+    return 0;
+  }
+}
+
 ElementP copy(ElementP el) {
-  ElementP ret;
   switch (el->type) {
-  case NIL: {
-    ret = nil();
-  } break;
   case ENVIRONMENT: {
     EnvironmentP e_orig = el->to<Environment>();
-    ret->to<Environment>()->outer = environment(e_orig->outer);
-    ret->to<Environment>()->level = e_orig->level;
-    ret->to<Environment>()->exprs = list();
-    for (unsigned int i=0; i < e_orig->exprs->size(); ++i){
-      ret->to<Environment>()->exprs->append(copy(e_orig->exprs->at(i)));
-    }
-    for (const auto& [key, value] : e_orig->env) {
-      ret->to<Environment>()->env.insert({key, copy(value)});
-    }
-  } break;
-  case FUNCTION: {
-    FunctionP f_orig = el->to<Function>();
-    if (f_orig->is_native()) {
-      ret = func(f_orig->f_native);
-    } else {
-      ret = func(f_orig->env, f_orig->binds, f_orig->exprs,
-                 f_orig->last_is_variadic);
-    }
-  } break;
-  case BOOLEAN: {
-    ret = boolean(el->to<Boolean>()->value());
-                }
-                break;
-  case NUMBER: {
-    ret = num(el->to<Number>()->value());
-                }
-                break;
-  case SYMBOL: {
-    ret = sym(el->to<Symbol>()->value());
-                }
-                break;
-  case STRING: {
-    ret = str(el->to<String>()->value());
-                }
-                break;
-  case KEYWORD: {
-    ret = kw(el->to<Keyword>()->value());
-                }
-                break;
-  case EXCEPTION: {
-    ret = exc(el->to<Exception>()->value());
-                }
-                break;
-  case ATOM: {
-    ret = atom(copy(el->to<Atom>()->ref));
-                }
-                break;
-  case LIST: {
-    ret = list();
-    ListP l_orig = el->to<List>();
-    for (unsigned int i=0; i<l_orig->size();i++){
-      ret->to<List>()->append(copy(l_orig->at(i)));
-    }
-    ret->to<List>()->meta = copy(l_orig->meta);
-             }
-             break;
-  case VEC: {
-    ret = vec();
-    VecP v_orig = el->to<Vec>();
-    for (unsigned int i=0; i<v_orig->size();i++){
-      ret->to<Vec>()->append(copy(v_orig->at(i)));
-    }
-    ret->to<Vec>()->meta = copy(v_orig->meta);
-             }
-             break;
-  case DICT: {
-    ret = dict();
-    DictP d_orig = el->to<Dict>();
-    for (const auto& [key, value] : d_orig->elements) {
-      ret->to<Dict>()->elements.insert({key, copy(value)});
-    }
-    ret->to<Dict>()->meta = copy(d_orig->meta);
-             }
-             break;
+    e_orig->freeze();
+    return std::make_shared<Environment>(*e_orig);
+  }
+  case FUNCTION:
+    return el->to<Function>()->clone();
+  case ATOM:
+    return atom(el->to<Atom>()->ref);
+  default:
+    return el;
   }
-  return ret;
 }
 
+// A null meta means none was ever attached
 ElementP get_meta(ElementP el) {
+  ElementP meta;
   switch (el->type) {
     case FUNCTION:
-      return el->to<Function>()->meta;
+      meta = el->to<Function>()->meta;
+      break;
     case LIST:
-      return el->to<List>()->meta;
+      meta = el->to<List>()->meta;
+      break;
     case VEC:
-      return el->to<Vec>()->meta;
+      meta = el->to<Vec>()->meta;
+      break;
     case DICT:
-      return el->to<Dict>()->meta;
+      meta = el->to<Dict>()->meta;
+      break;
     default:
       THROW("only functions, lists, vectors and hash-maps have meta-data");
   }
+  return meta ? meta : nil();
 }
 
 void set_meta(ElementP el, ElementP meta) {
@@ -481,8 +1234,50 @@ void set_meta(ElementP el, ElementP meta) {
       el->to<Dict>()->meta = meta;
       break;
     default:
-      Runtime::get_current().raised = true;
-      Runtime::get_current().exc_value = str("only functions, lists, vectors and hash-maps have meta-data");
+      Runtime::raise(str("only functions, lists, vectors and hash-maps have meta-data"));
   }
 }
+
+void set_span(ListP l, Source_Span span) { l->span = span; }
+
+Source_Span get_span(ElementP el) {
+  if (el->type != LIST)
+    return {};
+  return el->to<List>()->span;
+}
+
+void set_closure_info(const ListP &l, Closure_InfoP info) {
+  l->info.store(std::move(info), std::memory_order_release);
+}
+
+Closure_InfoP get_closure_info(const ListP &l) {
+  return l->info.load(std::memory_order_acquire);
+}
+
+void set_tail_checked(const ListP &l) {
+  l->tail_checked.store(true, std::memory_order_relaxed);
+}
+
+bool is_tail_checked(const ListP &l) {
+  return l->tail_checked.load(std::memory_order_relaxed);
+}
+
+unsigned int source_file(const std::string &name) {
+  if (name.empty())
+    return 0;
+  std::lock_guard<std::shared_mutex> lock(files_mutex);
+  for (unsigned int i = 0; i < source_files.size(); i++)
+    if (source_files[i] == name)
+      return i;
+  source_files.push_back(name);
+  return source_files.size() - 1;
+}
+
+std::string span_str(Source_Span span) {
+  if (span.line == 0)
+    return "unknown";
+  std::shared_lock<std::shared_mutex> lock(files_mutex);
+  return source_files[span.file] + ":" + std::to_string(span.line) + ":" +
+         std::to_string(span.column);
+}
 } // namespace lmlisp
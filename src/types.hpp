@@ -1,6 +1,11 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -18,8 +23,15 @@ enum TYPES {
   VEC,
   DICT,
   ATOM,
-  EXCEPTION,
+  LAZY_SEQ,
+  REDUCED,
+  TRANSIENT,
+  ARRAY,
+  TABLE,
+  STRING_BUILDER,
+  EXCEPTION, // keep last, TYPES_COUNT relies on it
 };
+constexpr unsigned int TYPES_COUNT = EXCEPTION + 1;
 
 class Element;
 class Environment;
@@ -35,6 +47,14 @@ class String;
 class Function;
 class Atom;
 class Exception;
+class Lazy_Seq;
+class Reduced;
+class Transient;
+class Array;
+class Table;
+class String_Builder;
+struct Source_Span;
+struct Closure_Info;
 using ElementP = std::shared_ptr<Element>;
 using EnvironmentP = std::shared_ptr<Environment>;
 using ListP = std::shared_ptr<List>;
@@ -48,6 +68,53 @@ using StringP = std::shared_ptr<String>;
 using FunctionP = std::shared_ptr<Function>;
 using AtomP = std::shared_ptr<Atom>;
 using ExceptionP = std::shared_ptr<Exception>;
+using Lazy_SeqP = std::shared_ptr<Lazy_Seq>;
+using ReducedP = std::shared_ptr<Reduced>;
+using TransientP = std::shared_ptr<Transient>;
+using ArrayP = std::shared_ptr<Array>;
+using TableP = std::shared_ptr<Table>;
+using String_BuilderP = std::shared_ptr<String_Builder>;
+using Closure_InfoP = std::shared_ptr<const Closure_Info>;
+
+// SOURCE SPAN
+// Where a form was read from, kept on the list; forms built at runtime
+// have none.
+struct Source_Span {
+  unsigned int file = 0;
+  unsigned int line = 0; // 0 when the location is unknown
+  unsigned int column = 0;
+};
+
+// TEXT
+// Immutable storage for strings, symbols and keywords. Short texts are kept
+// inline; longer ones live in a shared buffer that copies and substrings
+// point into.
+class Text {
+public:
+  Text(const char *text = "");
+  Text(std::string_view text);
+  Text(std::string text);
+  std::string_view view() const;
+  std::size_t size() const;
+  Text substr(std::size_t pos, std::size_t n) const;
+
+private:
+  static constexpr std::size_t INLINE_SIZE = 16;
+  std::shared_ptr<const std::string> buffer; // null when inline
+  std::size_t offset = 0;
+  std::size_t length = 0;
+  char small[INLINE_SIZE];
+};
+
+// Lets maps keyed by std::string be searched with a std::string_view
+struct Text_Hash {
+  using is_transparent = void;
+  std::size_t operator()(std::string_view text) const {
+    return std::hash<std::string_view>{}(text);
+  }
+};
+template <class T>
+using Text_Map = std::unordered_map<std::string, T, Text_Hash, std::equal_to<>>;
 
 // ELEMENT
 class Element : public std::enable_shared_from_this<Element> {
@@ -70,46 +137,113 @@ public:
 };
 
 // FUNCTION
+// A parameter list of a user function and the body it evaluates
+struct Arity {
+  ListP binds;
+  ElementP exprs;
+  bool last_is_variadic = false;
+};
+
 class Function : public Element {
 public:
   Function(std::function<ElementP(ListP)>);
-  Function(EnvironmentP outer, ListP binds, ElementP exprs,
-           bool last_is_variadic);
+  Function(EnvironmentP outer, std::vector<Arity> arities);
   bool is_native() const;
-  EnvironmentP create_env(EnvironmentP outer, ListP args);
+  FunctionP clone() const;
+  bool accepts(unsigned int n_args) const;
+  // The arity taking n_args arguments; raises and returns null when none
+  // does
+  const Arity *arity(unsigned int n_args);
+  EnvironmentP create_env(const Arity &arity, ListP args);
+  const EnvironmentP &closure() const;
+  const std::vector<Arity> &get_arities() const;
   ElementP apply(ListP args);
-  ElementP get_exprs();
   bool is_macro;
+  // a macro of the runtime's own that only builds forms, which closure
+  // analysis may expand when a fn* is evaluated
+  bool pure_macro = false;
+  // false when nothing in the body can keep the call's frame, which is then
+  // taken from and returned to a pool
+  bool frame_escapes = true;
+  std::string name;
+  Source_Span site;
+  Closure_InfoP info; // of the fn* form that made it
   friend ElementP copy(ElementP el);
   friend ElementP get_meta(ElementP el);
   friend void set_meta(ElementP el, ElementP meta);
 
 private:
-  ListP binds;
-  ElementP exprs;
+  const Arity *find_arity(unsigned int n_args) const;
+  std::vector<Arity> arities;
+  // by_count[n] indexes the arity taking n arguments, -1 for none
+  std::vector<int> by_count;
+  int variadic = -1;
   EnvironmentP env;
-  bool last_is_variadic;
   std::function<ElementP(ListP)> f_native;
   bool native;
-  ElementP meta;
+  ElementP meta; // null until with-meta attaches some
 };
 
 // ENVIRONMENT
+// Copies share the bindings made before the copy as frozen layers; each
+// side writes to its own map on top of them, shadowing the shared values.
+// Past a few layers the ones above the bottom are merged into one.
+struct Frozen_Bindings {
+  Text_Map<ElementP> env;
+  std::shared_ptr<const Frozen_Bindings> below;
+  unsigned int depth = 1; // this layer and those below it
+};
 
 class Environment : public Element {
 public:
   Environment(ElementP outer);
-  ElementP get(std::string key);
-  ElementP find(std::string key);
-  void set(std::string key, ElementP value);
+  ElementP get(std::string_view key);
+  ElementP find(std::string_view key);
+  void set(std::string_view key, ElementP value);
+  ElementP &slot(std::string_view key);
   int get_level() const;
+  Environment *get_outer() const;
+  EnvironmentP root();
+  Environment *global_env();
+  const ElementP *lookup(std::string_view key) const;
+  // Identifies the bindings of a global environment: unique among all
+  // environments, and changed whenever one of them may have moved or a
+  // macro was bound or unbound, so pointers to the bindings and macro
+  // expansions can be cached against it
+  std::uint64_t version() const;
+  // False when key surely isn't in this frame's own map, leaving aside the
+  // frozen layers
+  bool may_hold(std::uint64_t key_bit) const { return key_bits & key_bit; }
+  static std::uint64_t key_bit(std::string_view key);
+  // A call frame from this thread's pool, still holding the keys of the
+  // last function it was used for
+  static EnvironmentP pooled_frame(EnvironmentP outer, const ListP &binds);
+  // Drops env, returning it to the pool if it was the last reference to a
+  // pooled frame or to frames nested in one
+  static void release(EnvironmentP &env);
   friend ElementP copy(ElementP el);
 
+  // def! may still add names to this local frame after closures are made
+  // over it
+  bool open = false;
+
 private:
-  std::unordered_map<std::string, ElementP> env;
-  ListP exprs;
+  void freeze();
+  void changed(); // gives the environment a new version
+  // copies are other environments, which get versions of their own
+  struct Version {
+    Version() = default;
+    Version(const Version &) {}
+    mutable std::atomic<std::uint64_t> value = 0; // 0 until one is asked for
+  };
+  Version version_;
+  std::uint64_t key_bits = 0; // the key_bit of each key in env
+  Text_Map<ElementP> env;
+  std::shared_ptr<const Frozen_Bindings> frozen;
   EnvironmentP outer;
   int level;
+  bool pooled = false;
+  ListP shape; // the binds the keys of a pooled frame were made for
 };
 
 // BOOLEAN
@@ -128,6 +262,10 @@ class List : public Element {
 public:
   List();
   void append(ElementP el);
+  void reserve(unsigned int n);
+  ListP clone() const;
+  // A list with the same elements, read from this one's storage, and meta
+  ListP with_meta(ElementP meta) const;
   ElementP at(unsigned int i) const;
   unsigned int size() const;
   bool at_least(unsigned int n) const;
@@ -135,10 +273,26 @@ public:
   friend ElementP copy(ElementP el);
   friend ElementP get_meta(ElementP el);
   friend void set_meta(ElementP el, ElementP meta);
+  friend void set_span(ListP l, Source_Span span);
+  friend Source_Span get_span(ElementP el);
+  friend void set_closure_info(const ListP &l, Closure_InfoP info);
+  friend Closure_InfoP get_closure_info(const ListP &l);
+  friend void set_tail_checked(const ListP &l);
+  friend bool is_tail_checked(const ListP &l);
 
 private:
+  const std::vector<ElementP> &items() const {
+    return shared ? *shared : elements;
+  }
+  void unshare();
   std::vector<ElementP> elements;
+  // the elements of the collection this one was made from by with_meta,
+  // which they keep alive; copied into elements before any change
+  std::shared_ptr<const std::vector<ElementP>> shared;
   ElementP meta;
+  Source_Span span; // where the reader found it
+  std::atomic<Closure_InfoP> info;
+  std::atomic<bool> tail_checked = false;
 };
 
 // VEC
@@ -146,6 +300,11 @@ class Vec : public Element {
 public:
   Vec();
   void append(ElementP el);
+  void reserve(unsigned int n);
+  void set(unsigned int i, ElementP el);
+  void pop();
+  VecP clone() const;
+  VecP with_meta(ElementP meta) const;
   ElementP at(unsigned int i) const;
   unsigned int size() const;
   bool at_least(unsigned int n) const;
@@ -156,24 +315,49 @@ public:
   friend void set_meta(ElementP el, ElementP meta);
 
 private:
+  const std::vector<ElementP> &items() const {
+    return shared ? *shared : elements;
+  }
+  void unshare();
   std::vector<ElementP> elements;
+  std::shared_ptr<const std::vector<ElementP>> shared; // as in List
   ElementP meta;
 };
 
 // DICT
+// Keys are strings or keywords. Keywords are interned, so they hash and
+// compare by identity; strings by contents.
+struct Key_Hash {
+  std::size_t operator()(const ElementP &key) const;
+};
+struct Key_Equal {
+  bool operator()(const ElementP &a, const ElementP &b) const;
+};
+
 class Dict : public Element {
 public:
   Dict();
   void append(ElementP key, ElementP value);
+  void remove(ElementP key);
+  void reserve(unsigned int n);
+  unsigned int size() const;
+  DictP clone() const;
+  DictP with_meta(ElementP meta) const;
   ElementP get(ElementP key);
   ElementP contains(ElementP key);
   ListP keys() const;
+  void for_each(const std::function<void(ElementP, ElementP)> &f) const;
   friend ElementP copy(ElementP el);
   friend ElementP get_meta(ElementP el);
   friend void set_meta(ElementP el, ElementP meta);
 
 private:
-  std::unordered_map<std::string, ElementP> elements;
+  using Map = std::unordered_map<ElementP, ElementP, Key_Hash, Key_Equal>;
+  static bool is_key(const ElementP &key);
+  const Map &items() const { return shared ? *shared : elements; }
+  void unshare();
+  Map elements;
+  std::shared_ptr<const Map> shared; // as in List
   ElementP meta;
 };
 
@@ -204,37 +388,53 @@ private:
 // SYMBOL
 class Symbol : public Element {
 public:
-  Symbol(std::string symbol);
-  std::string value() const;
+  Symbol(Text symbol);
+  std::string_view value() const;
 
   friend ElementP copy(ElementP el);
 
 private:
-  std::string data;
+  Text data;
 };
 
 // KEYWORD
+// Keywords are interned by kw(): there is one Keyword per name.
 class Keyword : public Element {
 public:
-  Keyword(std::string keyword);
-  std::string value() const;
+  Keyword(Text keyword);
+  std::string_view value() const;
+  std::size_t hash() const;
 
   friend ElementP copy(ElementP el);
 
 private:
-  std::string data;
+  Text data;
+  std::size_t name_hash;
 };
 
 // STRING
+// A string is either flat or the concatenation of two strings, a rope,
+// which is flattened the first time its contents are read.
 class String : public Element {
 public:
-  String(std::string string);
-  std::string value() const;
+  String(Text string);
+  String(StringP left, StringP right);
+  ~String();
+  std::string_view value() const;
+  const Text &text() const;
+  std::size_t size() const; // doesn't flatten
 
   friend ElementP copy(ElementP el);
 
 private:
-  std::string data;
+  struct Rope {
+    StringP left, right;
+  };
+  void flatten() const;
+  mutable Text data;
+  mutable std::unique_ptr<Rope> rope;
+  mutable std::atomic<bool> flat;
+  std::size_t length;
 };
 
 // ATOM
@@ -247,6 +447,94 @@ public:
   friend ElementP copy(ElementP el);
 };
 
+// REDUCED
+// Wraps the accumulator returned by a reducing function to stop the
+// reduction early.
+
+class Reduced : public Element {
+public:
+  Reduced(ElementP el);
+  ElementP ref;
+
+  friend ElementP copy(ElementP el);
+};
+
+// TRANSIENT
+// A vector or dict that can be edited in place by the thread that made it,
+// until persistent! hands the collection back.
+
+class Transient : public Element {
+public:
+  Transient(ElementP coll);
+  ElementP coll; // null once persistent! was called
+  std::thread::id owner;
+
+  friend ElementP copy(ElementP el);
+};
+
+// ARRAY
+// Numbers stored contiguously, as doubles or as 64 bit integers, for the
+// numeric kernels. Only the vector of the array's kind is used.
+
+class Array : public Element {
+public:
+  enum Kind { DOUBLE, LONG };
+  Array(Kind kind, std::size_t size = 0);
+  Kind kind;
+  std::vector<double> doubles;
+  std::vector<std::int64_t> longs;
+  std::size_t size() const;
+  double double_at(std::size_t i) const;
+  // The number at i; raises when it doesn't fit in a Number
+  ElementP at(std::size_t i) const;
+
+  friend ElementP copy(ElementP el);
+};
+
+// TABLE
+// Rows stored column by column. Numeric columns are arrays; string and
+// keyword columns hold, for each row, a code into a dictionary of their
+// distinct values. Columns are immutable and shared by the tables derived
+// from each other, and a table may only see the rows in its selection.
+
+struct Column {
+  enum Kind { NUMERIC, STRING, KEYWORD };
+  Kind kind;
+  ArrayP numbers; // NUMERIC
+  std::vector<std::string> dictionary;
+  std::vector<std::uint32_t> codes;
+  std::size_t size() const;
+  ElementP at(std::size_t row) const;
+};
+using ColumnP = std::shared_ptr<const Column>;
+using SelectionP = std::shared_ptr<const std::vector<std::uint32_t>>;
+
+class Table : public Element {
+public:
+  Table();
+  std::vector<std::string> names;
+  std::vector<ColumnP> columns;
+  SelectionP selection; // null when every row is seen
+  std::size_t rows() const;
+  std::size_t row(std::size_t i) const; // column row of the i-th row seen
+  int find(const std::string &name) const;
+
+  friend ElementP copy(ElementP el);
+};
+
+// STRING BUILDER
+// A mutable buffer to build strings in, usable only by the thread that
+// created it.
+
+class String_Builder : public Element {
+public:
+  String_Builder();
+  std::string buffer;
+  std::thread::id owner;
+
+  friend ElementP copy(ElementP el);
+};
+
 // EXCEPTION
 
 class Exception : public Element {
@@ -260,27 +548,97 @@ private:
   std::string msg;
 };
 
+// LAZY SEQUENCE
+// A sequence computed on demand. The body runs once, on first access, and
+// yields the sequence this one stands for (nil, a list, a vector or another
+// lazy sequence); the result is cached and the body released. A realized
+// cell holds a chunk of values, a range of a list or vector shared with
+// other cells, followed by the cell for the rest of the sequence.
+class Lazy_Seq : public Element {
+public:
+  Lazy_Seq(std::function<ElementP()> body);
+  Lazy_Seq(ElementP chunk, unsigned int start, unsigned int end,
+           Lazy_SeqP more);
+  ~Lazy_Seq();
+  bool empty();
+  ElementP first();
+  ElementP rest();
+  unsigned int chunk_size();
+  ElementP chunk_at(unsigned int i);
+  Lazy_SeqP chunk_more();
+  Lazy_SeqP slice(unsigned int from, unsigned int to, Lazy_SeqP more);
+  friend ElementP copy(ElementP el);
+
+private:
+  void realize();
+  std::function<ElementP()> body;
+  bool realized;
+  ElementP chunk; // LIST or VEC, null when the sequence is empty
+  unsigned int start;
+  unsigned int end;
+  Lazy_SeqP more; // null at the end of the sequence
+};
+
 // POINTER CONSTRUCTORS
 ElementP nil();
 ListP list();
 VecP vec();
 DictP dict();
 BooleanP boolean(bool value);
+#ifdef _LM_WITH_FLOAT
 NumberP num(float number);
-SymbolP sym(std::string symbol);
-KeywordP kw(std::string keyword);
-StringP str(std::string string);
+#else
+NumberP num(int number);
+#endif
+// Whether a Number holds x without wrapping or truncating it: integer
+// builds hold whole numbers in the range of int, float builds any value
+// in the range of float
+bool fits_number(double x);
+bool fits_number(std::int64_t x);
+// The Number of x; raises and returns nil when it doesn't fit. Integer
+// builds round a double to the nearest integer, halves away from zero,
+// which is how the double arrays, tables and kernels read back.
+ElementP num_checked(double x);
+ElementP num_checked(std::int64_t x);
+SymbolP sym(Text symbol);
+KeywordP kw(Text keyword);
+StringP str(Text string);
+StringP str_concat(StringP left, StringP right);
 FunctionP func(std::function<ElementP(ListP)> f);
 FunctionP func(EnvironmentP outer, ListP binds, ElementP exprs,
                bool last_is_variadic = false);
+FunctionP func(EnvironmentP outer, std::vector<Arity> arities);
 EnvironmentP environment(EnvironmentP outer);
 AtomP atom(ElementP ref);
+ReducedP reduced(ElementP ref);
+TransientP transient(ElementP coll);
+ArrayP array(Array::Kind kind, std::size_t size = 0);
+TableP table();
+String_BuilderP string_builder();
 ExceptionP exc(std::string msg);
+Lazy_SeqP lazy_seq(std::function<ElementP()> body);
+Lazy_SeqP lazy_seq(ElementP chunk, unsigned int start, unsigned int end,
+                   Lazy_SeqP more);
+Lazy_SeqP as_lazy_seq(ElementP coll);
 
 // UTILITY FUNCTIONS
 
+// Values are immutable and shared as they are; functions are cloned,
+// atoms get their own cell and environments are copied on write
 ElementP copy(ElementP el);
+int order(ElementP a, ElementP b);
 inline bool is_nil(ElementP el);
 ElementP get_meta(ElementP el);
 void set_meta(ElementP el, ElementP meta);
+void set_span(ListP l, Source_Span span);
+Source_Span get_span(ElementP el);
+// What the evaluator worked out about a fn* form, kept on the form
+void set_closure_info(const ListP &l, Closure_InfoP info);
+Closure_InfoP get_closure_info(const ListP &l);
+// Marks a loop form whose recurs were all found in tail position, so the
+// macros in its body are expanded for the check only once
+void set_tail_checked(const ListP &l);
+bool is_tail_checked(const ListP &l);
+unsigned int source_file(const std::string &name);
+std::string span_str(Source_Span span);
 } // namespace lmlisp